@@ -0,0 +1,234 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <omp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include "blur.h"
+#include "blurd.h"
+
+
+// ============================================================================================================================================================
+// Client of the blur daemon (see blurd.h)
+//
+//   ./blur_client [socket-path] file  [kernel-type] [kernel-size] {additional-kernel-param} [input-file] [output-file] {repeats}
+//   ./blur_client [socket-path] memfd [kernel-type] [kernel-size] {additional-kernel-param} [input-file] [output-file] {repeats}
+//   ./blur_client [socket-path] stats
+//   ./blur_client [socket-path] stop
+//
+// With "file" the daemon reads and writes the images itself; with "memfd" the client reads
+// the (grey) input, hands it to the daemon in a shared memory buffer and writes the result.
+// The request is sent repeats times (1 by default), to measure the rate of the daemon.
+// The additional kernel parameter (kfactor) is required for kernel-type 1.
+//
+// ============================================================================================================================================================
+
+
+int send_request( const char *socket_name, blurd_request *req, int fd, blurd_reply *rep )
+/*
+ * one connection per request: sends req, with the descriptor fd if not negative, and waits
+ * for the reply. Returns 0 on success.
+ */
+{
+  int conn = socket( AF_UNIX, SOCK_STREAM, 0 );
+  struct sockaddr_un addr;
+  memset( &addr, 0, sizeof(addr) );
+  addr.sun_family = AF_UNIX;
+  strncpy( addr.sun_path, socket_name, sizeof(addr.sun_path)-1 );
+  if (conn < 0 || connect( conn, (struct sockaddr*)&addr, sizeof(addr) ) != 0){
+    perror( socket_name );
+    return -1;
+  }
+
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec  iov = { req, sizeof(*req) };
+  struct msghdr msg;
+  memset( &msg, 0, sizeof(msg) );
+  msg.msg_iov    = &iov;
+  msg.msg_iovlen = 1;
+  if (fd >= 0){
+    memset( control, 0, sizeof(control) );
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy( CMSG_DATA(cmsg), &fd, sizeof(int) );
+  }
+  int status = -1;
+  if (sendmsg( conn, &msg, 0 ) == sizeof(*req)){
+    size_t got = 0;
+    ssize_t more;
+    while (got < sizeof(*rep) && (more = read( conn, (char*)rep + got, sizeof(*rep) - got )) > 0)
+      got += more;
+    if (got == sizeof(*rep))
+      status = 0;
+  }
+  close(conn);
+  return status;
+}
+
+
+int read_pgm( const char *name, int *maxval, int *xsize, int *ysize, unsigned char **pixels )
+/*
+ * reads a binary PGM image, leaving its pixels in the byte order of the file
+ */
+{
+  FILE *file = fopen(name, "r");
+  char  magic[3];
+  int   c;
+  if (file == NULL || fscanf(file, "%2s", magic) != 1 || strcmp(magic, "P5") != 0)
+    return -1;
+  // skip white space and comments
+  while ((c = fgetc(file)) != EOF){
+    if (c == '#') { while ((c = fgetc(file)) != EOF && c != '\n'); }
+    else if (c > ' ') { ungetc(c, file); break; }
+  }
+  if (fscanf(file, "%d %d %d", xsize, ysize, maxval) != 3)
+    return -1;
+  fgetc(file);
+  size_t size = (size_t)*xsize * *ysize * (1 + (*maxval > 255));
+  *pixels = (unsigned char*)malloc( size );
+  size_t got = fread( *pixels, 1, size, file );
+  fclose(file);
+  return (got == size)? 0 : -1;
+}
+
+
+int main( int argc, char **argv )
+{
+  if (argc < 3){
+    printf("usage: %s [socket-path] file|memfd|stats|stop ...\n", argv[0]);
+    return 0;
+  }
+  const char *socket_name = argv[1];
+  const char *ops[4] = {"file", "memfd", "stats", "stop"};
+  blurd_request req;
+  blurd_reply   rep;
+  memset( &req, 0, sizeof(req) );
+  req.op = -1;
+  for (int k=0; k<4; k++)
+    if (strcmp(argv[2], ops[k]) == 0) req.op = k;
+  if (req.op < 0){
+    printf("Unknown request %s\n", argv[2]);
+    return 0;
+  }
+
+  if (req.op == BLURD_STATS || req.op == BLURD_STOP){
+    if (send_request( socket_name, &req, -1, &rep ) != 0)
+      return 1;
+    printf("jobs done %ld, rejected %ld, queued %d, cached plans %d\n", rep.done, rep.rejected, rep.queue_depth, rep.cached_plans);
+    printf("latency (ms): p50 %.3f  p90 %.3f  p99 %.3f\n", 1e3*rep.latency_p50, 1e3*rep.latency_p90, 1e3*rep.latency_p99);
+    return 0;
+  }
+
+  // ---------------------------------------------
+  // kernel and images, as on the command line of the blur codes
+  int arg_num = 3;
+  if (argc < arg_num+4){
+    printf("Missing parameters\n");
+    return 0;
+  }
+  req.ktype   = atoi(argv[arg_num++]);
+  req.ksize   = atoi(argv[arg_num++]);
+  req.kfactor = 0.2;
+  if (req.ktype == 1){
+    if (argc < arg_num+3){
+      printf("Missing parameters\n");
+      return 0;
+    }
+    req.kfactor = atof(argv[arg_num++]);
+  }
+  const char *input_name  = argv[arg_num++];
+  const char *output_name = argv[arg_num++];
+  int repeats = (argc > arg_num)? atoi(argv[arg_num]) : 1;
+  if (repeats < 1) repeats = 1;
+
+  int fd = -1, maxval = 0;
+  size_t bytes = 0;
+  unsigned char *buf = NULL;
+  if (req.op == BLURD_FILE){
+    // the daemon opens the files: relative paths would be relative to its own directory
+    char *path = realpath( input_name, NULL );
+    if (path == NULL){
+      perror( input_name );
+      return 1;
+    }
+    strncpy( req.input, path, BLURD_PATH-1 );
+    free(path);
+    if (output_name[0] == '/')
+      strncpy( req.output, output_name, BLURD_PATH-1 );
+    else {
+      if (getcwd( req.output, BLURD_PATH ) == NULL)
+        return 1;
+      strncat( req.output, "/", BLURD_PATH-1-strlen(req.output) );
+      strncat( req.output, output_name, BLURD_PATH-1-strlen(req.output) );
+    }
+  }
+  else {
+    // the input pixels, in the host byte order, followed by room for the output
+    unsigned char *pixels;
+    if (read_pgm( input_name, &maxval, &req.xsize, &req.ysize, &pixels ) != 0){
+      printf("Could not read %s (only binary PGM images in this mode)\n", input_name);
+      return 1;
+    }
+    req.pixel_type = (maxval > 255)? BLUR_U16 : BLUR_U8;
+    bytes = (size_t)req.xsize*req.ysize*req.pixel_type;
+    fd  = memfd_create( "blur", 0 );
+    if (fd < 0 || ftruncate( fd, 2*bytes ) != 0){
+      perror("memfd");
+      return 1;
+    }
+    buf = (unsigned char*)mmap( NULL, 2*bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if (req.pixel_type == BLUR_U16)
+      for (size_t i=0; i<bytes/2; i++)
+        ((unsigned short int*)buf)[i] = (pixels[2*i] << 8) | pixels[2*i+1];
+    else
+      memcpy( buf, pixels, bytes );
+    free(pixels);
+  }
+
+  // ---------------------------------------------
+  // requests, one after the other
+  double start = omp_get_wtime();
+  double wait = 0, run = 0;
+  for (int r=0; r<repeats; r++){
+    if (send_request( socket_name, &req, fd, &rep ) != 0)
+      return 1;
+    if (rep.status != BLURD_OK){
+      const char *errors[5] = {"ok", "invalid request", "queue full", "i/o error", "out of memory"};
+      printf("Request refused: %s\n", errors[rep.status]);
+      return 1;
+    }
+    wait += rep.wait;
+    run  += rep.run;
+  }
+  double elapsed = omp_get_wtime() - start;
+  printf("%d requests in %f s (%.1f per second): mean wait %.3f ms, mean run %.3f ms\n", repeats, elapsed, repeats/elapsed, 1e3*wait/repeats, 1e3*run/repeats);
+
+  if (req.op == BLURD_MEMFD){
+    FILE *out = fopen(output_name, "w");
+    if (out == NULL){
+      perror( output_name );
+      return 1;
+    }
+    fprintf(out, "P5\n# generated by\n# M. Danese \n%d %d\n%d\n", req.xsize, req.ysize, maxval);
+    unsigned char *res = buf + bytes;
+    if (req.pixel_type == BLUR_U16)
+      for (size_t i=0; i<bytes/2; i++){
+        unsigned short int v = ((unsigned short int*)res)[i];
+        fputc( v >> 8, out );
+        fputc( v & 0xff, out );
+      }
+    else
+      fwrite( res, 1, bytes, out );
+    fclose(out);
+    munmap( buf, 2*bytes );
+    close(fd);
+  }
+  return 0;
+}
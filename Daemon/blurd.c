@@ -0,0 +1,639 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h> 
+#include <math.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <omp.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include "blur.h"
+#include "blurd.h"
+
+#define NTHS        0      // threads of the blur, 0 = the OpenMP default
+#define QUEUE_SIZE  64     // jobs waiting at most
+#define PLAN_CACHE  16     // plans kept ready
+#define LAT_WINDOW  1024   // jobs over which the latency percentiles are computed
+#define REQUEST_TIMEOUT 2  // seconds a connection has to send its request
+
+
+// ============================================================================================================================================================
+// Blur daemon: a long-lived process serving blur requests over a Unix domain socket 
+// (protocol in blurd.h), built on the library in lib/
+//
+//   ./blurd [socket-path] {nths} {queue-size}
+//
+// The process start-up, the construction of the kernel and of the plan and the creation of
+// the threads are paid once instead of at every blur:
+//
+//   * the main thread accepts the connections and reads the requests, which are queued in a
+//     bounded queue (a request finding it full is refused with BLURD_EBUSY), while statistics
+//     requests are answered at once; a connection that does not send its request within 
+//     REQUEST_TIMEOUT seconds is dropped, so that a slow client cannot hold up the others
+//   * a single blur thread takes the jobs in order and runs them with blur_execute, whose 
+//     OpenMP team stays alive between jobs, as it always starts from the same thread
+//   * plans, which hold the built kernel, are cached by (ktype, ksize, kfactor, image size, 
+//     pixel type) and the least recently used one is dropped when the cache is full
+//
+// 1. utilities for managinf pgm files
+//
+//  * write_pgm_image
+//  * read_pgm_image
+//  * deinterleave_image
+//  * interleave_image
+//
+// 2. jobs
+//
+//  * get_plan
+//  * run_file
+//  * run_memfd
+//  * blur_thread
+//
+// 3. requests
+//
+//  * fill_stats
+//  * read_request
+//
+//  WRITE 
+
+void write_pgm_image( void *image, int maxval, int xsize, int ysize, int nch, const char *image_name)
+/*
+ * image        : a pointer to the memory region that contains the image
+ * maxval       : either 255 or 65536
+ * xsize, ysize : x and y dimensions of the image
+ * nch          : number of channels, 1 (P5, grey) or 3 (P6, RGB)
+ * image_name   : the name of the file to be written
+ *
+ */
+{
+  FILE* image_file; 
+  image_file = fopen(image_name, "w"); 
+  
+  // Writing header
+  // The header's format is as follows, all in ASCII.
+  // "whitespace" is either a blank or a TAB or a CF or a LF
+  // - The Magic Number (see below the magic numbers)
+  // - the image's width
+  // - the height
+  // - a white space
+  // - the image's height
+  // - a whitespace
+  // - the maximum color value, which must be between 0 and 65535
+  //
+  //
+
+  int color_depth = 1 + ( maxval > 255 );
+
+  fprintf(image_file, "P%d\n# generated by\n# M. Danese \n%d %d\n%d\n", (nch==3)? 6 : 5, xsize, ysize, maxval);
+  
+  // Writing file
+  fwrite( image, 1, (size_t)xsize*ysize*color_depth*nch, image_file);  
+
+  fclose(image_file); 
+  return ;
+
+  /* ---------------------------------------------------------------
+
+     TYPE    MAGIC NUM     EXTENSION   COLOR RANGE
+           ASCII  BINARY
+
+     PBM   P1     P4       .pbm        [0-1]
+     PGM   P2     P5       .pgm        [0-255]
+     PPM   P3     P6       .ppm        [0-2^16[
+  
+  ------------------------------------------------------------------ */
+}
+
+
+// ============================================================================================================================================================
+
+
+//                               READ PGM
+
+
+void read_pgm_image( void **image, int *maxval, int *xsize, int *ysize, int *nch, const char *image_name)
+/*
+ * image        : a pointer to the pointer that will contain the image
+ * maxval       : a pointer to the int that will store the maximum intensity in the image
+ * xsize, ysize : pointers to the x and y sizes
+ * nch          : a pointer to the number of channels, 1 for P5 and 3 for P6 images
+ * image_name   : the name of the file to be read
+ *
+ */
+{
+  FILE* image_file; 
+  image_file = fopen(image_name, "r"); 
+
+  *image = NULL;
+  *xsize = *ysize = *maxval = 0;
+  if ( image_file == NULL )
+    {
+      *maxval = -1;
+      return;
+    }
+  
+  char    MagicN[3];
+  char   *line = NULL;
+  size_t  k, n = 0;
+
+    
+  /* --------------------------------------------------------------- */
+
+
+  // get the Magic Number - first element
+  k = fscanf(image_file, "%2s%*c", MagicN );
+  *nch = (strcmp(MagicN, "P6") == 0)? 3 : 1;
+
+
+    
+  /* --------------------------------------------------------------- */
+
+
+  // skip all the comments
+  k = getline( &line, &n, image_file);
+  while ( (k > 0) && (line[0]=='#') )
+    k = getline( &line, &n, image_file);
+
+    
+  /* --------------------------------------------------------------- */
+
+
+  if (k > 0)
+    {
+      k = sscanf(line, "%d%*c%d%*c%d%*c", xsize, ysize, maxval);
+      if ( k < 3 )
+	if(fscanf(image_file, "%d%*c", maxval)!=1){
+	  printf("no maxval was provided\n");
+	  *maxval = -1;
+	  fclose(image_file);
+	  free( line );
+	  return;
+	}
+    }
+  // in the case I am givning some bad input
+  else
+    {
+      *maxval = -1;         // this is the signal that there was an I/O error
+			    // while reading the image header
+      fclose(image_file);
+      free( line );
+      return;
+    }
+  free( line );
+  
+
+    
+  /* --------------------------------------------------------------- */
+
+
+  int color_depth = 1 + ( *maxval > 255 );
+  size_t size = (size_t)*xsize * *ysize * color_depth * *nch;
+  
+  if ( (*image = (char*)malloc( size )) == NULL )
+    {
+      fclose(image_file);
+      *maxval = -2;         // this is the signal that memory was insufficient
+      *xsize  = 0;
+      *ysize  = 0;
+      return;
+    }
+  
+  if ( fread( *image, 1, size, image_file) != size )
+    {
+      free( *image );
+      *image  = NULL;
+      *maxval = -3;         // this is the signal that there was an i/o error
+      *xsize  = 0;
+      *ysize  = 0;
+    }  
+
+  fclose(image_file);
+  return;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               PLANAR LAYOUT
+
+
+/*
+  Pixels are stored in the files as 1 or 2 big endian bytes per sample (maxval > 255), and 
+  the 3 samples of a P6 pixel are interleaved (RGBRGB...). The blur works instead on planar
+  images of unsigned short in the host order: channel c of pixel idx is at c*xsize*ysize+idx, 
+  so that every channel is a contiguous grey image sharing the indices of the others.
+*/
+
+
+void deinterleave_image( const unsigned char *raw, unsigned short int *planar, int xsize, int ysize, int maxval, int nch )
+/*
+ * raw    : the pixels as read from the file
+ * planar : nch planes of xsize*ysize samples
+ */
+{
+  size_t plane = (size_t)xsize*ysize;
+  if ( maxval > 255 )
+    for ( size_t i = 0; i < plane; i++ )
+      for ( int c = 0; c < nch; c++ )
+        planar[c*plane+i] = (raw[2*(i*nch+c)] << 8) | raw[2*(i*nch+c)+1];
+  else
+    for ( size_t i = 0; i < plane; i++ )
+      for ( int c = 0; c < nch; c++ )
+        planar[c*plane+i] = raw[i*nch+c];
+  return;
+}
+
+
+void interleave_image( const unsigned short int *planar, unsigned char *raw, int xsize, int ysize, int maxval, int nch )
+/*
+ * the inverse of deinterleave_image
+ */
+{
+  size_t plane = (size_t)xsize*ysize;
+  if ( maxval > 255 )
+    for ( size_t i = 0; i < plane; i++ )
+      for ( int c = 0; c < nch; c++ ){
+        raw[2*(i*nch+c)]   = planar[c*plane+i] >> 8;
+        raw[2*(i*nch+c)+1] = planar[c*plane+i] & 0xff;
+      }
+  else
+    for ( size_t i = 0; i < plane; i++ )
+      for ( int c = 0; c < nch; c++ )
+        raw[i*nch+c] = planar[c*plane+i];
+  return;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               JOBS
+
+
+typedef struct {
+  blurd_request req;
+  int    conn;           // connection on which the reply is sent
+  int    fd;             // shared memory buffer of BLURD_MEMFD, -1 otherwise
+  double arrival;        // seconds, as given by omp_get_wtime
+} job;
+
+typedef struct {
+  int        ktype, ksize;
+  float      kfactor;
+  int        xsize, ysize, pixel_type;
+  blur_plan *plan;
+  long       last_use;
+} cached_plan;
+
+// state shared by the main and the blur thread, protected by lock
+pthread_mutex_t lock     = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  not_empty = PTHREAD_COND_INITIALIZER;
+job            *queue;
+int             queue_size, queue_first = 0, queue_len = 0;
+int             stopping = 0;
+long            done = 0, rejected = 0;
+int             ncached = 0;
+double          latency[LAT_WINDOW];      // of the last jobs, in a circular buffer
+
+// owned by the blur thread
+cached_plan     cache[PLAN_CACHE];
+int             nths = NTHS;
+
+
+blur_plan * get_plan( int ktype, int ksize, float kfactor, int xsize, int ysize, int pixel_type )
+/*
+ * returns the cached plan for these parameters, creating it (and possibly dropping the least
+ * recently used one) if needed; NULL if the parameters are not valid
+ */
+{
+  static long use = 0;
+  int lru = 0;
+  use++;
+  for (int i=0; i<ncached; i++){
+    cached_plan *c = &cache[i];
+    if (c->ktype == ktype && c->ksize == ksize && (ktype != BLUR_WEIGHTED || c->kfactor == kfactor) && 
+        c->xsize == xsize && c->ysize == ysize && c->pixel_type == pixel_type){
+      c->last_use = use;
+      return c->plan;
+    }
+    if (c->last_use < cache[lru].last_use) lru = i;
+  }
+
+  blur_plan *plan = blur_plan_create( ktype, ksize, kfactor, xsize, ysize, pixel_type, nths );
+  if (plan == NULL)
+    return NULL;
+  int slot = lru;
+  if (ncached < PLAN_CACHE){
+    pthread_mutex_lock( &lock );
+    slot = ncached++;
+    pthread_mutex_unlock( &lock );
+  }
+  else
+    blur_plan_destroy( cache[slot].plan );
+  cache[slot] = (cached_plan){ktype, ksize, kfactor, xsize, ysize, pixel_type, plan, use};
+  return plan;
+}
+
+
+int run_file( blurd_request *req )
+/*
+ * grey and colour images alike are blurred one plane at a time, as 16-bit pixels
+ */
+{
+  void *raw;
+  int maxval, xsize, ysize, nch;
+  read_pgm_image( &raw, &maxval, &xsize, &ysize, &nch, req->input );
+  if (maxval == -2)
+    return BLURD_ENOMEM;
+  if (maxval <= 0)
+    return BLURD_EIO;
+
+  blur_plan *plan = get_plan( req->ktype, req->ksize, req->kfactor, xsize, ysize, BLUR_U16 );
+  if (plan == NULL){
+    free(raw);
+    return BLURD_EINVAL;
+  }
+  size_t plane = (size_t)xsize*ysize;
+  unsigned short int *in  = (unsigned short int*)malloc( plane*nch*sizeof(short int) );
+  unsigned short int *out = (unsigned short int*)malloc( plane*nch*sizeof(short int) );
+  if (in == NULL || out == NULL){
+    free(in);
+    free(out);
+    free(raw);
+    return BLURD_ENOMEM;
+  }
+  deinterleave_image( raw, in, xsize, ysize, maxval, nch );
+  for (int c=0; c<nch; c++)
+    blur_execute( plan, in + c*plane, xsize, out + c*plane, xsize );
+  interleave_image( out, raw, xsize, ysize, maxval, nch );
+
+  int status = BLURD_OK;
+  FILE *test = fopen(req->output, "w");
+  if (test == NULL)
+    status = BLURD_EIO;
+  else {
+    fclose(test);
+    write_pgm_image( raw, maxval, xsize, ysize, nch, req->output );
+  }
+  free(in);
+  free(out);
+  free(raw);
+  return status;
+}
+
+
+int run_memfd( blurd_request *req, int fd )
+{
+  if (fd < 0 || req->xsize < 1 || req->ysize < 1 || (req->pixel_type != BLUR_U8 && req->pixel_type != BLUR_U16))
+    return BLURD_EINVAL;
+  size_t bytes = (size_t)req->xsize*req->ysize*req->pixel_type;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < 2*bytes)
+    return BLURD_EINVAL;
+
+  blur_plan *plan = get_plan( req->ktype, req->ksize, req->kfactor, req->xsize, req->ysize, req->pixel_type );
+  if (plan == NULL)
+    return BLURD_EINVAL;
+  unsigned char *buf = (unsigned char*)mmap( NULL, 2*bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if (buf == MAP_FAILED)
+    return BLURD_EIO;
+  blur_execute( plan, buf, req->xsize, buf + bytes, req->xsize );
+  munmap( buf, 2*bytes );
+  return BLURD_OK;
+}
+
+
+void fill_stats( blurd_reply *rep );
+
+void * blur_thread( void *arg )
+/*
+ * takes the jobs from the queue, in order, until the daemon stops and the queue is empty
+ */
+{
+  (void)arg;
+  for (;;){
+    pthread_mutex_lock( &lock );
+    while (queue_len == 0 && !stopping)
+      pthread_cond_wait( &not_empty, &lock );
+    if (queue_len == 0){
+      pthread_mutex_unlock( &lock );
+      break;
+    }
+    job j = queue[queue_first];
+    pthread_mutex_unlock( &lock );
+
+    blurd_reply rep;
+    memset( &rep, 0, sizeof(rep) );
+    double start = omp_get_wtime();
+    if (j.req.op == BLURD_FILE)
+      rep.status = run_file( &j.req );
+    else
+      rep.status = run_memfd( &j.req, j.fd );
+    double end = omp_get_wtime();
+    if (j.fd >= 0)
+      close(j.fd);
+
+    // the job leaves the queue only now, so that the depth counts the running one too
+    pthread_mutex_lock( &lock );
+    queue_first = (queue_first+1)%queue_size;
+    queue_len--;
+    latency[done%LAT_WINDOW] = end - j.arrival;
+    done++;
+    pthread_mutex_unlock( &lock );
+
+    fill_stats( &rep );
+    rep.wait = start - j.arrival;
+    rep.run  = end - start;
+    if (write( j.conn, &rep, sizeof(rep) ) != sizeof(rep))
+      perror("reply");
+    close(j.conn);
+  }
+  for (int i=0; i<ncached; i++)
+    blur_plan_destroy( cache[i].plan );
+  return NULL;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               REQUESTS
+
+
+int compare_doubles( const void *a, const void *b )
+{
+  double d = *(const double*)a - *(const double*)b;
+  return (d > 0) - (d < 0);
+}
+
+
+double percentile( const double *sorted, int n, double p )
+/*
+ * nearest rank: the smallest of the n sorted values with at least p*n of them up to it, so
+ * that e.g. the 99th percentile of 10 values is the largest one
+ */
+{
+  int i = (int)ceil(p*n - 1e-9) - 1;
+  return sorted[(i < 0)? 0 : ((i > n-1)? n-1 : i)];
+}
+
+
+void fill_stats( blurd_reply *rep )
+{
+  double lat[LAT_WINDOW];
+  pthread_mutex_lock( &lock );
+  int n = (done < LAT_WINDOW)? done : LAT_WINDOW;
+  memcpy( lat, latency, n*sizeof(double) );
+  rep->queue_depth  = queue_len;
+  rep->done         = done;
+  rep->rejected     = rejected;
+  rep->cached_plans = ncached;
+  pthread_mutex_unlock( &lock );
+
+  if (n > 0){
+    qsort( lat, n, sizeof(double), compare_doubles );
+    rep->latency_p50 = percentile( lat, n, 0.50 );
+    rep->latency_p90 = percentile( lat, n, 0.90 );
+    rep->latency_p99 = percentile( lat, n, 0.99 );
+  }
+}
+
+
+int read_request( int conn, blurd_request *req, int *fd )
+/*
+ * reads a request and the descriptor that may come with it (-1 if none); returns 0 on success
+ */
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec  iov = { req, sizeof(*req) };
+  struct msghdr msg;
+  memset( &msg, 0, sizeof(msg) );
+  msg.msg_iov        = &iov;
+  msg.msg_iovlen     = 1;
+  msg.msg_control    = control;
+  msg.msg_controllen = sizeof(control);
+
+  *fd = -1;
+  ssize_t got = recvmsg( conn, &msg, 0 );
+  if (got <= 0)
+    return -1;
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR( &msg );
+  if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    memcpy( fd, CMSG_DATA(cmsg), sizeof(int) );
+
+  // the rest of the request, if it arrived in pieces
+  while (got < (ssize_t)sizeof(*req)){
+    ssize_t more = read( conn, (char*)req + got, sizeof(*req) - got );
+    if (more <= 0){
+      if (*fd >= 0) close(*fd);
+      return -1;
+    }
+    got += more;
+  }
+  req->input[BLURD_PATH-1] = req->output[BLURD_PATH-1] = '\0';
+  return 0;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               MAIN
+
+
+int main( int argc, char **argv )
+{
+  const char *socket_name = (argc > 1)? argv[1] : "/tmp/blurd.sock";
+  if (argc > 2) nths       = atoi(argv[2]);
+  queue_size = (argc > 3)? atoi(argv[3]) : QUEUE_SIZE;
+  if (nths < 0 || queue_size < 1){
+    printf("Invalid number of threads or queue size\n");
+    return 0;
+  }
+  queue = (job*)malloc( queue_size*sizeof(job) );
+  signal( SIGPIPE, SIG_IGN );   // a client leaving early must not stop the daemon
+
+  int server = socket( AF_UNIX, SOCK_STREAM, 0 );
+  struct sockaddr_un addr;
+  memset( &addr, 0, sizeof(addr) );
+  addr.sun_family = AF_UNIX;
+  strncpy( addr.sun_path, socket_name, sizeof(addr.sun_path)-1 );
+  unlink( socket_name );
+  if (server < 0 || bind( server, (struct sockaddr*)&addr, sizeof(addr) ) != 0 || listen( server, 64 ) != 0){
+    perror( socket_name );
+    return 1;
+  }
+  printf("Listening on %s: queue of %d jobs, %d threads\n", socket_name, queue_size, (nths > 0)? nths : omp_get_max_threads());
+  fflush(stdout);
+
+  pthread_t blurrer;
+  pthread_create( &blurrer, NULL, blur_thread, NULL );
+
+  while (!stopping){
+    int conn = accept( server, NULL, NULL );
+    if (conn < 0)
+      continue;
+    // the request is read here, by the only thread accepting connections: bound the wait
+    struct timeval timeout = { REQUEST_TIMEOUT, 0 };
+    setsockopt( conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout) );
+    job j;
+    if (read_request( conn, &j.req, &j.fd ) != 0){
+      close(conn);
+      continue;
+    }
+    j.conn    = conn;
+    j.arrival = omp_get_wtime();
+
+    blurd_reply rep;
+    memset( &rep, 0, sizeof(rep) );
+    int queued = 0;
+    if (j.req.op == BLURD_FILE || j.req.op == BLURD_MEMFD){
+      pthread_mutex_lock( &lock );
+      if (queue_len < queue_size){
+        queue[(queue_first+queue_len)%queue_size] = j;
+        queue_len++;
+        queued = 1;
+        pthread_cond_signal( &not_empty );
+      }
+      else {
+        rejected++;
+        rep.status = BLURD_EBUSY;
+      }
+      pthread_mutex_unlock( &lock );
+    }
+    else if (j.req.op == BLURD_STOP){
+      pthread_mutex_lock( &lock );
+      stopping = 1;
+      pthread_cond_signal( &not_empty );
+      pthread_mutex_unlock( &lock );
+    }
+    else if (j.req.op != BLURD_STATS)
+      rep.status = BLURD_EINVAL;
+
+    // the reply of a job is sent by the blur thread, when done
+    if (!queued){
+      if (j.fd >= 0) close(j.fd);
+      fill_stats( &rep );
+      if (write( conn, &rep, sizeof(rep) ) != sizeof(rep))
+        perror("reply");
+      close(conn);
+    }
+  }
+
+  pthread_join( blurrer, NULL );
+  close(server);
+  unlink( socket_name );
+  free(queue);
+  printf("Stopped after %ld jobs\n", done);
+  return 0;
+}
@@ -0,0 +1,57 @@
+#ifndef BLURD_H
+#define BLURD_H
+
+/*
+  Protocol of the blur daemon (blurd.c), spoken over a Unix domain stream socket.
+
+  Every connection carries one request and its reply. The client sends a blurd_request,
+  the daemon answers with a blurd_reply once the job is done (or refused). Requests are:
+
+    * BLURD_FILE  : the daemon reads the PGM/PPM image in input, blurs it and writes it
+                    to output, both paths as seen by the daemon
+    * BLURD_MEMFD : the image is in a shared memory buffer (e.g. from memfd_create), whose
+                    descriptor travels with the request as SCM_RIGHTS ancillary data. The
+                    buffer holds xsize*ysize input pixels of pixel_type, in the host byte
+                    order, followed by room for as many output pixels, which the daemon
+                    fills: no pixel goes through the socket.
+    * BLURD_STATS : only the statistics of the daemon are returned
+    * BLURD_STOP  : the daemon ends after the jobs already queued
+
+  Kernel parameters have the meaning of the command line of the blur codes.
+*/
+
+#define BLURD_FILE      0
+#define BLURD_MEMFD     1
+#define BLURD_STATS     2
+#define BLURD_STOP      3
+
+// status of a reply
+#define BLURD_OK        0
+#define BLURD_EINVAL    1     // invalid request
+#define BLURD_EBUSY     2     // the queue is full, try again later
+#define BLURD_EIO       3     // the image could not be read or written
+#define BLURD_ENOMEM    4     // not enough memory for the image
+
+#define BLURD_PATH      256
+
+typedef struct {
+  int   op;
+  int   ktype, ksize;
+  float kfactor;
+  int   xsize, ysize;                    // BLURD_MEMFD only
+  int   pixel_type;                      // BLURD_MEMFD only: BLUR_U8 or BLUR_U16
+  char  input[BLURD_PATH];               // BLURD_FILE only
+  char  output[BLURD_PATH];
+} blurd_request;
+
+typedef struct {
+  int    status;
+  int    queue_depth;                    // jobs waiting in the queue
+  double wait, run;                      // seconds this job spent in the queue and running
+  // statistics of the daemon
+  long   done, rejected;                 // jobs completed, refused because the queue was full
+  int    cached_plans;
+  double latency_p50, latency_p90, latency_p99;   // seconds from arrival to completion, over the last jobs
+} blurd_reply;
+
+#endif
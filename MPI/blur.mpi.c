@@ -4,11 +4,8 @@
 #include <stdio.h> 
 #include <math.h>
 #include <time.h>
-#define UP    3
-#define DOWN  1
-#define LEFT  2
-#define RIGHT 0
-
+#include <limits.h>
+#include "../Tiled/tiled.h"
 #define KSIDE 3 
 #define XWIDTH 256
 #define YWIDTH 256
@@ -31,22 +28,83 @@
 //
 //  * write_pgm_image
 //  * read_header
-//  * swap_image
+//  * deinterleave_image
+//  * interleave_image
 //  * read_pixels2
 //  
 // 2. routine for bluring an image
 //
 //  * identify_thread
-//  * blur
+//  * median_padded
+//  * bilateral_blur_line
+//  * bilateral_padded
+//  * morph_line
+//  * morph_rows
+//  * morph_padded
+//  * read_kernel
+//  * separate_kernel
+//  * custom_padded
+//  * blur_padded
+//  * filter_padded
+//  * fill_apron
+//
+// 3. domain decomposition
+//
+//  * plan_cost
+//  * plan_decomposition
+//  * print_plan
+//
+// 4. run time options and profiling
+//
+//  * read_options
+//  * trace_start
+//  * trace_record
+//  * trace_write
+//
+// 5. gathering of large images
+//
+//  * gather_values
+//  * gather_rows
+//
+// 6. dynamic distribution of tiles
+//
+//  * read_tile
+//  * blur_dynamic
+//
+// 7. shared-memory and one-sided halos
+//
+//  * neighbour_halo
+//  * shm_grid_order
+//  * shm_alloc
+//  * shm_free
+//  * shm_copy_halo
+//  * rma_create
+//  * rma_free
+//  * rma_get_halo
+//
+// 8. blur with (deep) halos
+//
+//  * exchange_halo_padded
+//  * tune_halo_depth
+//  * blur_iterations
+//
+// 9. batches of images
+//
+//  * batch_team_size
+//  * batch_compare
+//  * batch_print
+//  * blur_batch_image
+//  * blur_batch
 //
 // ============================================================================================================================================================
 //  WRITE 
 
-void write_pgm_image( void *image, int maxval, int xsize, int ysize, const char *image_name)
+void write_pgm_image( void *image, int maxval, int xsize, int ysize, int nch, const char *image_name)
 /*
  * image        : a pointer to the memory region that contains the image
  * maxval       : either 255 or 65536
  * xsize, ysize : x and y dimensions of the image
+ * nch          : number of channels, 1 (P5, grey) or 3 (P6, RGB)
  * image_name   : the name of the file to be written
  *
  */
@@ -70,10 +128,10 @@ void write_pgm_image( void *image, int maxval, int xsize, int ysize, const char
   // returns 1 if maxval<=255 and 2 if >=255
   int color_depth = 1 + ( maxval > 255 );
 
-  fprintf(image_file, "P5\n# generated by\n# M. Danese \n%d %d\n%d\n", xsize, ysize, maxval);
+  fprintf(image_file, "P%d\n# generated by\n# M. Danese \n%d %d\n%d\n", (nch==3)? 6 : 5, xsize, ysize, maxval);
   
   // Writing file
-  fwrite( image, 1, xsize*ysize*color_depth, image_file);  
+  fwrite( image, 1, (size_t)xsize*ysize*color_depth*nch, image_file);  
 
   fclose(image_file); 
   return ;
@@ -101,11 +159,12 @@ void write_pgm_image( void *image, int maxval, int xsize, int ysize, const char
 
 
 
-void identify_thread(int xxth, int yyth, int* xpxl, int* ypxl, int* start_idx, int* start_x, int* start_y, int thpos[2], int thid, int xsize, int ysize)
+void identify_thread(int xxth, int yyth, int* xpxl, int* ypxl, long* start_idx, int* start_x, int* start_y, int thpos[2], int thid, int xsize, int ysize)
 {
 /*
 this routine takes and input infos about the decomposed domain and the image under analyisi, and returns the starting point
-for the image blurring associated to each thread
+for the image blurring associated to each thread: start_y is its first row, start_idx the index of its first pixel (long, 
+as images may exceed 2^31 pixels)
 */
 
     // x axis
@@ -127,8 +186,7 @@ for the image blurring associated to each thread
     *start_y  = yyth*floor(ysize/thpos[1]); 
     *start_y += (yyth <= ysize%thpos[1])? yyth : ysize%thpos[1]; 
 
-    *start_y  *=  xsize;
-    *start_idx = *start_x + *start_y;
+    *start_idx = (long)*start_y*xsize + *start_x;
 
 }
 
@@ -141,11 +199,12 @@ for the image blurring associated to each thread
 //                               READ HEADER
 
 
-void read_header( int *maxval, int *xsize, int *ysize, const char *image_name, FILE** file)
+void read_header( int *maxval, int *xsize, int *ysize, int *nch, const char *image_name, FILE** file)
 /*
  * image        : a pointer to the pointer that will contain the image
  * maxval       : a pointer to the int that will store the maximum intensity in the image
  * xsize, ysize : pointers to the x and y sizes
+ * nch          : a pointer to the number of channels, 1 for P5 and 3 for P6 images
  * image_name   : the name of the file to be read
  *
  */
@@ -154,7 +213,7 @@ void read_header( int *maxval, int *xsize, int *ysize, const char *image_name, F
 
   *xsize = *ysize = *maxval = 0;
   
-  char    MagicN[2];
+  char    MagicN[3];
   char   *line = NULL;
   size_t  k, n = 0;
 
@@ -164,6 +223,7 @@ void read_header( int *maxval, int *xsize, int *ysize, const char *image_name, F
 
   // get the Magic Number - first element
   k = fscanf(*file, "%2s%*c", MagicN );
+  *nch = (strcmp(MagicN, "P6") == 0)? 3 : 1;
 
 
     
@@ -211,17 +271,18 @@ void read_header( int *maxval, int *xsize, int *ysize, const char *image_name, F
 //                               READ PIXELS
 
 
-void read_pixels2( void **image, int *maxval, int *xpxl, int *ypxl, const char *image_name, FILE** file, int start_idx, int nths, int thid, int thpos[2], int xyth[2], int ysize, int xsize) 
+void read_pixels2( void **image, int *maxval, int *xpxl, int *ypxl, int nch, const char *image_name, FILE** file, long start_idx, int nths, int thid, int thpos[2], int xyth[2], int ysize, int xsize) 
 {   
 /*
- This routine makes every thread read the pixel values of interest the image, avoiding reading the image more than once or any communication
+ This routine makes every thread read the pixel values of interest the image, avoiding reading the image more than once or any communication.
+ The nch channels of the pixels are left interleaved, as in the file.
 */
 
 
   *image = NULL;
 
-  int color_depth = 1 + ( *maxval > 255 );
-  unsigned int size =  (*xpxl) * (*ypxl) * color_depth;
+  int color_depth = (1 + ( *maxval > 255 ))*nch;
+  size_t size =  (size_t)(*xpxl) * (*ypxl) * color_depth;
   
   if ( (*image = (char*)malloc( size )) == NULL )
     {
@@ -253,7 +314,7 @@ void read_pixels2( void **image, int *maxval, int *xpxl, int *ypxl, const char *
 	  if ( (xyth[0]==xdim) && (xyth[1]==ydim))
 	    {
 	    for (int k=0; k< color_depth*xmax; k++){
-              ((char*)*image)[k+ypxlidx*(xmax)*color_depth] = ((char*)line)[k];
+              ((char*)*image)[k+(size_t)ypxlidx*(xmax)*color_depth] = ((char*)line)[k];
             }
 	  }
 	  } else {
@@ -278,28 +339,52 @@ void read_pixels2( void **image, int *maxval, int *xpxl, int *ypxl, const char *
 // ============================================================================================================================================================
 
 
-//                               SWAP PGM
+//                               PLANAR LAYOUT
+
 
+/*
+  Pixels are stored in the files as 1 or 2 big endian bytes per sample (maxval > 255), and 
+  the 3 samples of a P6 pixel are interleaved (RGBRGB...). The blur works instead on planar
+  images of unsigned short in the host order: channel c of pixel idx is at c*xsize*ysize+idx, 
+  so that every channel is a contiguous grey image sharing the indices of the others.
+*/
 
 
-void swap_image( void *image, int xsize, int ysize, int maxval )
+void deinterleave_image( const unsigned char *raw, unsigned short int *planar, int xsize, int ysize, int maxval, int nch )
 /*
- * This routine swaps the endianism of the memory area pointed
- * to by ptr, by blocks of 2 bytes
- *
+ * raw    : the pixels as read from the file
+ * planar : nch planes of xsize*ysize samples
  */
 {
+  size_t plane = (size_t)xsize*ysize;
   if ( maxval > 255 )
-    {
-      // pgm files has the short int written in
-      // big endian;
-      // here we swap the content of the image from
-      // one to another
-      //
-      unsigned int size = xsize * ysize;
-      for ( int i = 0; i < size; i++ )
-  	((unsigned short int*)image)[i] = swap(((unsigned short int*)image)[i]);
-    }
+    for ( size_t i = 0; i < plane; i++ )
+      for ( int c = 0; c < nch; c++ )
+        planar[c*plane+i] = (raw[2*(i*nch+c)] << 8) | raw[2*(i*nch+c)+1];
+  else
+    for ( size_t i = 0; i < plane; i++ )
+      for ( int c = 0; c < nch; c++ )
+        planar[c*plane+i] = raw[i*nch+c];
+  return;
+}
+
+
+void interleave_image( const unsigned short int *planar, unsigned char *raw, int xsize, int ysize, int maxval, int nch )
+/*
+ * the inverse of deinterleave_image
+ */
+{
+  size_t plane = (size_t)xsize*ysize;
+  if ( maxval > 255 )
+    for ( size_t i = 0; i < plane; i++ )
+      for ( int c = 0; c < nch; c++ ){
+        raw[2*(i*nch+c)]   = planar[c*plane+i] >> 8;
+        raw[2*(i*nch+c)+1] = planar[c*plane+i] & 0xff;
+      }
+  else
+    for ( size_t i = 0; i < plane; i++ )
+      for ( int c = 0; c < nch; c++ )
+        raw[i*nch+c] = planar[c*plane+i];
   return;
 }
 
@@ -308,62 +393,138 @@ void swap_image( void *image, int xsize, int ysize, int maxval )
 // ============================================================================================================================================================
 
 
-//                               BLUR PGM
+//                               MEDIAN FILTER
 
 
-void * blur( void *image, int xsize, int ysize, int start_idx, int start_x, int start_y, int xxth, int yyth, int xpxl, int ypxl, int maxval, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize, short unsigned int* halo[4])
 /*
-  This routine takes as input the image to blur, its x and y size, its maxval (as above), 
-  the kernel size (ksize), the kernel matrix valuse and its normalisation  
+  With ktype 3 blur_padded takes the median of the ksize x ksize pixels around each pixel,
+  apron included, so that the halos and the edge modes work as for the kernels. It is the
+  constant-time median of Perreault and Hebert, as in the OpenMP code: sliding column 
+  histograms, summed into the histogram of the window, in a coarse and a fine tier (16 x 16
+  bins for 8-bit samples, 256 x 256 for 16-bit ones) with the fine bins updated only where
+  the median falls. The cost of a pixel does not depend on ksize.
+*/
+
+int median_filter = 0;   // ktype 3
+
+#define MEDIAN_MEMORY (32*1024*1024)   // bytes of the column histograms
+
+
+void median_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, int khalfsize )
+/*
+ * median filter of a region, with the same conventions as blur_padded
  */
 {
-  short int *sImage;   // the image when a two bytes are used for each pixel
-  void      *tempptr;
- 
-  start_y /= xsize; // instead of repeating this division at every loop
+  int r     = khalfsize;
+  int ksize = 2*r+1;
+  int half  = ksize*ksize/2;          // rank of the median in the window
+
+  // bins: coarse bits, then fine bits, of the largest sample of the region and its apron
+  unsigned short int vmax = 0;
+  for (int y=-r; y<ypxl+r; y++)
+    for (int x=-r; x<xpxl+r; x++)
+      if (image[(long)y*istride+x] > vmax) vmax = image[(long)y*istride+x];
+  int bits = 1;
+  while ((1 << bits) <= vmax) bits++;
+  int fbits = (bits+1)/2;
+  int nc    = 1 << (bits-fbits);      // coarse bins
+  int nf    = 1 << fbits;             // fine bins of a coarse bin
+
+  int strip = (int)(MEDIAN_MEMORY/(nc*nf*sizeof(short int))) - 2*r;
+  if (strip < 16)   strip = 16;
+  if (strip > xpxl) strip = xpxl;
+  int ncols = strip + 2*r;
+  unsigned short int *ccol = (unsigned short int*)calloc( (size_t)ncols*nc,    sizeof(short int) );  // column histograms, the fine ones
+  unsigned short int *fcol = (unsigned short int*)calloc( (size_t)ncols*nc*nf, sizeof(short int) );  // grouped by coarse bin
+  unsigned int *hc0  = (unsigned int*)calloc( nc,    sizeof(int) );   // window at the start of the row
+  unsigned int *hf0  = (unsigned int*)calloc( nc*nf, sizeof(int) );
+  unsigned int *hc   = (unsigned int*)malloc( nc*sizeof(int) );       // window at the current pixel
+  unsigned int *hf   = (unsigned int*)malloc( nc*nf*sizeof(int) );
+  int          *last = (int*)malloc( nc*sizeof(int) );                 // position of the fine bins of hf
+
+  #define MEDIAN_COLUMN(c, v, d) { ccol[(size_t)(c)*nc + ((v) >> fbits)] += (d); fcol[((size_t)((v) >> fbits)*ncols + (c))*nf + ((v) & (nf-1))] += (d); }
+  #define MEDIAN_WINDOW(v, d)    { hc0[(v) >> fbits] += (d); hf0[v] += (d); }
+
+  for (int sx=0; sx<xpxl; sx+=strip){
+    int w = (xpxl-sx < strip)? xpxl-sx : strip;
+    unsigned short int *base = image + sx - r;       // column c of the histograms
+
+    // columns and window of the first row
+    for (int y=-r; y<=r; y++)
+      for (int c=0; c<w+2*r; c++){
+        unsigned short int v = base[(long)y*istride+c];
+        MEDIAN_COLUMN(c, v, 1);
+        if (c < ksize) MEDIAN_WINDOW(v, 1);
+      }
 
-  
-  /* --------------------------------------------------------------- */
-    //   2 bytes
-  
-      sImage = (unsigned short int*)calloc( xpxl*ypxl, sizeof(short int) );
-      unsigned short int _maxval = swap((unsigned short int)maxval);
-      for ( int yy = 0; yy < ypxl; yy++ ){
-        for( int xx = 0; xx < xpxl; xx++ ){
-          int idx =  yy*xpxl + xx; 
-	  double xxyy = 0;
-	  for (int yks=-khalfsize; yks<khalfsize+1; yks++){
-	    for (int xks=-khalfsize; xks<khalfsize+1; xks++){
-              // check global borders (x_start and y_start for real values)
-	      if (start_x + xx + xks < xsize && start_y + yy + yks < ysize  && start_x+xx+xks >= 0 && start_y+yy+yks >=0){
-	        //check local borders
-		if (xx+xks<xpxl && yy+yks<ypxl && xx+xks>=0 && yy+yks>=0){
-	          int sidx = idx + yks*xpxl+ xks; 
-	          xxyy += kernel[khalfsize+yks][khalfsize+xks]*((unsigned short int*)image)[sidx];
-	        } // RIGHT
-		  else if (xx+xks>=xpxl){  
-                    xxyy += kernel[khalfsize+yks][khalfsize+xks]*((unsigned short int*)halo[RIGHT])[(xx+xks-xpxl) + (yy+yks+khalfsize)*khalfsize];
-		  } // LEFT
-		  else if (xx+xks<0){ 
-	            xxyy += kernel[khalfsize+yks][khalfsize+xks]*((unsigned short int*)halo[LEFT])[(xx+xks+khalfsize) + (yy+yks+khalfsize)*khalfsize];
-                  } // UP
-		  else if (yy+yks<0){ 
-	            xxyy += kernel[khalfsize+yks][khalfsize+xks]*((unsigned short int*)halo[UP])[(xx+xks) + (khalfsize+yy+yks)*xpxl];
-                  } // DOWN
-		  else if (yy+yks>=ypxl){ 
-	            xxyy += kernel[khalfsize+yks][khalfsize+xks]*((unsigned short int*)halo[DOWN])[(xx+xks) + (yy+yks-ypxl)*xpxl];
-                  }
-
-	      }
-	    }
-	  }
-	  sImage[yy*xpxl+xx] = round(xxyy/knorm);
-	  idx++;
+    for (int y=0; y<ypxl; y++){
+      memcpy(hc, hc0, nc*sizeof(int));
+      for (int b=0; b<nc; b++)
+        last[b] = -1;                                // fine bins still in hf0
+
+      for (int x=0; x<w; x++){
+        if (x > 0)
+          for (int b=0; b<nc; b++)
+            hc[b] += ccol[(size_t)(x+2*r)*nc+b] - ccol[(size_t)(x-1)*nc+b];
+        int acc = 0, b = 0;
+        while (acc + (int)hc[b] <= half)
+          acc += hc[b++];
+
+        // fine bins of b at x: from the start of the row, or the last update, or the columns
+        unsigned int *seg = hf + (size_t)b*nf;
+        if (last[b] < 0){
+          memcpy(seg, hf0 + (size_t)b*nf, nf*sizeof(int));
+          last[b] = 0;
+        }
+        if (x - last[b] > ksize){
+          memset(seg, 0, nf*sizeof(int));
+          for (int c=x; c<x+ksize; c++)
+            for (int f=0; f<nf; f++)
+              seg[f] += fcol[((size_t)b*ncols+c)*nf+f];
         }
+        else
+          for (int j=last[b]+1; j<=x; j++)
+            for (int f=0; f<nf; f++)
+              seg[f] += fcol[((size_t)b*ncols+j+2*r)*nf+f] - fcol[((size_t)b*ncols+j-1)*nf+f];
+        last[b] = x;
+        int f = 0;
+        while (acc + (int)seg[f] <= half)
+          acc += seg[f++];
+        out[(long)y*ostride+sx+x] = b*nf + f;
       }
-      tempptr = (void*)sImage;	
 
-  return tempptr;
+      // down one row: row y-r leaves, row y+r+1 enters
+      if (y < ypxl-1)
+        for (int c=0; c<w+2*r; c++){
+          unsigned short int vout = base[(long)(y-r)*istride+c];
+          unsigned short int vin  = base[(long)(y+r+1)*istride+c];
+          MEDIAN_COLUMN(c, vout, -1);
+          MEDIAN_COLUMN(c, vin,   1);
+          if (c < ksize){
+            MEDIAN_WINDOW(vout, -1);
+            MEDIAN_WINDOW(vin,   1);
+          }
+        }
+    }
+
+    // empty the histograms for the next strip
+    for (int y=ypxl-1-r; y<=ypxl-1+r; y++)
+      for (int c=0; c<w+2*r; c++){
+        unsigned short int v = base[(long)y*istride+c];
+        MEDIAN_COLUMN(c, v, -1);
+        if (c < ksize) MEDIAN_WINDOW(v, -1);
+      }
+  }
+  #undef MEDIAN_COLUMN
+  #undef MEDIAN_WINDOW
+
+  free(ccol);
+  free(fcol);
+  free(hc0);
+  free(hf0);
+  free(hc);
+  free(hf);
+  free(last);
 }
 
 
@@ -371,202 +532,2311 @@ void * blur( void *image, int xsize, int ysize, int start_idx, int start_x, int
 // ============================================================================================================================================================
 
 
-//                               MAIN
+//                               BILATERAL GRID
 
 
-// ============================================================================================================================================================
+/*
+  ktype 4 is the bilateral filter of the OpenMP code, on a bilateral grid (see there): 
+  splat into cells of sigma_s x sigma_s pixels and sigma_r in value, blur of the grid, 
+  slice by trilinear interpolation. The cells are aligned to the image, and a region needs
+  the pixels within BILATERAL_APRON(sigma_s) of it: this is the depth of its halos, which
+  thus carry the part of the grid of the neighbours a rank needs, as the pixels it is 
+  splatted from. Pixels outside the image are not splatted, whatever the edge mode.
+  The filter replaces blur_padded in blur_iterations and blur_dynamic.
+*/
 
+typedef struct {
+  int   on;                         // ktype 4
+  float ss;                         // spatial sigma, in pixels
+  float range;                      // range sigma, as a fraction of maxval
+  float sr;                         // range sigma of the current image, in sample values
+} bilateral_grid;
 
-int main( int argc, char *argv[ ] ) 
-{ 
-  int xsize;
-  int ysize;
-  int maxval;
-  struct timespec ts;
-  double startt, stopt;
-  int nths,thid;
-  int ksize      = 25;
-  int ktype      = 0;
-  float kfactor  = 0.2;
-  char *input_image_name;
-  char *output_image_name;
+bilateral_grid bil = { 0, 0, 0, 0 };
 
-  MPI_Status status; 
-  MPI_Request request;
-  const int master = 0;
-  int tag = 123;
-  
+#define BILATERAL_CELLS    2                                      // half-size of the kernel of the grid
+#define BILATERAL_APRON(ss) ((int)ceil((BILATERAL_CELLS+1.5)*(ss)) + 1)
 
-  MPI_Init(&argc,&argv);
-  MPI_Comm_size(MPI_COMM_WORLD,&nths);  
-  startt = MPI_Wtime();
-  // decompose in a 2D cartesian grid
-  int thpos[2] = {0, 0};
-  MPI_Dims_create(nths, 2, thpos);
 
-  //set no periodicity
-  int periods[2] = {0,0};
+void bilateral_blur_line( float *first, int n, size_t stride, float *line )
+/*
+ * blurs with 1 4 6 4 1 a line of n cells of the grid (value and weight), stride floats
+ * apart, cells beyond the line counting as empty; line holds 2*n floats
+ */
+{
+  const float k[2*BILATERAL_CELLS+1] = {1./16, 4./16, 6./16, 4./16, 1./16};
+  for (int i=0; i<n; i++){
+    line[2*i]   = first[i*stride];
+    line[2*i+1] = first[i*stride+1];
+  }
+  for (int i=0; i<n; i++){
+    float v = 0, w = 0;
+    for (int j=-BILATERAL_CELLS; j<=BILATERAL_CELLS; j++)
+      if (i+j >= 0 && i+j < n){
+        v += k[j+BILATERAL_CELLS]*line[2*(i+j)];
+        w += k[j+BILATERAL_CELLS]*line[2*(i+j)+1];
+      }
+    first[i*stride]   = v;
+    first[i*stride+1] = w;
+  }
+}
 
-  // MPI assignes arbitrary ranks
-  int reorder=1;
-  
-  // Create a communicator given the 2D torus topology.
-  MPI_Comm grid_communicator;
-  MPI_Cart_create(MPI_COMM_WORLD, 2, thpos, periods, reorder, &grid_communicator);
 
-  //my thread id in the new communicator
-  MPI_Comm_rank(grid_communicator, &thid);
+void bilateral_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, int x0, int y0, int xsize, int ysize, float ss, float sr )
+/*
+ * bilateral filter of a region of xpxl x ypxl pixels at (x0, y0) in an image of xsize x 
+ * ysize, with spatial and range sigmas ss and sr: image points to the first pixel of the 
+ * region and must hold the pixels of the image within BILATERAL_APRON(ss) of it, rows of 
+ * istride pixels. The result is stored in out (rows of ostride pixels).
+ */
+{
+  // cells around the region, and the pixels of the image splatted into them
+  int cx0 = (int)floor(x0/ss) - BILATERAL_CELLS, cx1 = (int)floor((x0+xpxl-1)/ss) + 1 + BILATERAL_CELLS;
+  int cy0 = (int)floor(y0/ss) - BILATERAL_CELLS, cy1 = (int)floor((y0+ypxl-1)/ss) + 1 + BILATERAL_CELLS;
+  int nx  = cx1-cx0+1, ny = cy1-cy0+1;
+  int apron = BILATERAL_APRON(ss);
+  int px0 = (x0-apron < 0)? 0 : x0-apron, px1 = (x0+xpxl+apron > xsize)? xsize : x0+xpxl+apron;
+  int py0 = (y0-apron < 0)? 0 : y0-apron, py1 = (y0+ypxl+apron > ysize)? ysize : y0+ypxl+apron;
+
+  // cells in value: up to the largest sample, plus one for the interpolation
+  unsigned short int vmax = 0;
+  for (int y=py0; y<py1; y++)
+    for (int x=px0; x<px1; x++)
+      if (image[(long)(y-y0)*istride+x-x0] > vmax) vmax = image[(long)(y-y0)*istride+x-x0];
+  int nz = (int)(vmax/sr + 0.5) + 2;
 
-  //get coordinate in the new communicator
-  int    xyth[2];
-  MPI_Cart_coords(grid_communicator, thid, 2, xyth);
+  // ---------------------------------------------
+  // splat: cells of [y][x][z], each a sum of values and a weight
+  size_t zs = 2, xs = 2*(size_t)nz, ys = xs*nx;
+  float *grid = (float*)calloc( ys*ny, sizeof(float) );
+  for (int y=py0; y<py1; y++){
+    int iy = (int)floor(y/ss + 0.5) - cy0;
+    if (iy < 0 || iy >= ny) continue;
+    for (int x=px0; x<px1; x++){
+      int ix = (int)floor(x/ss + 0.5) - cx0;
+      if (ix < 0 || ix >= nx) continue;
+      unsigned short int v = image[(long)(y-y0)*istride+x-x0];
+      float *cell = grid + iy*ys + ix*xs + (int)(v/sr + 0.5)*zs;
+      cell[0] += v;
+      cell[1] += 1;
+    }
+  }
 
+  // ---------------------------------------------
+  // blur along z, x and y
+  int nmax = (nz > nx)? nz : nx;
+  if (ny > nmax) nmax = ny;
+  float *line = (float*)malloc( 2*nmax*sizeof(float) );
+  for (int iy=0; iy<ny; iy++)
+    for (int ix=0; ix<nx; ix++)
+      bilateral_blur_line( grid + iy*ys + ix*xs, nz, zs, line );
+  for (int iy=0; iy<ny; iy++)
+    for (int iz=0; iz<nz; iz++)
+      bilateral_blur_line( grid + iy*ys + iz*zs, nx, xs, line );
+  for (int ix=0; ix<nx; ix++)
+    for (int iz=0; iz<nz; iz++)
+      bilateral_blur_line( grid + ix*xs + iz*zs, ny, ys, line );
+  free(line);
 
+  // ---------------------------------------------
+  // slice: trilinear interpolation at the position and value of every pixel
+  // (fractions taken before the offset of the cells, to be the same in any region)
+  for (int yy=0; yy<ypxl; yy++){
+    float gy = (y0+yy)/ss;
+    int   iy = (int)gy;
+    float fy = gy - iy;
+    iy -= cy0;
+    for (int xx=0; xx<xpxl; xx++){
+      float gx = (x0+xx)/ss;
+      int   ix = (int)gx;
+      float fx = gx - ix;
+      ix -= cx0;
+      unsigned short int v = image[(long)yy*istride+xx];
+      float gz = v/sr;
+      int   iz = (int)gz;
+      float fz = gz - iz;
+      float *c = grid + iy*ys + ix*xs + iz*zs;
+      float sum[2];
+      for (int k=0; k<2; k++)
+        sum[k] = (1-fy)*( (1-fx)*((1-fz)*c[k]       + fz*c[zs+k])       + fx*((1-fz)*c[xs+k]    + fz*c[xs+zs+k]) )
+                +   fy *( (1-fx)*((1-fz)*c[ys+k]    + fz*c[ys+zs+k])    + fx*((1-fz)*c[ys+xs+k] + fz*c[ys+xs+zs+k]) );
+      out[(long)yy*ostride+xx] = (sum[1] > 0)? round(sum[0]/sum[1]) : v;
+    }
+  }
+  free(grid);
+}
 
 
-    // read input parameters
-    int arg_num=1;
-    if ( argc > arg_num ) {
-     ktype   = atoi( argv[arg_num] );
-     arg_num++;
-     if (ktype>2 || ktype <0){
-       printf("Invalid ktype\n");
-       return 0;
-       }
-    if ( argc > arg_num ) {
-     ksize   = atoi( argv[arg_num] );
-     arg_num++;
-    if (ktype==1) {if ( argc > arg_num) {
-                     kfactor = atof( argv[arg_num]);
-                     arg_num++;
-                     if (kfactor>1 || kfactor<0){
-                       printf("Invalid kfactor\n");
-                       return 0;
-                     }
-                   }
-    }
-    if ( argc > arg_num ) {
-     input_image_name  = malloc(strlen( argv[arg_num])+1);
-     strcpy(input_image_name, argv[arg_num]);
-     arg_num++;
-    if ( argc > arg_num ) {
-     output_image_name  = malloc(strlen( argv[arg_num])+1);
-     strcpy(output_image_name, argv[arg_num]);
-     arg_num++;
-     } } } } 
-    
-    //if no output image name is provided
-    if(arg_num<(5+ktype%2)) {
-     output_image_name  = malloc(15);
-     strcpy(output_image_name, "mpi_output.pgm");
+
+// ============================================================================================================================================================
+
+
+//                               MORPHOLOGY
+
+
+/*
+  ktypes 5 to 8 are the erosion, dilation, opening and closing of the OpenMP code, with a 
+  square ksize x ksize element: separable passes of van Herk and Gil-Werman, 3 comparisons 
+  per pixel and pass for any ksize, the erosion as the dilation of the complement, and the
+  two operators of opening and closing in the same call, with an apron (and halos) of 
+  twice the radius. Pixels outside the image take no part, whatever the edge mode.
+*/
+
+int morph_op = 0;   // MORPH_* of ktypes 5 to 8, 0 for the other filters
+
+#define MORPH_ERODE  1
+#define MORPH_DILATE 2
+#define MORPH_OPEN   3     // erosion, then dilation
+#define MORPH_CLOSE  4     // dilation, then erosion
+
+#define MORPH_MAX(a,b) (((a) > (b))? (a) : (b))
+
+
+void morph_line( const unsigned short int *in, unsigned short int *out, int n, int w, unsigned short int *g, unsigned short int *h )
+/*
+ * out[i] = max of in[i ... i+w-1], for n outputs; g and h hold n+w-1 values
+ */
+{
+  int m = n+w-1;
+  for (int b=0; b<m; b+=w){
+    int e = (b+w < m)? b+w : m;
+    g[b] = in[b];
+    for (int i=b+1; i<e; i++)
+      g[i] = MORPH_MAX(g[i-1], in[i]);
+    h[e-1] = in[e-1];
+    for (int i=e-2; i>=b; i--)
+      h[i] = MORPH_MAX(h[i+1], in[i]);
+  }
+  for (int i=0; i<n; i++)
+    out[i] = MORPH_MAX(h[i], g[i+w-1]);
+}
+
+
+void morph_rows( const unsigned short int *in, int istride, unsigned short int *out, int ostride, int width, int n, int w, unsigned short int *g, unsigned short int *h )
+/*
+ * as morph_line, along the columns of n+w-1 rows of width values: row i of out is the 
+ * maximum of the rows i ... i+w-1 of in; g and h hold (n+w-1)*width values
+ */
+{
+  int m = n+w-1;
+  for (int b=0; b<m; b+=w){
+    int e = (b+w < m)? b+w : m;
+    memcpy( g + (size_t)b*width, in + (long)b*istride, width*sizeof(short int) );
+    for (int i=b+1; i<e; i++){
+      unsigned short int *gi = g + (size_t)i*width, *gp = gi - width;
+      const unsigned short int *ii = in + (long)i*istride;
+      for (int x=0; x<width; x++)
+        gi[x] = MORPH_MAX(gp[x], ii[x]);
     }
-    if(arg_num<(4+ktype%2)) {
-     input_image_name   = malloc(16);
-     strcpy(input_image_name, "../check_me.pgm");
+    memcpy( h + (size_t)(e-1)*width, in + (long)(e-1)*istride, width*sizeof(short int) );
+    for (int i=e-2; i>=b; i--){
+      unsigned short int *hi = h + (size_t)i*width, *hn = hi + width;
+      const unsigned short int *ii = in + (long)i*istride;
+      for (int x=0; x<width; x++)
+        hi[x] = MORPH_MAX(hn[x], ii[x]);
     }
+  }
+  for (int i=0; i<n; i++){
+    unsigned short int *oi = out + (long)i*ostride;
+    const unsigned short int *hi = h + (size_t)i*width, *gi = g + (size_t)(i+w-1)*width;
+    for (int x=0; x<width; x++)
+      oi[x] = MORPH_MAX(hi[x], gi[x]);
+  }
+}
 
 
-  void *ptr; 
-  int skip_counter=0;
-  FILE *file;
-
-   /*  ------------------------------------------------------- 
-  
-           THREADS SET UP     
-  
-       -------------------------------------------------------
+void morph_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, int x0, int y0, int xsize, int ysize, int khalfsize, int op )
+/*
+ * operator op (MORPH_*) on a region of xpxl x ypxl pixels at (x0, y0) in an image of 
+ * xsize x ysize: image points to the first pixel of the region, with an apron of 
+ * khalfsize pixels (the radius, twice for opening and closing) wherever it falls inside
+ * the image; rows of istride pixels. The result is stored in out (rows of ostride pixels).
+ */
+{
+  int twice = (op == MORPH_OPEN || op == MORPH_CLOSE);
+  int r     = (twice)? khalfsize/2 : khalfsize;
+  int w     = 2*r+1;
+  int e     = khalfsize - r;                 // extension of the result of the first operator
+  int bx    = xpxl + 2*khalfsize, by = ypxl + 2*khalfsize;
+  int flip  = (op == MORPH_ERODE || op == MORPH_OPEN);   // the first operator is an erosion
+
+  unsigned short int *a   = (unsigned short int*)calloc( (size_t)bx*by, sizeof(short int) );
+  unsigned short int *b   = (unsigned short int*)malloc( (size_t)bx*by*sizeof(short int) );
+  unsigned short int *row = (unsigned short int*)malloc( (size_t)bx*by*sizeof(short int) );
+  unsigned short int *g   = (unsigned short int*)malloc( (size_t)bx*by*sizeof(short int) );
+  unsigned short int *h   = (unsigned short int*)malloc( (size_t)bx*by*sizeof(short int) );
+
+  // the pixels of the image around the region, complemented for an erosion, 0 outside
+  for (int y=-khalfsize; y<ypxl+khalfsize; y++){
+    if (y0+y < 0 || y0+y >= ysize) continue;
+    for (int x=-khalfsize; x<xpxl+khalfsize; x++)
+      if (x0+x >= 0 && x0+x < xsize){
+        unsigned short int v = image[(long)y*istride+x];
+        a[(size_t)(y+khalfsize)*bx+x+khalfsize] = (flip)? 65535-v : v;
+      }
+  }
 
-       The original image is divided into a grid of subimages.
+  // first operator, on the region extended by e
+  int bw = xpxl+2*e, bh = ypxl+2*e;
+  for (int y=0; y<bh+2*r; y++)
+    morph_line( a + (size_t)y*bx, row + (size_t)y*bw, bw, w, g, h );
+  morph_rows( row, bw, b, bw, bw, bh, w, g, h );
+
+  if (twice){
+    // the second operator is the opposite one: complement, 0 outside the image
+    for (int y=0; y<bh; y++)
+      for (int x=0; x<bw; x++){
+        int inside = (x0+x-e >= 0 && x0+x-e < xsize && y0+y-e >= 0 && y0+y-e < ysize);
+        b[(size_t)y*bw+x] = (inside)? 65535-b[(size_t)y*bw+x] : 0;
+      }
+    flip = !flip;
+    for (int y=0; y<bh; y++)
+      morph_line( b + (size_t)y*bw, row + (size_t)y*xpxl, xpxl, w, g, h );
+    morph_rows( row, xpxl, b, xpxl, xpxl, ypxl, w, g, h );
+  }
 
-         * nths        - total number of threads = number of 
-	                 subimages to be considered
-	 * thpos[0]    - number of division along the x axis
-	 * thpos[1]    - number of division along the y axis
-	 * xpxl        - number of pixel in the x axis that 
-	                 each column of subimages should have
-	 * ypxl        - number of pixel in the y axis that 
-	                 each row of subimages should have
-         * thid        - number of the current thread
-         * xyth[0]     - x coordinate of the sub image (see below)
-         * xyth[1]     - y coordinate of the sub image (see below)
+  // (e = 0 without a second operator, the result is xpxl wide in any case)
+  for (int y=0; y<ypxl; y++)
+    for (int x=0; x<xpxl; x++){
+      unsigned short int v = b[(size_t)y*xpxl+x];
+      out[(long)y*ostride+x] = (flip)? 65535-v : v;
+    }
 
+  free(a);
+  free(b);
+  free(row);
+  free(g);
+  free(h);
+}
 
-          illustration with 9 threads (nths=9):
-          best division: 3x3 grid (i.e. thpos[0]=3 and thpos[1]=3)
 
-	       _________________________          original image       
-          ^   |  (0,0) '  (0,1) '  (0,2) |        divided in 9 subimages          
-          |   |      0 '      1 '      2 |        following a 3x3 grid
-          |   |--------'--------'--------|       / 
-    ysize |   |  (1,0) '  (1,1) '  (1,2) |   <--ˊ
-          |   |      3 '      4 '      5 |            where the subimage is:
-          |   |--------'--------'--------|            ---------------------  ^
-          |   |  (2,0) '  (2,1) '  (2,2) |           '                    '  |
-	  ˅   | _____6_'______7_'______8_|           '  (xyth[0],xxth[1]) '  |
-                                                     '            thid    '  |  ypxl
-	      <-------------------------->	     '                    '  |
-                        xsize                        '--------------------'  ˅
-						                                     
-						              xpxl 
-						      <------------------->            
 
-       ------------------------------------------------------- */
-  
-  read_header( &maxval, &xsize, &ysize, input_image_name, &file);
-  int xpxl, ypxl;
-  int start_idx, start_x, start_y;
+// ============================================================================================================================================================
 
-  identify_thread(xyth[0], xyth[1], &xpxl, &ypxl, &start_idx, &start_x, &start_y, thpos, thid, xsize, ysize);
-  
-  read_pixels2( &ptr, &maxval, &xpxl, &ypxl, input_image_name, &file, start_idx, nths, thid, thpos, xyth, ysize, xsize);
 
+//                               CUSTOM KERNELS
 
-  // the sharing of pixel dimensions of subimages and their starting points is useful now
-  // and necessary in the final stage.
-  void *xpxlrcounts, *ypxlrcounts, *startidxrcounts;
-  xpxlrcounts   = malloc(nths * sizeof(int));
-  ypxlrcounts   = malloc(nths * sizeof(int));
-  startidxrcounts = malloc(nths * sizeof(int));
 
-  MPI_Allgather(&xpxl,      1, MPI_INT, xpxlrcounts,     1, MPI_INT, grid_communicator);;
-  MPI_Allgather(&ypxl,      1, MPI_INT, ypxlrcounts,     1, MPI_INT, grid_communicator);
-  MPI_Allgather(&start_idx, 1, MPI_INT, startidxrcounts, 1, MPI_INT, grid_communicator);
-  
-  if ( I_M_LITTLE_ENDIAN )
-    swap_image( ptr, xpxl, ypxl, maxval);
+/*
+  --kernel and --kernel-tol as in the OpenMP code: a ksize x ksize kernel read from a file,
+  normalised by the sum of its weights (or by 1) and clipped to [0, maxval], and applied 
+  as the fewest rank-1 separable terms of its singular value decomposition within the 
+  relative error tol, for 2*rank*ksize taps per pixel instead of ksize^2, or directly
+  when the terms would cost as much. Every rank reads the file and decomposes the kernel 
+  in the same way; the halos are those of a kernel of that size, for any edge mode.
+*/
 
+typedef struct {
+  float *terms;    // rank-1 terms of a custom kernel (see separate_kernel), NULL for the built-in ones
+  int    rank;     // number of terms, 0 to apply the kernel directly
+  int    maxval;   // of the image being blurred, results are clipped to [0, maxval]
+} custom_kernel;
 
-   /*  ------------------------------------------------------- 
-  
-           KERNEL SET UP   
-  
-       ------------------------------------------------------- */
+custom_kernel ckernel = {NULL, 0, 0};
 
-    float kernel[ksize][ksize];
-    float knorm = 0;
-    int khalfsize   = (ksize-1)/2; // radius of the kernel
+#define KERNEL_TOL 1e-3   // default of --kernel-tol
 
 
-    // ---------------------------------------------
-    // average kernel
-    if (ktype==0) {
-      for (int i=0; i<ksize;i++){
-        for (int j=0; j<ksize;j++){
-          kernel[i][j]=1;
-	  knorm += kernel[i][j];
-        }
-      }
+float * read_kernel( const char *kernel_name, int *ksize )
+/*
+ * reads a kernel file and returns its ksize*ksize weights, NULL if it is not valid
+ */
+{
+  FILE *file = fopen( kernel_name, "r" );
+  if ( file == NULL )
+    return NULL;
+
+  float *kernel = NULL;
+  int    n = 0, nread = -1;
+  for (;;){
+    int c = fgetc(file);
+    while ( c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == ',' )
+      c = fgetc(file);
+    if ( c == '#' ){
+      while ( c != '\n' && c != EOF )
+        c = fgetc(file);
+      continue;
     }
-    else if (ktype==1) {
-    // ---------------------------------------------
-    // weight kernel
-      for (int i=0; i<ksize;i++){
-        for (int j=0; j<ksize;j++){
-          kernel[i][j]=1-kfactor;
-        }
-      }
-      knorm = (ksize*ksize-1);
-      kernel[khalfsize][khalfsize]=kfactor*(ksize*ksize-1);
+    if ( c == EOF )
+      break;
+    ungetc(c, file);
+    if ( nread < 0 ){
+      if ( fscanf(file, "%d", ksize) != 1 || *ksize < 1 || *ksize%2 == 0 )
+        break;
+      kernel = (float*)malloc( (size_t)(*ksize)*(*ksize)*sizeof(float) );
+      nread  = 0;
+      n      = (*ksize)*(*ksize);
+    }
+    else if ( nread == n || fscanf(file, "%f", &kernel[nread++]) != 1 ){
+      nread = -1;
+      break;
+    }
+  }
+  fclose(file);
+
+  if ( nread != n || n == 0 ){
+    free(kernel);
+    return NULL;
+  }
+  return kernel;
+}
+
+
+int separate_kernel( int ksize, const float *kernel, double tol, float *terms, double *error )
+/*
+ * rank-1 terms of the kernel within the relative error tol: returns their number (the 
+ * rank) and stores them in terms (up to 2*ksize*ksize values), each one as a column of 
+ * ksize weights followed by a row of ksize weights, and the error of the truncation
+ */
+{
+  int n = ksize;
+  double *a = (double*)malloc( (size_t)n*n*sizeof(double) );   // columns: s_i u_i
+  double *v = (double*)calloc( (size_t)n*n, sizeof(double) );  // columns: v_i
+  for (int i=0; i<n*n; i++)
+    a[i] = kernel[i];
+  for (int i=0; i<n; i++)
+    v[i*n+i] = 1;
+
+  // ---------------------------------------------
+  // one-sided Jacobi: rotate pairs of columns of a until they are orthogonal, then
+  // a = K V holds the singular values times the left vectors
+  for (int sweep=0; sweep<60; sweep++){
+    int rotated = 0;
+    for (int p=0; p<n-1; p++)
+      for (int q=p+1; q<n; q++){
+        double alpha = 0, beta = 0, gamma = 0;
+        for (int i=0; i<n; i++){
+          alpha += a[i*n+p]*a[i*n+p];
+          beta  += a[i*n+q]*a[i*n+q];
+          gamma += a[i*n+p]*a[i*n+q];
+        }
+        if ( fabs(gamma) <= 1e-15*sqrt(alpha*beta) )
+          continue;
+        rotated = 1;
+        double zeta = (beta-alpha)/(2*gamma);
+        double t    = ((zeta >= 0)? 1 : -1)/(fabs(zeta) + sqrt(1+zeta*zeta));
+        double c    = 1/sqrt(1+t*t), s = c*t;
+        for (int i=0; i<n; i++){
+          double ap = a[i*n+p], aq = a[i*n+q];
+          a[i*n+p] = c*ap - s*aq;
+          a[i*n+q] = s*ap + c*aq;
+          double vp = v[i*n+p], vq = v[i*n+q];
+          v[i*n+p] = c*vp - s*vq;
+          v[i*n+q] = s*vp + c*vq;
+        }
+      }
+    if ( !rotated )
+      break;
+  }
+
+  // ---------------------------------------------
+  // singular values in decreasing order, and the fewest terms within tol
+  double sv[n], total = 0;
+  int    order[n];
+  for (int j=0; j<n; j++){
+    sv[j] = 0;
+    for (int i=0; i<n; i++)
+      sv[j] += a[i*n+j]*a[i*n+j];
+    total   += sv[j];
+    order[j] = j;
+    for (int k=j; k>0 && sv[order[k]] > sv[order[k-1]]; k--){
+      int swap_j = order[k];
+      order[k]   = order[k-1];
+      order[k-1] = swap_j;
+    }
+  }
+  int    rank = n;
+  double left = 0;                  // squared singular values of the neglected terms
+  while ( rank > 1 && sqrt(left + sv[order[rank-1]]) <= tol*sqrt(total) )
+    left += sv[order[--rank]];
+  *error = (total > 0)? sqrt(left/total) : 0;
+
+  // the singular value is split evenly between the column and the row
+  for (int r=0; r<rank; r++){
+    int    j = order[r];
+    double s = sqrt(sqrt(sv[j]));
+    for (int i=0; i<n; i++){
+      terms[(size_t)r*2*n + i]     = (s > 0)? a[i*n+j]/s : 0;
+      terms[(size_t)r*2*n + n + i] = v[i*n+j]*s;
+    }
+  }
+
+  free(a);
+  free(v);
+  return rank;
+}
+
+
+void custom_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, int ksize, const float *kernel, float knorm, int maxval, int rank, const float *terms )
+/*
+ * a custom kernel on a region, with the conventions of blur_padded: as rank separable
+ * terms (see separate_kernel), or directly if rank is 0; results are clipped to [0, maxval]
+ */
+{
+  int    khalfsize = (ksize-1)/2;
+  float *acc = (float*)calloc( (size_t)xpxl*ypxl, sizeof(float) );
+
+  if ( rank == 0 ){
+    for (int yy=0; yy<ypxl; yy++)
+      for (int yks=-khalfsize; yks<=khalfsize; yks++){
+        const float *krow = kernel + (khalfsize+yks)*ksize + khalfsize;
+        for (int xks=-khalfsize; xks<=khalfsize; xks++){
+          float w = krow[xks];
+          unsigned short int *row = image + (long)(yy+yks)*istride + xks;
+          float *arow = acc + (size_t)yy*xpxl;
+          for (int xx=0; xx<xpxl; xx++)
+            arow[xx] += w*row[xx];
+        }
+      }
+  }
+  else {
+    // the row of every term along the rows of the region and of its apron, then its column
+    float *tmp = (float*)malloc( (size_t)xpxl*(ypxl+2*khalfsize)*sizeof(float) );
+    for (int r=0; r<rank; r++){
+      const float *col  = terms + (size_t)r*2*ksize;
+      const float *trow = col + ksize;
+      for (int y=-khalfsize; y<ypxl+khalfsize; y++){
+        float *t = tmp + (size_t)(y+khalfsize)*xpxl;
+        for (int xx=0; xx<xpxl; xx++)
+          t[xx] = 0;
+        for (int xks=-khalfsize; xks<=khalfsize; xks++){
+          float w = trow[khalfsize+xks];
+          unsigned short int *row = image + (long)y*istride + xks;
+          for (int xx=0; xx<xpxl; xx++)
+            t[xx] += w*row[xx];
+        }
+      }
+      for (int yy=0; yy<ypxl; yy++){
+        float *arow = acc + (size_t)yy*xpxl;
+        for (int i=0; i<ksize; i++){
+          float  w = col[i];
+          float *t = tmp + (size_t)(yy+i)*xpxl;
+          for (int xx=0; xx<xpxl; xx++)
+            arow[xx] += w*t[xx];
+        }
+      }
+    }
+    free(tmp);
+  }
+
+  for (int yy=0; yy<ypxl; yy++)
+    for (int xx=0; xx<xpxl; xx++){
+      float v = roundf( acc[(size_t)yy*xpxl+xx]/knorm );
+      out[(long)yy*ostride+xx] = (v < 0)? 0 : ((v > maxval)? maxval : v);
+    }
+  free(acc);
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               BLUR PADDED SUB IMAGE
+
+
+void blur_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize )
+/*
+  image points to the first pixel of a region of xpxl x ypxl pixels (rows of istride 
+  pixels) surrounded by an apron of at least khalfsize pixels on every side, already 
+  filled with the halo and, outside the image, by fill_apron. Thus no border check is 
+  needed inside the kernel loops. The result is stored in out (rows of ostride pixels).
+ */
+{
+  if (median_filter){
+    median_padded( image, istride, out, ostride, xpxl, ypxl, khalfsize );
+    return;
+  }
+  for ( int yy = 0; yy < ypxl; yy++ ){
+    for( int xx = 0; xx < xpxl; xx++ ){
+      unsigned short int *center = image + (long)yy*istride + xx;
+      double xxyy = 0;
+      for (int yks=-khalfsize; yks<khalfsize+1; yks++){
+        unsigned short int *row = center + (long)yks*istride;
+        for (int xks=-khalfsize; xks<khalfsize+1; xks++)
+          xxyy += kernel[khalfsize+yks][khalfsize+xks]*row[xks];
+      }
+      out[(long)yy*ostride+xx] = round(xxyy/knorm);
+    }
+  }
+}
+
+
+void filter_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, int x0, int y0, int xsize, int ysize, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize )
+/*
+ * the filter of the command line on a region at (x0, y0) in an image of xsize x ysize, 
+ * with the conventions of blur_padded: the bilateral and morphological filters need the 
+ * position of the region, the kernels and the median do not
+ */
+{
+  if (bil.on)
+    bilateral_padded( image, istride, out, ostride, xpxl, ypxl, x0, y0, xsize, ysize, bil.ss, bil.sr );
+  else if (morph_op)
+    morph_padded( image, istride, out, ostride, xpxl, ypxl, x0, y0, xsize, ysize, khalfsize, morph_op );
+  else if (ckernel.terms != NULL)
+    custom_padded( image, istride, out, ostride, xpxl, ypxl, ksize, &kernel[0][0], knorm, ckernel.maxval, ckernel.rank, ckernel.terms );
+  else
+    blur_padded( image, istride, out, ostride, xpxl, ypxl, ksize, kernel, knorm, khalfsize );
+}
+
+
+// ============================================================================================================================================================
+
+
+//                               EDGE MODES
+
+
+/*
+  The part of the apron falling outside the image is filled according to the edge mode:
+  
+    EDGE_ZERO    pixels outside the image are 0 (the apron is simply never written)
+    EDGE_CLAMP   they repeat the closest pixel of the image          aaa|abcd...
+    EDGE_MIRROR  they reflect the image, edge pixel included         cba|abcd...
+*/
+
+#define EDGE_ZERO   0
+#define EDGE_CLAMP  1
+#define EDGE_MIRROR 2
+const char *edge_names[3] = {"zero", "clamp", "mirror"};
+
+
+int edge_index( int i, int size, int edge )
+/*
+ * pixel of the image providing the value of the pixel i, which may be outside [0, size)
+ */
+{
+  if (edge == EDGE_MIRROR)
+    i = (i < 0)? -1-i : ((i >= size)? 2*size-1-i : i);
+  return (i < 0)? 0 : ((i >= size)? size-1 : i);
+}
+
+
+void fill_apron( unsigned short int *image, int xstride, size_t plane, int nch, int xpxl, int ypxl, int pad, int start_x, int start_y, int xsize, int ysize, int edge )
+/*
+ * image points to the first pixel of the sub-image (xpxl x ypxl pixels starting at start_x, 
+ * start_y in the image) in the first of nch planes of plane pixels, with rows of xstride 
+ * pixels and an apron of pad pixels already holding the halos. The pixels of the apron 
+ * outside the image are set from the rows first and then from the columns, so that the 
+ * corners get the value of the closest corner (clamp) or of the reflected one (mirror).
+ */
+{
+  if (edge == EDGE_ZERO)
+    return;
+  for (int c=0; c<nch; c++){
+    unsigned short int *p = image + c*plane;
+    for (int yy=-pad; yy<ypxl+pad; yy++){
+      if (start_y+yy >= 0 && start_y+yy < ysize) continue;
+      int sy = edge_index(start_y+yy, ysize, edge) - start_y;
+      memcpy( p + (long)yy*xstride - pad, p + (long)sy*xstride - pad, (xpxl+2*pad)*sizeof(short int) );
+    }
+    for (int yy=-pad; yy<ypxl+pad; yy++){
+      unsigned short int *row = p + (long)yy*xstride;
+      for (int xx=-pad; xx<0; xx++)
+        if (start_x+xx < 0)      row[xx] = row[edge_index(start_x+xx, xsize, edge) - start_x];
+      for (int xx=xpxl; xx<xpxl+pad; xx++)
+        if (start_x+xx >= xsize) row[xx] = row[edge_index(start_x+xx, xsize, edge) - start_x];
+    }
+  }
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               DECOMPOSITION PLANNER
+
+
+/*
+  The Cartesian grid thpos[0] x thpos[1] is chosen among all the factorisations of nths,
+  which include the row strips (1 x nths grid), instead of relying on MPI_Dims_create,
+  which ignores the shape of the image and the size of the kernel.
+
+  Every candidate is scored with a cost model in units of kernel taps: every rank costs
+  xpxl*ypxl*ksize*ksize for the blurring, HALO_COST for each halo pixel it receives and
+  MSG_COST for each message (one per neighbour, corners included). The slowest rank sets
+  the elapsed time, so the cost of a plan is the maximum over the ranks: in this way
+  compute, halo volume and load imbalance are all accounted for.
+
+  Sub-images of different rows holding a different number of columns (the "uneven"
+  plans of the OpenMP code) do not fit a Cartesian topology and are not considered.
+*/
+
+#define PLAN_GRID   0
+#define PLAN_STRIPS 1
+#define HALO_COST   2.0      // cost of sending and receiving a halo pixel, in kernel taps
+#define MSG_COST    2000.0   // latency of a message, in kernel taps
+
+const char *plan_names[2] = {"grid", "strips"};
+
+typedef struct {
+  int    kind;                // PLAN_GRID or PLAN_STRIPS
+  int    thpos[2];            // divisions along x and y
+  double cost;                // max over the ranks of compute + halo + messages
+  double compute;             // mean compute per rank
+  double imbalance;           // cost - mean cost per rank
+  double halo;                // total number of halo pixels
+} plan;
+
+
+void plan_cost( plan *pl, int nths, int xsize, int ysize, int khalfsize )
+{
+  int ksize = 2*khalfsize+1;
+  double sum = 0;
+  pl->cost = pl->compute = pl->halo = 0;
+  for (int xxth=0; xxth<pl->thpos[0]; xxth++){
+    for (int yyth=0; yyth<pl->thpos[1]; yyth++){
+      int xpxl, ypxl, start_x, start_y;
+      long start_idx;
+      identify_thread(xxth, yyth, &xpxl, &ypxl, &start_idx, &start_x, &start_y, pl->thpos, 0, xsize, ysize);
+
+      // the halo is not needed on the borders of the image
+      int left  = (xxth > 0)?              khalfsize : 0;
+      int right = (xxth < pl->thpos[0]-1)? khalfsize : 0;
+      int up    = (yyth > 0)?              khalfsize : 0;
+      int down  = (yyth < pl->thpos[1]-1)? khalfsize : 0;
+      int nmsg  = (left>0) + (right>0) + (up>0) + (down>0) 
+	        + (left>0 && up>0) + (left>0 && down>0) + (right>0 && up>0) + (right>0 && down>0);
+      double halo    = (double)(xpxl+left+right)*(ypxl+up+down) - (double)xpxl*ypxl;
+      double compute = (double)xpxl*ypxl*ksize*ksize;
+      double cost    = compute + HALO_COST*halo + MSG_COST*nmsg;
+
+      if (cost > pl->cost) pl->cost = cost;
+      pl->compute += compute/nths;
+      pl->halo    += halo;
+      sum         += cost;
+    }
+  }
+  pl->imbalance = pl->cost - sum/nths;
+}
+
+
+int plan_fits( plan *pl, int xsize, int ysize, int khalfsize )
+/*
+ * 1 if every sub-image of the plan is at least as large as the halo along the axes where
+ * it has neighbours, so that the halos can be taken from the nearest neighbours only
+ */
+{
+  return (pl->thpos[0] == 1 || xsize/pl->thpos[0] >= khalfsize) && (pl->thpos[1] == 1 || ysize/pl->thpos[1] >= khalfsize);
+}
+
+
+plan plan_decomposition( int nths, int xsize, int ysize, int khalfsize, int kind, int nthsx, int nthsy )
+/*
+ * returns the cheapest plan. kind < 0 lets the planner choose among all kinds; a
+ * grid given by the user (nthsx*nthsy = nths) is used as it is.
+ */
+{
+  plan best, pl;
+  best.cost = -1;
+
+  if (nthsx > 0 && nthsy > 0){
+    best.kind     = (nthsx == 1 && nthsy > 1)? PLAN_STRIPS : PLAN_GRID;
+    best.thpos[0] = nthsx;
+    best.thpos[1] = nthsy;
+    plan_cost( &best, nths, xsize, ysize, khalfsize );
+    return best;
+  }
+
+  for (int ny=1; ny<=nths; ny++){
+    if (nths%ny != 0) continue;
+    pl.kind     = (ny == nths && nths > 1)? PLAN_STRIPS : PLAN_GRID;
+    pl.thpos[0] = nths/ny;
+    pl.thpos[1] = ny;
+    // sub-images must be at least as large as the halo, which is taken from the nearest neighbours only
+    if (!plan_fits( &pl, xsize, ysize, khalfsize ) || (kind >= 0 && kind != pl.kind)) continue;
+    plan_cost( &pl, nths, xsize, ysize, khalfsize );
+    if (best.cost < 0 || pl.cost < best.cost) best = pl;
+  }
+
+  // e.g. strips requested but impossible: fall back to any plan
+  if (best.cost < 0 && kind >= 0)
+    return plan_decomposition( nths, xsize, ysize, khalfsize, -1, 0, 0 );
+  // very small images: use the default of MPI
+  if (best.cost < 0){
+    best.kind     = PLAN_GRID;
+    best.thpos[0] = best.thpos[1] = 0;
+    MPI_Dims_create(nths, 2, best.thpos);
+    plan_cost( &best, nths, xsize, ysize, khalfsize );
+  }
+  return best;
+}
+
+
+void print_plan( plan *pl )
+{
+  printf("Decomposition: %s %dx%d (cost %.4g taps: compute %.4g, imbalance %.4g, halo %.0f pixels)\n", 
+	 plan_names[pl->kind], pl->thpos[0], pl->thpos[1], pl->cost, pl->compute, pl->imbalance, pl->halo);
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               OPTIONS
+
+
+#define HALO_SENDRECV 0
+#define HALO_RMA      1
+
+const char *halo_names[2] = {"sendrecv", "rma"};
+
+typedef struct {
+  char *trace_name;     // --trace file : timeline in Chrome trace-event format
+  int   plan_kind;      // --plan grid|strips : kind of decomposition (-1 = auto)
+  int   nthsx, nthsy;   // --grid NXxNY : decomposition given by the user
+  int   dynamic;        // --dynamic tile_size : tiles handed out on demand (0 = automatic size)
+  int   iterations;     // --iterations N : number of times the blur is applied
+  int   halo_depth;     // --halo-depth k : iterations between halo exchanges (0 = automatic)
+  int   edge;           // --edge zero|clamp|mirror : pixels outside the image
+  int   roi[4];         // --roi x,y,w,h : blur only this region of interest (w = 0: the whole image)
+  int   roi_full;       // --roi-full : write the whole image with the ROI blurred, instead of the ROI alone
+  int   shm;            // --shm : halos of the ranks on the same node through shared memory
+  int   halo;           // --halo sendrecv|rma : two-sided or one-sided exchange of the halos
+  char *batch_name;     // --batch list : blur the "input output" pairs of the list, a team of ranks per image
+  char *kernel_name;    // --kernel file : custom kernel, see read_kernel
+  double kernel_tol;    // --kernel-tol eps : relative error of its separable terms, see separate_kernel
+} options;
+
+
+int read_options( int argc, char **argv, options *opts )
+/*
+ * Optional "--name value" arguments can be placed anywhere on the command line.
+ * They are removed from argv, so that the positional parameters keep their meaning,
+ * and the new argc is returned.
+ */
+{
+  opts->trace_name = NULL;
+  opts->plan_kind  = -1;
+  opts->nthsx      = 0;
+  opts->nthsy      = 0;
+  opts->dynamic    = -1;
+  opts->iterations = 1;
+  opts->halo_depth = 0;
+  opts->edge       = EDGE_ZERO;
+  opts->roi[0] = opts->roi[1] = opts->roi[2] = opts->roi[3] = 0;
+  opts->roi_full   = 0;
+  opts->shm        = 0;
+  opts->halo       = HALO_SENDRECV;
+  opts->batch_name = NULL;
+  opts->kernel_name = NULL;
+  opts->kernel_tol  = KERNEL_TOL;
+
+  int nargs = 1;
+  for (int i=1; i<argc; i++){
+    if ( strcmp(argv[i], "--trace")==0 && i+1<argc ){
+      opts->trace_name = argv[++i];
+    }
+    else if ( strcmp(argv[i], "--plan")==0 && i+1<argc ){
+      i++;
+      for (int k=0; k<2; k++)
+        if ( strcmp(argv[i], plan_names[k])==0 ) opts->plan_kind = k;
+      if ( strcmp(argv[i], "uneven")==0 ){
+        int rank;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        if ( rank == 0 )
+          printf("uneven plans are not available with a Cartesian grid, choosing automatically\n");
+      }
+      else if ( opts->plan_kind < 0 && strcmp(argv[i], "auto")!=0 ){
+        printf("Invalid plan %s\n", argv[i]);
+        return -1;
+      }
+    }
+    else if ( strcmp(argv[i], "--dynamic")==0 && i+1<argc ){
+      opts->dynamic = atoi(argv[++i]);
+    }
+    else if ( strcmp(argv[i], "--iterations")==0 && i+1<argc ){
+      opts->iterations = atoi(argv[++i]);
+      if ( opts->iterations < 1 ){
+        printf("Invalid number of iterations\n");
+        return -1;
+      }
+    }
+    else if ( strcmp(argv[i], "--halo-depth")==0 && i+1<argc ){
+      opts->halo_depth = atoi(argv[++i]);
+    }
+    else if ( strcmp(argv[i], "--edge")==0 && i+1<argc ){
+      i++;
+      opts->edge = -1;
+      for (int k=0; k<3; k++)
+        if ( strcmp(argv[i], edge_names[k])==0 ) opts->edge = k;
+      if ( opts->edge < 0 ){
+        printf("Invalid edge mode %s\n", argv[i]);
+        return -1;
+      }
+    }
+    else if ( strcmp(argv[i], "--roi")==0 && i+1<argc ){
+      int *r = opts->roi;
+      if ( sscanf(argv[++i], "%d,%d,%d,%d", &r[0], &r[1], &r[2], &r[3])!=4 || r[0]<0 || r[1]<0 || r[2]<1 || r[3]<1 ){
+        printf("Invalid ROI %s\n", argv[i]);
+        return -1;
+      }
+    }
+    else if ( strcmp(argv[i], "--roi-full")==0 ){
+      opts->roi_full = 1;
+    }
+    else if ( strcmp(argv[i], "--shm")==0 ){
+      opts->shm = 1;
+    }
+    else if ( strcmp(argv[i], "--halo")==0 && i+1<argc ){
+      i++;
+      opts->halo = -1;
+      for (int k=0; k<2; k++)
+        if ( strcmp(argv[i], halo_names[k])==0 ) opts->halo = k;
+      if ( opts->halo < 0 ){
+        printf("Invalid halo exchange %s\n", argv[i]);
+        return -1;
+      }
+    }
+    else if ( strcmp(argv[i], "--kernel")==0 && i+1<argc ){
+      opts->kernel_name = argv[++i];
+    }
+    else if ( strcmp(argv[i], "--kernel-tol")==0 && i+1<argc ){
+      opts->kernel_tol = atof(argv[++i]);
+      if ( opts->kernel_tol < 0 ){
+        printf("Invalid kernel tolerance %s\n", argv[i]);
+        return -1;
+      }
+    }
+    else if ( strcmp(argv[i], "--batch")==0 && i+1<argc ){
+      opts->batch_name = argv[++i];
+    }
+    else if ( strcmp(argv[i], "--grid")==0 && i+1<argc ){
+      if ( sscanf(argv[++i], "%dx%d", &opts->nthsx, &opts->nthsy)!=2 || opts->nthsx<1 || opts->nthsy<1 ){
+        printf("Invalid grid %s\n", argv[i]);
+        return -1;
+      }
+    }
+    else if ( strncmp(argv[i], "--", 2)==0 ){
+      printf("Unknown option %s\n", argv[i]);
+      return -1;
+    }
+    else argv[nargs++] = argv[i];
+  }
+  argv[nargs] = NULL;
+  return nargs;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               TRACE
+
+
+/*
+  Timeline of the run in Chrome trace-event format, to be opened with chrome://tracing
+  or ui.perfetto.dev. Every process records its own events; trace_write gathers them on
+  the master, which writes a single file with one track (pid) per rank.
+  Timestamps are taken from MPI_Wtime after a barrier, so that all the ranks share the
+  same origin.
+*/
+
+#define TRACE_MAXEV 64
+
+typedef struct {
+  char   name[32];
+  double begin, end;  // seconds since trace_start
+} trace_event;
+
+int          trace_on  = 0;
+double       trace_t0;
+trace_event  trace_ev[TRACE_MAXEV];
+int          trace_nev = 0;
+
+
+void trace_start( MPI_Comm comm )
+{
+  MPI_Barrier(comm);
+  trace_on  = 1;
+  trace_t0  = MPI_Wtime();
+  trace_nev = 0;
+}
+
+
+void trace_record( const char *name, double begin, double end )
+{
+  if ( !trace_on || trace_nev == TRACE_MAXEV )
+    return;
+  trace_event *ev = &trace_ev[trace_nev++];
+  strncpy(ev->name, name, sizeof(ev->name)-1);
+  ev->name[sizeof(ev->name)-1] = '\0';
+  ev->begin = begin - trace_t0;
+  ev->end   = end   - trace_t0;
+}
+
+
+void trace_write( const char *trace_name, MPI_Comm comm )
+/*
+ * the events are gathered as raw bytes by the master, which writes one complete ("X")
+ * event per record, timestamps in microseconds
+ */
+{
+  int thid, nths;
+  MPI_Comm_rank(comm, &thid);
+  MPI_Comm_size(comm, &nths);
+
+  int *nev = NULL, *displs = NULL, *bytes = NULL;
+  trace_event *all = NULL;
+  if (thid == 0){
+    nev    = (int*)malloc( nths*sizeof(int) );
+    bytes  = (int*)malloc( nths*sizeof(int) );
+    displs = (int*)malloc( nths*sizeof(int) );
+  }
+  MPI_Gather(&trace_nev, 1, MPI_INT, nev, 1, MPI_INT, 0, comm);
+
+  int total = 0;
+  if (thid == 0){
+    for (int i=0; i<nths; i++){
+      bytes[i]  = nev[i]*sizeof(trace_event);
+      displs[i] = total*sizeof(trace_event);
+      total    += nev[i];
+    }
+    all = (trace_event*)malloc( (total>0? total : 1)*sizeof(trace_event) );
+  }
+  MPI_Gatherv(trace_ev, trace_nev*sizeof(trace_event), MPI_BYTE, all, bytes, displs, MPI_BYTE, 0, comm);
+
+  if (thid == 0){
+    FILE *trace_file = fopen(trace_name, "w");
+    if ( trace_file == NULL )
+      printf("cannot open trace file %s\n", trace_name);
+    else {
+      fprintf(trace_file, "{\"traceEvents\":[\n");
+      trace_event *ev = all;
+      int topology;
+      MPI_Topo_test(comm, &topology);
+      for (int rank=0; rank<nths; rank++){
+        // ranks of a Cartesian communicator are labelled with their coordinates
+        char label[32];
+        int  coords[2];
+        if (topology == MPI_CART){
+          MPI_Cart_coords(comm, rank, 2, coords);
+          snprintf(label, sizeof(label), "rank %d (%d,%d)", rank, coords[0], coords[1]);
+        }
+        else snprintf(label, sizeof(label), "rank %d", rank);
+        fprintf(trace_file, "%s{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}}",
+		(rank==0)? "" : ",\n", rank, label);
+        fprintf(trace_file, ",\n{\"name\":\"process_sort_index\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"sort_index\":%d}}", rank, rank);
+        fprintf(trace_file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"args\":{\"name\":\"thread 0\"}}", rank);
+        for (int e=0; e<nev[rank]; e++, ev++)
+          fprintf(trace_file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":0,\"ts\":%.3f,\"dur\":%.3f}",
+		  ev->name, rank, ev->begin*1e6, (ev->end-ev->begin)*1e6);
+      }
+      fprintf(trace_file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+      fclose(trace_file);
+    }
+    free(nev);
+    free(bytes);
+    free(displs);
+    free(all);
+  }
+  trace_on = 0;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               GATHERING OF LARGE IMAGES
+
+
+/*
+  Counts and displacements of MPI are int: a 16-bit image of more than 2^31 pixels (e.g. 
+  60000x60000) cannot be collected by a single MPI_Gatherv, whose displacements index the 
+  whole image. When they would not fit, the results are sent to the master in messages of 
+  at most GATHER_MAX values each instead, bands of whole rows of the sub-images, which the 
+  master receives directly at their place in the image: displacements are then pointers 
+  computed in size_t, and every count fits an int.
+  GATHER_MAX can be lowered at compile time (-DGATHER_MAX=...) to exercise this path on 
+  small images.
+*/
+
+#ifndef GATHER_MAX
+#define GATHER_MAX INT_MAX   // largest count of a single message, in values
+#endif
+
+
+void gather_values( unsigned short int *send, long nsend, unsigned short int *recv, int master, MPI_Comm comm )
+/*
+ * gathers on the master the nsend values of every rank into recv, one rank after the other
+ */
+{
+  int thid, nths;
+  MPI_Comm_rank(comm, &thid);
+  MPI_Comm_size(comm, &nths);
+  long nrank[nths];
+  MPI_Gather(&nsend, 1, MPI_LONG, nrank, 1, MPI_LONG, master, comm);
+
+  if (thid != master){
+    for (long sent=0; sent<nsend; sent+=GATHER_MAX){
+      int count = (nsend-sent > GATHER_MAX)? GATHER_MAX : nsend-sent;
+      MPI_Send(send + sent, count, MPI_UNSIGNED_SHORT, master, 789, comm);
+    }
+    return;
+  }
+  for (int i=0; i<nths; i++){
+    if (i == master)
+      memcpy(recv, send, nsend*sizeof(short int));
+    else
+      for (long got=0; got<nrank[i]; got+=GATHER_MAX){
+        int count = (nrank[i]-got > GATHER_MAX)? GATHER_MAX : nrank[i]-got;
+        MPI_Recv(recv + got, count, MPI_UNSIGNED_SHORT, i, 789, comm, MPI_STATUS_IGNORE);
+      }
+    recv += nrank[i];
+  }
+}
+
+
+void gather_rows( unsigned short int *sub, int xpxl, int ypxl, int nch, unsigned short int *image, int xsize, int ysize, long *start_idx, int *xpxls, int *ypxls, int master, MPI_Comm comm )
+/*
+ * gathers on the master the nch planes of the sub-images of all the ranks (xpxl x ypxl pixels 
+ * each, starting at start_idx in the image) into the nch planes of image. xpxls, ypxls and
+ * start_idx hold the values of all the ranks.
+ */
+{
+  int thid, nths;
+  MPI_Comm_rank(comm, &thid);
+  MPI_Comm_size(comm, &nths);
+  size_t plane = (size_t)xsize*ysize;
+
+  if (thid != master){
+    int band = (xpxl < GATHER_MAX)? GATHER_MAX/xpxl : 1;
+    for (int c=0; c<nch; c++)
+      for (int y=0; y<ypxl; y+=band){
+        int rows = (ypxl-y > band)? band : ypxl-y;
+        MPI_Send(sub + c*(size_t)xpxl*ypxl + (size_t)y*xpxl, rows*xpxl, MPI_UNSIGNED_SHORT, master, 790, comm);
+      }
+    return;
+  }
+  for (int i=0; i<nths; i++){
+    unsigned short int *dst = image + start_idx[i];
+    if (i == master){
+      for (int c=0; c<nch; c++)
+        for (int y=0; y<ypxl; y++)
+          memcpy(dst + c*plane + (size_t)y*xsize, sub + c*(size_t)xpxl*ypxl + (size_t)y*xpxl, xpxl*sizeof(short int));
+      continue;
+    }
+    // every band is received as a vector of rows of the image
+    int band = (xpxls[i] < GATHER_MAX)? GATHER_MAX/xpxls[i] : 1;
+    for (int c=0; c<nch; c++)
+      for (int y=0; y<ypxls[i]; y+=band){
+        int rows = (ypxls[i]-y > band)? band : ypxls[i]-y;
+        MPI_Datatype rows_type;
+        MPI_Type_vector(rows, xpxls[i], xsize, MPI_UNSIGNED_SHORT, &rows_type);
+        MPI_Type_commit(&rows_type);
+        MPI_Recv(dst + c*plane + (size_t)y*xsize, 1, rows_type, i, 790, comm, MPI_STATUS_IGNORE);
+        MPI_Type_free(&rows_type);
+      }
+  }
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               DYNAMIC DISTRIBUTION OF TILES
+
+
+/*
+  With a fixed block per rank, a slow or oversubscribed node stalls everybody at the final
+  MPI_Gatherv. In the dynamic mode the image is instead divided into square tiles of 
+  tile_size pixels, handed out on demand through a shared counter living in an RMA window 
+  on the master: every rank atomically fetches and increments it (MPI_Fetch_and_op) to get
+  its next tile, reads the tile plus its halo directly from the file, blurs it and keeps
+  the result. Faster ranks simply take more tiles. At the end the tiles are gathered by the
+  master, together with their ids, and placed into the final image.
+*/
+
+
+void read_tile( FILE *file, const tiled_image *timg, long data_start, int xsize, int ysize, int x0, int y0, int xpxl, int ypxl, int pad, int color_depth, unsigned char *tile )
+/*
+ * reads the rows of the tile starting at (x0, y0), extended by pad pixels on every side,
+ * into tile, which must hold (xpxl+2*pad)*(ypxl+2*pad) zeroed pixels of color_depth bytes 
+ * each, as in the file. The part of the apron falling outside the image is left to zero.
+ * From a tiled image (timg not NULL) only the chunks overlapping the tile are read.
+ */
+{
+  int xstride = xpxl + 2*pad;
+  int xfirst  = (x0-pad < 0)? 0 : x0-pad;
+  int xlast   = (x0+xpxl+pad > xsize)? xsize : x0+xpxl+pad;
+  if (timg != NULL){
+    int yfirst = (y0-pad < 0)? 0 : y0-pad;
+    int ylast  = (y0+ypxl+pad > ysize)? ysize : y0+ypxl+pad;
+    if ( tiled_read_region( timg, xfirst, yfirst, xlast-xfirst, ylast-yfirst, tile + ((long)(yfirst-y0+pad)*xstride + (xfirst-x0+pad))*color_depth, xstride ) != 0 )
+      printf("wrong size\n");
+    return;
+  }
+  for (int y=y0-pad; y<y0+ypxl+pad; y++){
+    if (y < 0 || y >= ysize) continue;
+    fseek(file, data_start + ((long)y*xsize + xfirst)*color_depth, SEEK_SET);
+    if ( fread( tile + ((long)(y-y0+pad)*xstride + (xfirst-x0+pad))*color_depth, color_depth, xlast-xfirst, file) != (size_t)(xlast-xfirst) )
+      printf("wrong size\n");
+  }
+}
+
+
+void blur_dynamic( FILE *file, const tiled_image *timg, int xsize, int ysize, int maxval, int nch, int tile_size, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize, int edge, const char *output_image_name, MPI_Comm comm )
+{
+  int thid, nths;
+  const int master = 0;
+  MPI_Comm_rank(comm, &thid);
+  MPI_Comm_size(comm, &nths);
+
+  // pixel data start right after the header, where read_header left the file
+  long data_start  = (file != NULL)? ftell(file) : 0;
+  int  color_depth = (1 + ( maxval > 255 ))*nch;
+
+  // a dozen tiles per rank by default, never smaller than the kernel
+  if (tile_size <= 0)
+    tile_size = (int)sqrt((double)xsize*ysize/(12.*nths));
+  if (tile_size < ksize) tile_size = ksize;
+  int ntilesx = (xsize+tile_size-1)/tile_size;
+  int ntilesy = (ysize+tile_size-1)/tile_size;
+  int ntiles  = ntilesx*ntilesy;
+
+  // ---------------------------------------------
+  // shared counter on the master
+  int *counter;
+  MPI_Win win;
+  MPI_Win_allocate( (thid==master)? sizeof(int) : 0, sizeof(int), MPI_INFO_NULL, comm, &counter, &win);
+  if (thid==master){
+    MPI_Win_lock(MPI_LOCK_EXCLUSIVE, master, 0, win);
+    *counter = 0;
+    MPI_Win_unlock(master, win);
+  }
+  MPI_Barrier(comm);
+
+  // ---------------------------------------------
+  // take tiles until there are none left
+  // results hold the nch planes of every tile one after the other
+  int  mytiles = 0, capacity = ntiles/nths + 1;
+  long mypixels = 0;
+  int *tile_ids = (int*)malloc( capacity*sizeof(int) );
+  size_t tile_area = (size_t)(tile_size+2*khalfsize)*(tile_size+2*khalfsize);
+  unsigned short int *results = (unsigned short int*)malloc( (size_t)capacity*tile_size*tile_size*nch*sizeof(short int) );
+  unsigned short int *tile    = (unsigned short int*)malloc( tile_area*nch*sizeof(short int) );
+  unsigned char      *raw     = (unsigned char*)malloc( tile_area*color_depth );
+  double busy = 0;
+
+  int one = 1, next;
+  while (1){
+    MPI_Win_lock(MPI_LOCK_SHARED, master, 0, win);
+    MPI_Fetch_and_op(&one, &next, MPI_INT, master, 0, MPI_SUM, win);
+    MPI_Win_unlock(master, win);
+    if (next >= ntiles) break;
+
+    double tt = MPI_Wtime();
+    int x0   = (next%ntilesx)*tile_size;
+    int y0   = (next/ntilesx)*tile_size;
+    int xpxl = (x0+tile_size > xsize)? xsize-x0 : tile_size;
+    int ypxl = (y0+tile_size > ysize)? ysize-y0 : tile_size;
+
+    if (mytiles == capacity){
+      capacity *= 2;
+      tile_ids = (int*)realloc( tile_ids, capacity*sizeof(int) );
+      results  = (unsigned short int*)realloc( results, (size_t)capacity*tile_size*tile_size*nch*sizeof(short int) );
+    }
+
+    int xstride = xpxl + 2*khalfsize;
+    int ystride = ypxl + 2*khalfsize;
+    memset(raw, 0, (size_t)xstride*ystride*color_depth);
+    read_tile( file, timg, data_start, xsize, ysize, x0, y0, xpxl, ypxl, khalfsize, color_depth, raw );
+    deinterleave_image( raw, tile, xstride, ystride, maxval, nch );
+    fill_apron( tile + khalfsize*xstride + khalfsize, xstride, (size_t)xstride*ystride, nch, xpxl, ypxl, khalfsize, x0, y0, xsize, ysize, edge );
+    for (int c=0; c<nch; c++)
+      filter_padded( tile + (size_t)c*xstride*ystride + khalfsize*xstride + khalfsize, xstride, results + (size_t)mypixels*nch + (size_t)c*xpxl*ypxl, xpxl, xpxl, ypxl, x0, y0, xsize, ysize, ksize, kernel, knorm, khalfsize );
+
+    tile_ids[mytiles++] = next;
+    mypixels += (long)xpxl*ypxl;
+    busy     += MPI_Wtime() - tt;
+
+    char event_name[32];
+    snprintf(event_name, sizeof(event_name), "tile %d", next);
+    trace_record( event_name, tt, MPI_Wtime() );
+  }
+  if (file != NULL) fclose(file);
+  free(tile);
+  free(raw);
+  MPI_Win_free(&win);
+
+  // ---------------------------------------------
+  // gather the tiles on the master
+
+  double tt = MPI_Wtime();
+  int    *ntiles_rank = NULL, *displs_tiles = NULL, *displs_pixels = NULL;
+  long   *npixels_rank = NULL;
+  double *busy_rank   = NULL;
+  int    *all_ids     = NULL;
+  unsigned short int *all_results = NULL;
+  if (thid==master){
+    ntiles_rank   = (int*)malloc( nths*sizeof(int) );
+    npixels_rank  = (long*)malloc( nths*sizeof(long) );
+    displs_tiles  = (int*)malloc( nths*sizeof(int) );
+    displs_pixels = (int*)malloc( nths*sizeof(int) );
+    busy_rank     = (double*)malloc( nths*sizeof(double) );
+    all_ids       = (int*)malloc( ntiles*sizeof(int) );
+    all_results   = (unsigned short int*)malloc( (size_t)xsize*ysize*nch*sizeof(short int) );
+  }
+  MPI_Gather(&mytiles,  1, MPI_INT,    ntiles_rank,  1, MPI_INT,    master, comm);
+  MPI_Gather(&mypixels, 1, MPI_LONG,   npixels_rank, 1, MPI_LONG,   master, comm);
+  MPI_Gather(&busy,     1, MPI_DOUBLE, busy_rank,    1, MPI_DOUBLE, master, comm);
+  // every pixel carries nch values: beyond GATHER_MAX of them in all, they no longer fit
+  // the int displacements of MPI_Gatherv (see gather_values)
+  int  large = ((long)xsize*ysize*nch > GATHER_MAX);
+  int *nvalues_rank = NULL;
+  if (thid==master){
+    nvalues_rank = (int*)malloc( nths*sizeof(int) );
+    displs_tiles[0] = displs_pixels[0] = 0;
+    for (int i=0; i<nths; i++){
+      nvalues_rank[i] = (large)? 0 : npixels_rank[i]*nch;
+      if (i == 0) continue;
+      displs_tiles[i]  = displs_tiles[i-1]  + ntiles_rank[i-1];
+      displs_pixels[i] = displs_pixels[i-1] + nvalues_rank[i-1];
+    }
+  }
+  MPI_Gatherv(tile_ids, mytiles,      MPI_INT,            all_ids,     ntiles_rank,  displs_tiles,  MPI_INT,            master, comm);
+  if (large)
+    gather_values( results, mypixels*nch, all_results, master, comm );
+  else
+    MPI_Gatherv(results, mypixels*nch, MPI_UNSIGNED_SHORT, all_results, nvalues_rank, displs_pixels, MPI_UNSIGNED_SHORT, master, comm);
+  free(tile_ids);
+  free(results);
+
+  if (thid==master){
+    // tiles come in the order they were taken by each rank
+    size_t plane = (size_t)xsize*ysize;
+    unsigned short int *final_pointer = (unsigned short int*)malloc( plane*nch*sizeof(short int) );
+    unsigned short int *src = all_results;
+    for (int t=0; t<ntiles; t++){
+      int id   = all_ids[t];
+      int x0   = (id%ntilesx)*tile_size;
+      int y0   = (id/ntilesx)*tile_size;
+      int xpxl = (x0+tile_size > xsize)? xsize-x0 : tile_size;
+      int ypxl = (y0+tile_size > ysize)? ysize-y0 : tile_size;
+      for (int c=0; c<nch; c++){
+        for (int yy=0; yy<ypxl; yy++)
+          memcpy( final_pointer + c*plane + (long)(y0+yy)*xsize + x0, src + (size_t)yy*xpxl, xpxl*sizeof(short int) );
+        src += (size_t)xpxl*ypxl;
+      }
+    }
+    trace_record( "gather", tt, MPI_Wtime() );
+
+    printf("Dynamic tiles: %d tiles of %dx%d pixels\n", ntiles, tile_size, tile_size);
+    for (int i=0; i<nths; i++)
+      printf("  rank %3d: %5d tiles, %10ld pixels, busy %f s\n", i, ntiles_rank[i], npixels_rank[i], busy_rank[i]);
+
+    tt = MPI_Wtime();
+    unsigned char *raw_image = (unsigned char*)malloc( plane*color_depth );
+    interleave_image( final_pointer, raw_image, xsize, ysize, maxval, nch );
+    write_pgm_image( raw_image, maxval, xsize, ysize, nch, output_image_name);
+    trace_record( "write", tt, MPI_Wtime() );
+
+    free(raw_image);
+    free(final_pointer);
+    free(nvalues_rank);
+    free(all_results);
+    free(all_ids);
+    free(ntiles_rank);
+    free(npixels_rank);
+    free(displs_tiles);
+    free(displs_pixels);
+    free(busy_rank);
+  }
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               SHARED-MEMORY AND ONE-SIDED HALOS
+
+
+/*
+  With --shm the ranks running on the same node (MPI_Comm_split_type with 
+  MPI_COMM_TYPE_SHARED) allocate the padded buffers of blur_iterations in a single window
+  of shared memory (MPI_Win_allocate_shared). A rank then copies the halos of its 
+  neighbours on the node straight from their buffers into its apron, the only 
+  synchronisation being a barrier of the node before the exchange (the neighbours are 
+  done writing) and one after it (everybody is done reading); only the halos of the 
+  neighbours on other nodes are still sent.
+  The Cartesian grid is laid out by shm_grid_order so that every node holds a compact 
+  block of sub-images, as square as the grid allows, which keeps most neighbours on the 
+  same node: with the default order a node would hold a thin column of the grid.
+  SHM_NODE_SIZE, if defined at compile time, splits the ranks into nodes of that many 
+  consecutive ranks instead of the real ones, to exercise the mixed case on one machine.
+*/
+
+typedef struct {
+  MPI_Comm  node;                   // ranks of this node, MPI_COMM_NULL without --shm
+  MPI_Win   win;                    // buffers of the ranks of the node, MPI_WIN_NULL when not allocated
+  unsigned short int **base;        // buffers of every rank of the grid if on this node, NULL otherwise
+} shm_halos;
+
+shm_halos shm = { MPI_COMM_NULL, MPI_WIN_NULL, NULL };
+
+int halo_xsize, halo_ysize;         // of the image, to size the sub-images of the neighbours
+
+
+size_t neighbour_halo( const unsigned short int *buf, const unsigned short int *base, int xstride, int ystride, int nch, int xpxl, int pad, int dx, int dy, int source, MPI_Comm comm, int thpos[2], int *nxstride, size_t *nplane )
+/*
+ * the buffers of every rank hold the two padded copies of its sub-image of blur_iterations,
+ * one after the other. buf being at some place of those starting at base (xstride x ystride 
+ * pixels per plane), returns the offset from the start of the buffers of the neighbour 
+ * source of the first pixel of the halo it sends in the direction (dx, dy) in 
+ * exchange_halo_padded, with buf at the same place in them; also its row stride and plane.
+ */
+{
+  int coords[2], nxpxl, nypxl, nstart_x, nstart_y;
+  long nstart_idx;
+  MPI_Cart_coords(comm, source, 2, coords);
+  identify_thread(coords[0], coords[1], &nxpxl, &nypxl, &nstart_idx, &nstart_x, &nstart_y, thpos, source, halo_xsize, halo_ysize);
+
+  // buf lies in the first or second buffer, at some row and column of the apron
+  int    apron   = (xstride - xpxl)/2;
+  size_t plane   = (size_t)xstride*ystride;
+  size_t off     = buf - base;
+  size_t which   = off/(plane*nch);
+  size_t row     = (off%(plane*nch))/xstride;
+  size_t col     = (off%(plane*nch))%xstride;
+  *nxstride = nxpxl + 2*apron;
+  *nplane   = (size_t)*nxstride*(nypxl + 2*apron);
+  int send_y = pad + ((dy==1)? nypxl-pad : 0);
+  int send_x = pad + ((dx==1)? nxpxl-pad : 0);
+  return which*(*nplane)*nch + (row+send_y)*(*nxstride) + col+send_x;
+}
+
+
+int shm_grid_order( MPI_Comm node, int thpos[2] )
+/*
+ * returns the rank in the Cartesian grid (coordinates x*thpos[1]+y) that this rank should 
+ * take so that its node holds a block of the grid, or -1 (on all ranks) if the nodes have 
+ * different sizes or no block of their size tiles the grid
+ */
+{
+  int thid, nths, ppn, nrank;
+  MPI_Comm_rank(MPI_COMM_WORLD, &thid);
+  MPI_Comm_size(MPI_COMM_WORLD, &nths);
+  MPI_Comm_size(node, &ppn);
+  MPI_Comm_rank(node, &nrank);
+  int sizes[2] = {ppn, -ppn};
+  MPI_Allreduce(MPI_IN_PLACE, sizes, 2, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+  if (sizes[0] != -sizes[1])
+    return -1;
+
+  // block of bx x by sub-images of the least perimeter
+  int bx = 0, by = 0;
+  for (int x=1; x<=ppn; x++)
+    if (ppn%x == 0 && thpos[0]%x == 0 && thpos[1]%(ppn/x) == 0 && (bx == 0 || x+ppn/x < bx+by)){
+      bx = x;
+      by = ppn/x;
+    }
+  if (bx == 0)
+    return -1;
+
+  // nodes are numbered by their first rank in MPI_COMM_WORLD
+  MPI_Comm leaders;
+  int node_id;
+  MPI_Comm_split(MPI_COMM_WORLD, (nrank == 0)? 0 : MPI_UNDEFINED, thid, &leaders);
+  if (nrank == 0){
+    MPI_Comm_rank(leaders, &node_id);
+    MPI_Comm_free(&leaders);
+  }
+  MPI_Bcast(&node_id, 1, MPI_INT, 0, node);
+
+  int nby = thpos[1]/by;
+  int x   = (node_id/nby)*bx + nrank/by;
+  int y   = (node_id%nby)*by + nrank%by;
+  if (thid == 0)
+    printf("Shared memory: %d ranks per node on %d nodes, blocks of %dx%d sub-images\n", ppn, nths/ppn, bx, by);
+  return x*thpos[1] + y;
+}
+
+
+unsigned short int * shm_alloc( size_t count, MPI_Comm comm )
+/*
+ * returns count zeroed pixels of the window of the node for this rank, and finds the
+ * buffers of the other ranks of comm on the node
+ */
+{
+  unsigned short int *buf;
+  MPI_Win_allocate_shared( count*sizeof(short int), sizeof(short int), MPI_INFO_NULL, shm.node, &buf, &shm.win );
+  memset(buf, 0, count*sizeof(short int));
+
+  int nths;
+  MPI_Comm_size(comm, &nths);
+  int ranks[nths], node_ranks[nths];
+  MPI_Group grid_group, node_group;
+  MPI_Comm_group(comm, &grid_group);
+  MPI_Comm_group(shm.node, &node_group);
+  for (int i=0; i<nths; i++) ranks[i] = i;
+  MPI_Group_translate_ranks(grid_group, nths, ranks, node_group, node_ranks);
+  MPI_Group_free(&grid_group);
+  MPI_Group_free(&node_group);
+
+  shm.base = (unsigned short int**)malloc( nths*sizeof(unsigned short int*) );
+  for (int i=0; i<nths; i++){
+    shm.base[i] = NULL;
+    if (node_ranks[i] != MPI_UNDEFINED){
+      MPI_Aint size;
+      int      disp_unit;
+      MPI_Win_shared_query(shm.win, node_ranks[i], &size, &disp_unit, &shm.base[i]);
+    }
+  }
+  // passive target epoch, MPI_Win_sync orders the loads and stores around the barriers
+  MPI_Win_lock_all(MPI_MODE_NOCHECK, shm.win);
+  return buf;
+}
+
+
+void shm_free( void )
+{
+  MPI_Win_unlock_all(shm.win);
+  MPI_Win_free(&shm.win);
+  free(shm.base);
+  shm.base = NULL;
+}
+
+
+void shm_copy_halo( unsigned short int *buf, int xstride, int ystride, int nch, int xpxl, int ypxl, int pad, int dx, int dy, int source, MPI_Comm comm, int thpos[2] )
+/*
+ * copies into the apron of buf the halo that the neighbour source (on this node) would 
+ * send in the direction (dx, dy) in exchange_halo_padded. Its buffer has the layout of 
+ * buf, with the strides of its own sub-image: buf is found at the same place in it.
+ */
+{
+  int    thid, nxstride;
+  size_t nplane;
+  MPI_Comm_rank(comm, &thid);
+  unsigned short int *nbuf = shm.base[source] + neighbour_halo( buf, shm.base[thid], xstride, ystride, nch, xpxl, pad, dx, dy, source, comm, thpos, &nxstride, &nplane );
+
+  size_t plane = (size_t)xstride*ystride;
+  int rows   = (dy==0)? ypxl : pad;
+  int cols   = (dx==0)? xpxl : pad;
+  int recv_y = (dy==0)? pad : ((dy==1)? 0 : pad+ypxl);
+  int recv_x = (dx==0)? pad : ((dx==1)? 0 : pad+xpxl);
+  for (int c=0; c<nch; c++)
+    for (int r=0; r<rows; r++)
+      memcpy( buf + c*plane + (size_t)(recv_y+r)*xstride + recv_x, nbuf + c*nplane + (size_t)r*nxstride, cols*sizeof(short int) );
+}
+
+
+/*
+  With --halo rma the halos that are not copied through shared memory are fetched with
+  one-sided communication instead of MPI_Sendrecv: the two padded buffers of every rank 
+  are exposed in a window (MPI_Win_create over the grid), and every rank gets the strips 
+  of its neighbours straight into its apron with MPI_Get, into the same subarray datatype
+  used to receive them, from a vector datatype over the rows of the neighbour. Nothing is
+  sent, so no sender has to be matched with its receiver by tags. The exchange is a 
+  post-start-complete-wait epoch restricted to the neighbours: MPI_Win_post exposes the 
+  buffers once the rank is done writing them, MPI_Win_wait returns once the neighbours 
+  are done reading them.
+*/
+
+typedef struct {
+  int       on;                     // --halo rma
+  MPI_Win   win;                    // the buffers of every rank, MPI_WIN_NULL when not created
+  unsigned short int *base;         // buffers of this rank (displacement 0)
+  MPI_Group neighbours;             // the neighbours reached through the window
+} rma_halos;
+
+rma_halos rma = { 0, MPI_WIN_NULL, NULL, MPI_GROUP_NULL };
+
+
+void rma_create( unsigned short int *buf, size_t count, MPI_Comm comm, int xyth[2], int thpos[2] )
+/*
+ * exposes the count pixels of buf, the buffers of this rank, to the neighbours not on the
+ * same node (all of them without --shm). No window is created if no rank has any such
+ * neighbour, as with a single rank or with --shm on a single node.
+ */
+{
+  int ranks[8], n = 0;
+  for (int dy=-1; dy<=1; dy++)
+    for (int dx=-1; dx<=1; dx++){
+      int coord[2] = {xyth[0]+dx, xyth[1]+dy};
+      if ((dx==0 && dy==0) || coord[0]<0 || coord[1]<0 || coord[0]>=thpos[0] || coord[1]>=thpos[1]) continue;
+      int rank;
+      MPI_Cart_rank(comm, coord, &rank);
+      if (shm.base == NULL || shm.base[rank] == NULL)
+        ranks[n++] = rank;
+    }
+  int nmax;
+  MPI_Allreduce(&n, &nmax, 1, MPI_INT, MPI_MAX, comm);
+  if (nmax == 0)
+    return;
+
+  MPI_Win_create( buf, count*sizeof(short int), sizeof(short int), MPI_INFO_NULL, comm, &rma.win );
+  rma.base = buf;
+  MPI_Group grid_group;
+  MPI_Comm_group(comm, &grid_group);
+  MPI_Group_incl(grid_group, n, ranks, &rma.neighbours);
+  MPI_Group_free(&grid_group);
+}
+
+
+void rma_free( void )
+{
+  if (rma.win == MPI_WIN_NULL)
+    return;
+  MPI_Win_free(&rma.win);
+  MPI_Group_free(&rma.neighbours);
+  rma.base = NULL;
+}
+
+
+void rma_get_halo( unsigned short int *buf, int xstride, int ystride, int nch, int xpxl, int ypxl, int pad, int dx, int dy, int source, MPI_Datatype recv_type, MPI_Comm comm, int thpos[2] )
+/*
+ * gets into the apron of buf, as described by recv_type, the halo that the neighbour 
+ * source would send in the direction (dx, dy) in exchange_halo_padded
+ */
+{
+  int    nxstride;
+  size_t nplane;
+  MPI_Aint disp = neighbour_halo( buf, rma.base, xstride, ystride, nch, xpxl, pad, dx, dy, source, comm, thpos, &nxstride, &nplane );
+
+  // the strip in the buffers of the neighbour: rows of one plane, repeated over the planes
+  MPI_Datatype rows_type, strip_type;
+  MPI_Type_vector( (dy==0)? ypxl : pad, (dx==0)? xpxl : pad, nxstride, MPI_UNSIGNED_SHORT, &rows_type );
+  MPI_Type_create_hvector( nch, 1, (MPI_Aint)(nplane*sizeof(short int)), rows_type, &strip_type );
+  MPI_Type_commit(&strip_type);
+  MPI_Get( buf, 1, recv_type, source, disp, 1, strip_type, rma.win );
+  MPI_Type_free(&rows_type);
+  MPI_Type_free(&strip_type);
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               BLUR WITH (DEEP) HALOS
+
+
+/*
+  Every rank keeps its sub-image in a buffer padded by an apron of pad = depth*khalfsize 
+  pixels on every side, into which the halos of the 8 neighbours are received directly,
+  so that the blur loops over the taps with no border check (see blur_padded). 
+  A single blur is the case niter = depth = 1.
+  Applying the blur niter times keeps the sub-images resident, and the apron is refreshed
+  with the halos only every depth iterations: in between, every rank blurs
+  its sub-image extended by the part of the apron that is still valid, which shrinks by
+  khalfsize at each iteration, redoing locally the work of its neighbours on the overlap.
+  This trades a little redundant compute for depth-fold fewer messages.
+  The apron outside the image is filled by fill_apron before every iteration, as its 
+  values follow those of the image (or stays zero, never being written).
+*/
+
+
+void exchange_halo_padded( unsigned short int *buf, int xstride, int ystride, int nch, int xpxl, int ypxl, int pad, MPI_Comm comm, int xyth[2], int thpos[2] )
+/*
+ * buf holds nch planes of ystride >= ypxl+2*pad rows of xstride >= xpxl+2*pad pixels. For each 
+ * of the 8 directions the strip of the sub-image next to that side is sent to the neighbour 
+ * there, while the strip of the opposite neighbour is received directly into the apron, 
+ * through subarray datatypes covering all the planes in one message. Neighbours must have 
+ * at least pad pixels along each axis. With the buffers in shared memory (see shm_alloc)
+ * the halos of the neighbours on the same node are copied instead, with --halo rma the
+ * others are fetched from the window of the buffers (see rma_create).
+ */
+{
+  int sizes[3] = {nch, ystride, xstride};
+  const char *names[3][3] = {{"UP-LEFT", "UP", "UP-RIGHT"}, {"LEFT", "", "RIGHT"}, {"DOWN-LEFT", "DOWN", "DOWN-RIGHT"}};
+  int shared = (shm.win != MPI_WIN_NULL);
+  if (shared){
+    // the neighbours on the node are done writing their sub-images
+    MPI_Win_sync(shm.win);
+    MPI_Barrier(shm.node);
+    MPI_Win_sync(shm.win);
+  }
+  int    one_sided = (rma.win != MPI_WIN_NULL);
+  double t_epoch   = MPI_Wtime();
+  if (one_sided){
+    // the buffers of this rank are ready to be read, and those of the neighbours are awaited
+    MPI_Win_post(rma.neighbours, MPI_MODE_NOPUT, rma.win);
+    MPI_Win_start(rma.neighbours, 0, rma.win);
+  }
+
+  for (int dy=-1; dy<=1; dy++){
+    for (int dx=-1; dx<=1; dx++){
+      if (dx==0 && dy==0) continue;
+      int nn_dest = MPI_PROC_NULL, nn_source = MPI_PROC_NULL;
+      int dest_coord[2]   = {xyth[0]+dx, xyth[1]+dy};
+      int source_coord[2] = {xyth[0]-dx, xyth[1]-dy};
+      if (dest_coord[0]>=0   && dest_coord[1]>=0   && dest_coord[0]<thpos[0]   && dest_coord[1]<thpos[1]  )
+        MPI_Cart_rank(comm, dest_coord,   &nn_dest);
+      if (source_coord[0]>=0 && source_coord[1]>=0 && source_coord[0]<thpos[0] && source_coord[1]<thpos[1])
+        MPI_Cart_rank(comm, source_coord, &nn_source);
+      double tt = MPI_Wtime();
+      if (shared){
+        // the neighbour on the node reads its halo itself
+        if (nn_dest != MPI_PROC_NULL && shm.base[nn_dest] != NULL)
+          nn_dest = MPI_PROC_NULL;
+        if (nn_source != MPI_PROC_NULL && shm.base[nn_source] != NULL){
+          shm_copy_halo( buf, xstride, ystride, nch, xpxl, ypxl, pad, dx, dy, nn_source, comm, thpos );
+          char event_name[32];
+          snprintf(event_name, sizeof(event_name), "copy %s", names[1-dy][1-dx]);
+          trace_record( event_name, tt, MPI_Wtime() );
+          nn_source = MPI_PROC_NULL;
+        }
+      }
+      if (nn_dest == MPI_PROC_NULL && nn_source == MPI_PROC_NULL) continue;
+
+      // {rows, columns} of the strip, and where it starts in the sub-image (sent) or in the apron (received)
+      int subsizes[3]   = {nch, (dy==0)? ypxl : pad, (dx==0)? xpxl : pad};
+      int send_start[3] = {0, pad + ((dy==1)? ypxl-pad : 0), pad + ((dx==1)? xpxl-pad : 0)};
+      int recv_start[3] = {0, (dy==0)? pad : ((dy==1)? 0 : pad+ypxl), (dx==0)? pad : ((dx==1)? 0 : pad+xpxl)};
+
+      MPI_Datatype send_type, recv_type;
+      MPI_Type_create_subarray(3, sizes, subsizes, send_start, MPI_ORDER_C, MPI_UNSIGNED_SHORT, &send_type);
+      MPI_Type_create_subarray(3, sizes, subsizes, recv_start, MPI_ORDER_C, MPI_UNSIGNED_SHORT, &recv_type);
+      MPI_Type_commit(&send_type);
+      MPI_Type_commit(&recv_type);
+
+      if (one_sided){
+        // nothing is sent: every rank gets its own halos
+        if (nn_source != MPI_PROC_NULL)
+          rma_get_halo( buf, xstride, ystride, nch, xpxl, ypxl, pad, dx, dy, nn_source, recv_type, comm, thpos );
+      }
+      else {
+        tt = MPI_Wtime();
+        MPI_Sendrecv(buf, 1, send_type, nn_dest, 456, buf, 1, recv_type, nn_source, 456, comm, MPI_STATUS_IGNORE);
+        char event_name[32];
+        snprintf(event_name, sizeof(event_name), "halo %s", names[1-dy][1-dx]);
+        trace_record( event_name, tt, MPI_Wtime() );
+      }
+
+      MPI_Type_free(&send_type);
+      MPI_Type_free(&recv_type);
+    }
+  }
+  if (one_sided){
+    // the gets are done, then the neighbours are done getting from this rank
+    MPI_Win_complete(rma.win);
+    MPI_Win_wait(rma.win);
+    trace_record( "halo get", t_epoch, MPI_Wtime() );
+  }
+  if (shared){
+    // everybody is done reading before the sub-images change again
+    MPI_Win_sync(shm.win);
+    MPI_Barrier(shm.node);
+  }
+}
+
+
+int tune_halo_depth( unsigned short int *buf, unsigned short int *out, int xpxl, int ypxl, int nch, int niter, int max_depth, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize, MPI_Comm comm, int xyth[2], int thpos[2] )
+/*
+ * chooses the depth minimising the modelled time per iteration
+ *
+ *   t(depth) = ( latency + halo_bytes(depth)/bandwidth ) / depth + tpixel * mean_area(depth)
+ *
+ * where mean_area is the mean number of pixels blurred at each iteration, including the
+ * redundant overlap. latency and bandwidth are measured with two exchanges of halos of 
+ * depth 1 and max_depth, tpixel blurring a few rows; the slowest rank decides.
+ * buf must hold nch planes padded by max_depth*khalfsize pixels.
+ */
+{
+  if (max_depth <= 1 || khalfsize == 0)
+    return 1;
+
+  int pad     = max_depth*khalfsize;
+  int xstride = xpxl + 2*pad;
+  int ystride = ypxl + 2*pad;
+  double tt, measures[3];
+
+  // latency: smallest halo, best of a few
+  measures[0] = 1e30;
+  for (int r=0; r<5; r++){
+    MPI_Barrier(comm);
+    tt = MPI_Wtime();
+    exchange_halo_padded( buf + (pad-1)*xstride + (pad-1), xstride, ystride, nch, xpxl, ypxl, 1, comm, xyth, thpos );
+    tt = MPI_Wtime() - tt;
+    if (tt < measures[0]) measures[0] = tt;
+  }
+  // bandwidth: deepest halo
+  MPI_Barrier(comm);
+  tt = MPI_Wtime();
+  exchange_halo_padded( buf, xstride, ystride, nch, xpxl, ypxl, pad, comm, xyth, thpos );
+  measures[1] = MPI_Wtime() - tt;
+  // compute: a few rows of the sub-image
+  int rows = (ypxl < 4)? ypxl : 4;
+  tt = MPI_Wtime();
+  blur_padded( buf + (size_t)pad*xstride + pad, xstride, out + (size_t)pad*xstride + pad, xstride, xpxl, rows, ksize, kernel, knorm, khalfsize );
+  measures[2] = nch*(MPI_Wtime() - tt)/((double)rows*xpxl);
+
+  MPI_Allreduce(MPI_IN_PLACE, measures, 3, MPI_DOUBLE, MPI_MAX, comm);
+  double latency = measures[0];
+  double halo1   = 2.*nch*((xpxl+2)*(ypxl+2) - xpxl*ypxl);
+  double halomax = 2.*nch*((double)xstride*(ypxl+2*pad) - (double)xpxl*ypxl);
+  double bandwidth = (measures[1] > latency)? (halomax-halo1)/(measures[1]-latency) : 1e30;
+
+  int    best = 1;
+  double best_time = 0;
+  for (int depth=1; depth<=max_depth && depth<=niter; depth++){
+    int    p     = depth*khalfsize;
+    double bytes = 2.*nch*((double)(xpxl+2*p)*(ypxl+2*p) - (double)xpxl*ypxl);
+    double area  = 0;
+    for (int j=0; j<depth; j++){
+      int e = (depth-1-j)*khalfsize;
+      area += (double)(xpxl+2*e)*(ypxl+2*e)/depth;
+    }
+    double time = (latency + bytes/bandwidth)/depth + measures[2]*area;
+    if (depth == 1 || time < best_time){
+      best      = depth;
+      best_time = time;
+    }
+  }
+  return best;
+}
+
+
+void * blur_iterations( void *image, int xsize, int ysize, int nch, int start_x, int start_y, int xpxl, int ypxl, int min_pxl, int niter, int depth, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize, int edge, MPI_Comm comm, int xyth[2], int thpos[2] )
+/*
+ * blurs niter times the nch planes of the sub-image (xpxl x ypxl pixels starting at start_x, 
+ * start_y) and returns the result. min_pxl is the smallest size of the sub-images along any 
+ * axis, which bounds the depth of the halos; depth <= 0 means automatic.
+ */
+{
+  int thid;
+  MPI_Comm_rank(comm, &thid);
+
+  int max_depth = (khalfsize > 0)? min_pxl/khalfsize : niter;
+  if (max_depth > niter) max_depth = niter;
+  if (max_depth < 1)     max_depth = 1;
+  if (depth > max_depth){
+    if (thid==0) printf("halo depth %d too large for the sub-images, using %d\n", depth, max_depth);
+    depth = max_depth;
+  }
+  // the tuning times blur_padded: the bilateral and morphological filters and the custom
+  // kernels exchange their halos at every iteration
+  if ((bil.on || morph_op || ckernel.terms != NULL) && depth <= 0)
+    depth = 1;
+
+  // buffers are allocated for the deepest possible halo, as needed by the tuning
+  int pad     = ((depth > 0)? depth : max_depth)*khalfsize;
+  int xstride = xpxl + 2*pad;
+  int ystride = ypxl + 2*pad;
+  size_t plane  = (size_t)xstride*ystride;
+  size_t splane = (size_t)xpxl*ypxl;
+  // both buffers one after the other, in the window of the node with --shm
+  unsigned short int *in, *out, *buffers;
+  if (shm.node != MPI_COMM_NULL)
+    buffers = shm_alloc( 2*plane*nch, comm );
+  else
+    buffers = (unsigned short int*)calloc( 2*plane*nch, sizeof(short int) );
+  in  = buffers;
+  out = buffers + plane*nch;
+  if (rma.on)
+    rma_create( buffers, 2*plane*nch, comm, xyth, thpos );
+  for (int c=0; c<nch; c++)
+    for (int yy=0; yy<ypxl; yy++)
+      memcpy( in + c*plane + (size_t)(yy+pad)*xstride + pad, (unsigned short int*)image + c*splane + (size_t)yy*xpxl, xpxl*sizeof(short int) );
+
+  if (depth <= 0){
+    depth = tune_halo_depth( in, out, xpxl, ypxl, nch, niter, max_depth, ksize, kernel, knorm, khalfsize, comm, xyth, thpos );
+    memset(out, 0, plane*nch*sizeof(short int));
+  }
+  if (thid==0 && niter > 1) printf("Iterations: %d, halo depth %d (%d pixels), %d exchanges\n", niter, depth, depth*khalfsize, (niter+depth-1)/depth);
+
+  // the exchanged halo is depth*khalfsize deep, placed at the inside of the apron
+  int hpad = depth*khalfsize;
+  unsigned short int *hbuf_in  = in  + (size_t)(pad-hpad)*xstride + (pad-hpad);
+  unsigned short int *hbuf_out = out + (size_t)(pad-hpad)*xstride + (pad-hpad);
+
+  for (int it=0; it<niter; it++){
+    int j = it%depth;
+    if (j == 0)
+      exchange_halo_padded( hbuf_in, xstride, ystride, nch, xpxl, ypxl, hpad, comm, xyth, thpos );
+    // the values outside the image follow those inside, which change at every iteration
+    fill_apron( in + (size_t)pad*xstride + pad, xstride, plane, nch, xpxl, ypxl, pad, start_x, start_y, xsize, ysize, edge );
+
+    // region still valid after this iteration, clipped to the image
+    int e  = (depth-1-j)*khalfsize;
+    if (it == niter-1) e = 0;
+    int x0 = (start_x-e < 0)? -start_x : -e;
+    int y0 = (start_y-e < 0)? -start_y : -e;
+    int x1 = (start_x+xpxl+e > xsize)? xsize-start_x : xpxl+e;
+    int y1 = (start_y+ypxl+e > ysize)? ysize-start_y : ypxl+e;
+
+    double tt = MPI_Wtime();
+    for (int c=0; c<nch; c++)
+      filter_padded( in + c*plane + (long)(pad+y0)*xstride + pad+x0, xstride, out + c*plane + (long)(pad+y0)*xstride + pad+x0, xstride, x1-x0, y1-y0, start_x+x0, start_y+y0, xsize, ysize, ksize, kernel, knorm, khalfsize );
+    trace_record( "blur", tt, MPI_Wtime() );
+
+    unsigned short int *swap_ptr = in;
+    in  = out;
+    out = swap_ptr;
+    swap_ptr = hbuf_in;
+    hbuf_in  = hbuf_out;
+    hbuf_out = swap_ptr;
+  }
+
+  // result is in "in" after the last swap
+  unsigned short int *result = (unsigned short int*)malloc( splane*nch*sizeof(short int) );
+  for (int c=0; c<nch; c++)
+    for (int yy=0; yy<ypxl; yy++)
+      memcpy( result + c*splane + (size_t)yy*xpxl, in + c*plane + (size_t)(yy+pad)*xstride + pad, xpxl*sizeof(short int) );
+  if (rma.on)
+    rma_free();
+  if (shm.win != MPI_WIN_NULL)
+    shm_free();
+  else
+    free(buffers);
+  return (void*)result;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               BATCHES OF IMAGES
+
+
+/*
+  With --batch the image names on the command line are replaced by a list file of 
+  "input output" pairs, one per line (empty lines and lines starting with # are skipped).
+  Splitting each of many medium-sized images over all the ranks spends most of the time
+  exchanging halos and gathering: the images are blurred side by side instead, each by a
+  team of ranks sized for it, be it a single rank, a sub-communicator running its own 
+  Cartesian grid, or all of them.
+
+  The team of an image is the smallest one whose ranks blur at most the share of a rank,
+  the compute of the whole batch divided by the ranks, so that no image is left alone on
+  a rank at the end; teams are not grown beyond the point where their efficiency, compute
+  over the cost of the plan of all their ranks (see plan_cost), falls below BATCH_EFFICIENCY. Larger images and kernels get larger teams,
+  while a batch of many small images is blurred one image per rank, with no communication.
+
+  The master only schedules. The images are taken with the largest teams first, then by
+  decreasing cost, and each one is assigned as soon as enough ranks are idle to form its
+  team, by sending them the list of its ranks: the team builds its communicator with 
+  MPI_Comm_create_group, which involves its ranks only, and every rank reports back to
+  the master when done. A single process blurs the images itself, one after the other.
+*/
+
+#define BATCH_EFFICIENCY 0.75
+#define BATCH_NAME       1024
+
+typedef struct {
+  char   input[BATCH_NAME], output[BATCH_NAME];
+  int    xsize, ysize, nch;
+  int    team;                // number of ranks
+  int    thpos[2];            // grid of the team
+  double cost;                // of the plan of the team, in kernel taps
+  double start, seconds;      // on the master
+  int    pending;             // ranks of the team still at work
+} batch_image;
+
+
+void batch_team_size( batch_image *im, int nworkers, double share, int khalfsize, int niter )
+{
+  int    ksize   = 2*khalfsize+1;
+  double compute = (double)im->xsize*im->ysize*ksize*ksize*im->nch*niter;
+  for (int t=1; t<=nworkers; t++){
+    plan   pl   = plan_decomposition( t, im->xsize, im->ysize, khalfsize, -1, 0, 0 );
+    double cost = pl.cost*im->nch*niter;
+    if (t > 1 && compute/(t*cost) < BATCH_EFFICIENCY)
+      break;
+    im->team     = t;
+    im->thpos[0] = pl.thpos[0];
+    im->thpos[1] = pl.thpos[1];
+    im->cost     = cost;
+    if (compute/t <= share)
+      break;
+  }
+}
+
+
+int batch_compare( const void *a, const void *b )
+{
+  const batch_image *ia = (const batch_image*)a, *ib = (const batch_image*)b;
+  if (ia->team != ib->team) return ib->team - ia->team;
+  return (ia->cost < ib->cost) - (ia->cost > ib->cost);
+}
+
+
+void batch_print( const batch_image *im )
+{
+  printf("  %-32s %6dx%-6d  team %3d (%dx%d)  %f s  %8.2f Mpixel/s\n", im->input, im->xsize, im->ysize, 
+	 im->team, im->thpos[0], im->thpos[1], im->seconds, 1e-6*im->xsize*im->ysize/im->seconds);
+}
+
+
+void blur_batch_image( const batch_image *im, int niter, int depth, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize, int edge, MPI_Comm team )
+/*
+ * blurs the image im with all the ranks of team, on a Cartesian grid of its own: every 
+ * rank reads its sub-image, and rank 0 of the grid gathers and writes the result
+ */
+{
+  int nths, thid;
+  const int master = 0;
+  MPI_Comm_size(team, &nths);
+
+  int xsize, ysize, maxval, nch;
+  FILE *file = NULL;
+  tiled_image timg;
+  int tiled = tiled_is_tiled( im->input );
+  if ( tiled ){
+    tiled_open( &timg, im->input );
+    xsize  = timg.xsize;
+    ysize  = timg.ysize;
+    maxval = timg.maxval;
+    nch    = timg.nch;
+  }
+  else
+    read_header( &maxval, &xsize, &ysize, &nch, im->input, &file );
+  bil.sr = bil.range*maxval;
+  ckernel.maxval = maxval;
+  long data_start = (file != NULL)? ftell(file) : 0;
+
+  // the grid of the team, as chosen by the master
+  int periods[2] = {0,0};
+  int thpos[2]   = {im->thpos[0], im->thpos[1]};
+  int xyth[2];
+  MPI_Comm grid;
+  MPI_Cart_create(team, 2, thpos, periods, 1, &grid);
+  MPI_Comm_rank(grid, &thid);
+  MPI_Cart_coords(grid, thid, 2, xyth);
+  int  xpxl, ypxl, start_x, start_y;
+  long start_idx;
+  identify_thread(xyth[0], xyth[1], &xpxl, &ypxl, &start_idx, &start_x, &start_y, thpos, thid, xsize, ysize);
+
+  int color_depth = (1 + (maxval > 255))*nch;
+  unsigned char      *raw = (unsigned char*)malloc( (size_t)xpxl*ypxl*color_depth );
+  unsigned short int *sub = (unsigned short int*)malloc( (size_t)xpxl*ypxl*nch*sizeof(short int) );
+  read_tile( file, (tiled)? &timg : NULL, data_start, xsize, ysize, start_x, start_y, xpxl, ypxl, 0, color_depth, raw );
+  if ( tiled )
+    tiled_close( &timg );
+  else
+    fclose( file );
+  deinterleave_image( raw, sub, xpxl, ypxl, maxval, nch );
+  free(raw);
+
+  int  *xpxls      = (int*)malloc( nths*sizeof(int) );
+  int  *ypxls      = (int*)malloc( nths*sizeof(int) );
+  long *start_idxs = (long*)malloc( nths*sizeof(long) );
+  MPI_Allgather(&xpxl,      1, MPI_INT,  xpxls,      1, MPI_INT,  grid);
+  MPI_Allgather(&ypxl,      1, MPI_INT,  ypxls,      1, MPI_INT,  grid);
+  MPI_Allgather(&start_idx, 1, MPI_LONG, start_idxs, 1, MPI_LONG, grid);
+  int min_pxl = xsize;
+  for (int i=0; i<nths; i++){
+    if (xpxls[i] < min_pxl) min_pxl = xpxls[i];
+    if (ypxls[i] < min_pxl) min_pxl = ypxls[i];
+  }
+
+  halo_xsize = xsize;
+  halo_ysize = ysize;
+  unsigned short int *result = (unsigned short int*)blur_iterations( sub, xsize, ysize, nch, start_x, start_y, xpxl, ypxl, min_pxl, niter, depth, ksize, kernel, knorm, khalfsize, edge, grid, xyth, thpos );
+  free(sub);
+
+  size_t plane = (size_t)xsize*ysize;
+  unsigned short int *image = NULL;
+  if (thid == master)
+    image = (unsigned short int*)malloc( plane*nch*sizeof(short int) );
+  gather_rows( result, xpxl, ypxl, nch, image, xsize, ysize, start_idxs, xpxls, ypxls, master, grid );
+  if (thid == master){
+    unsigned char *raw_image = (unsigned char*)malloc( plane*color_depth );
+    interleave_image( image, raw_image, xsize, ysize, maxval, nch );
+    write_pgm_image( raw_image, maxval, xsize, ysize, nch, im->output );
+    free(raw_image);
+    free(image);
+  }
+  free(result);
+  free(xpxls);
+  free(ypxls);
+  free(start_idxs);
+  MPI_Comm_free(&grid);
+}
+
+
+void blur_batch( const char *list_name, int niter, int depth, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize, int edge, MPI_Comm comm )
+{
+  int thid, nths;
+  const int master = 0;
+  MPI_Comm_rank(comm, &thid);
+  MPI_Comm_size(comm, &nths);
+  int nworkers = (nths > 1)? nths-1 : 1;
+
+  // ---------------------------------------------
+  // the list, with the size and the team of every image, on the master
+  int nimages = 0;
+  batch_image *images = NULL;
+  if (thid == master){
+    FILE *list = fopen(list_name, "r");
+    if (list == NULL)
+      printf("Cannot open the list %s\n", list_name);
+    int  capacity = 16;
+    char line[2*BATCH_NAME+8];
+    images = (batch_image*)malloc( capacity*sizeof(batch_image) );
+    while (list != NULL && fgets(line, sizeof(line), list) != NULL){
+      batch_image im;
+      memset(&im, 0, sizeof(im));
+      if (line[0] == '#' || sscanf(line, "%1023s %1023s", im.input, im.output) != 2)
+        continue;
+      int maxval = 0;
+      FILE *file;
+      if ( tiled_is_tiled( im.input ) ){
+        tiled_image timg;
+        if ( tiled_open( &timg, im.input ) == 0 ){
+          im.xsize = timg.xsize;
+          im.ysize = timg.ysize;
+          im.nch   = timg.nch;
+          maxval   = timg.maxval;
+          tiled_close( &timg );
+        }
+      }
+      else if ( (file = fopen(im.input, "r")) != NULL ){
+        fclose(file);
+        read_header( &maxval, &im.xsize, &im.ysize, &im.nch, im.input, &file );
+        fclose(file);
+      }
+      if (maxval <= 0 || im.xsize <= 0 || im.ysize <= 0){
+        printf("Cannot read %s, skipped\n", im.input);
+        continue;
+      }
+      if (nimages == capacity){
+        capacity *= 2;
+        images = (batch_image*)realloc( images, capacity*sizeof(batch_image) );
+      }
+      images[nimages++] = im;
+    }
+    if (list != NULL)
+      fclose(list);
+
+    double share = 0;
+    for (int i=0; i<nimages; i++)
+      share += (double)images[i].xsize*images[i].ysize*ksize*ksize*images[i].nch*niter/nworkers;
+    for (int i=0; i<nimages; i++)
+      batch_team_size( &images[i], nworkers, share, khalfsize, niter );
+    qsort( images, nimages, sizeof(batch_image), batch_compare );
+    printf("Batch: %d images on %d ranks\n", nimages, nworkers);
+  }
+  MPI_Bcast(&nimages, 1, MPI_INT, master, comm);
+  if (thid != master)
+    images = (batch_image*)malloc( nimages*sizeof(batch_image) );
+  MPI_Bcast(images, nimages*sizeof(batch_image), MPI_BYTE, master, comm);
+
+  double start = MPI_Wtime();
+  // assignments: image, team size and ranks of the team (the first one leads it)
+  int *msg = (int*)malloc( (nths+2)*sizeof(int) );
+  if (nths == 1){
+    for (int i=0; i<nimages; i++){
+      images[i].start = MPI_Wtime();
+      blur_batch_image( &images[i], niter, depth, ksize, kernel, knorm, khalfsize, edge, comm );
+      images[i].seconds = MPI_Wtime() - images[i].start;
+      batch_print( &images[i] );
+    }
+  }
+  else if (thid == master){
+    // ---------------------------------------------
+    // schedule: start images while their teams can be formed, then wait for a rank
+    int *idle  = (int*)malloc( nths*sizeof(int) );
+    int  nidle = 0;
+    for (int r=0; r<nths; r++)
+      if (r != master) idle[nidle++] = r;
+    int next = 0, running = 0;
+    while (next < nimages || running > 0){
+      while (next < nimages && images[next].team <= nidle){
+        batch_image *im = &images[next];
+        msg[0] = next;
+        msg[1] = im->team;
+        nidle -= im->team;
+        for (int k=0; k<im->team; k++)
+          msg[2+k] = idle[nidle+k];
+        for (int k=0; k<im->team; k++)
+          MPI_Send(msg, nths+2, MPI_INT, msg[2+k], 801, comm);
+        im->start   = MPI_Wtime();
+        im->pending = im->team;
+        next++;
+        running++;
+      }
+      int done;
+      MPI_Status status;
+      MPI_Recv(&done, 1, MPI_INT, MPI_ANY_SOURCE, 802, comm, &status);
+      idle[nidle++] = status.MPI_SOURCE;
+      if (--images[done].pending == 0){
+        images[done].seconds = MPI_Wtime() - images[done].start;
+        running--;
+        batch_print( &images[done] );
+      }
+    }
+    msg[0] = -1;
+    for (int r=0; r<nths; r++)
+      if (r != master) MPI_Send(msg, nths+2, MPI_INT, r, 801, comm);
+    free(idle);
+  }
+  else {
+    // ---------------------------------------------
+    // work: join the team of every image assigned, until told to stop
+    MPI_Group comm_group;
+    MPI_Comm_group(comm, &comm_group);
+    while (1){
+      MPI_Recv(msg, nths+2, MPI_INT, master, 801, comm, MPI_STATUS_IGNORE);
+      if (msg[0] < 0) break;
+      double tt = MPI_Wtime();
+      MPI_Group team_group;
+      MPI_Comm  team;
+      MPI_Group_incl(comm_group, msg[1], msg+2, &team_group);
+      MPI_Comm_create_group(comm, team_group, msg[0], &team);
+      blur_batch_image( &images[msg[0]], niter, depth, ksize, kernel, knorm, khalfsize, edge, team );
+      MPI_Comm_free(&team);
+      MPI_Group_free(&team_group);
+      char event_name[32];
+      snprintf(event_name, sizeof(event_name), "image %d", msg[0]);
+      trace_record( event_name, tt, MPI_Wtime() );
+      MPI_Send(&msg[0], 1, MPI_INT, master, 802, comm);
+    }
+    MPI_Group_free(&comm_group);
+  }
+
+  if (thid == master){
+    double elapsed = MPI_Wtime() - start;
+    double pixels  = 0;
+    for (int i=0; i<nimages; i++)
+      pixels += (double)images[i].xsize*images[i].ysize;
+    printf("Batch: %d images, %.1f Mpixels in %f s: %.2f images/s, %.2f Mpixel/s\n", nimages, 1e-6*pixels, elapsed, nimages/elapsed, 1e-6*pixels/elapsed);
+  }
+  free(msg);
+  free(images);
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               MAIN
+
+
+// ============================================================================================================================================================
+
+
+int main( int argc, char *argv[ ] ) 
+{ 
+  int xsize;
+  int ysize;
+  int maxval;
+  int nch;
+  struct timespec ts;
+  double startt, stopt;
+  int nths,thid;
+  int ksize      = 25;
+  int ktype      = 0;
+  float kfactor  = 0.2;
+  char *input_image_name;
+  char *output_image_name;
+
+  MPI_Status status; 
+  MPI_Request request;
+  const int master = 0;
+  int tag = 123;
+  
+
+  MPI_Init(&argc,&argv);
+  MPI_Comm_size(MPI_COMM_WORLD,&nths);  
+  startt = MPI_Wtime();
+
+
+
+    // read optional parameters first: they are removed from argv
+    options opts;
+    argc = read_options( argc, argv, &opts );
+    if ( argc < 0 ){
+      MPI_Finalize();
+      return 0;
+    }
+    if ( opts.trace_name != NULL )
+      trace_start( MPI_COMM_WORLD );
+    double tt;
+
+    // read input parameters
+    int arg_num=1;
+    if ( argc > arg_num ) {
+     ktype   = atoi( argv[arg_num] );
+     arg_num++;
+     if (ktype>8 || ktype <0){
+       printf("Invalid ktype\n");
+       return 0;
+       }
+    if ( argc > arg_num ) {
+     ksize   = atoi( argv[arg_num] );
+     arg_num++;
+    if (ktype==1 || ktype==4) {if ( argc > arg_num) {
+                     kfactor = atof( argv[arg_num]);
+                     arg_num++;
+                     if (kfactor>1 || kfactor<0){
+                       printf("Invalid kfactor\n");
+                       return 0;
+                     }
+                   }
+    }
+    if ( argc > arg_num ) {
+     input_image_name  = malloc(strlen( argv[arg_num])+1);
+     strcpy(input_image_name, argv[arg_num]);
+     arg_num++;
+    if ( argc > arg_num ) {
+     output_image_name  = malloc(strlen( argv[arg_num])+1);
+     strcpy(output_image_name, argv[arg_num]);
+     arg_num++;
+     } } } } 
+    
+    //if no output image name is provided
+    if(arg_num<(5+(ktype==1 || ktype==4))) {
+     output_image_name  = malloc(15);
+     strcpy(output_image_name, "mpi_output.pgm");
+    }
+    if(arg_num<(4+(ktype==1 || ktype==4))) {
+     input_image_name   = malloc(16);
+     strcpy(input_image_name, "../check_me.pgm");
+    }
+
+    // a custom kernel takes the place of kernel-type and kernel-size
+    float *custom = NULL;
+    if ( opts.kernel_name != NULL ){
+      custom = read_kernel( opts.kernel_name, &ksize );
+      if ( custom == NULL ){
+        MPI_Comm_rank(MPI_COMM_WORLD, &thid);
+        if (thid==master) printf("Invalid kernel file %s\n", opts.kernel_name);
+        MPI_Finalize();
+        return 0;
+      }
+      ktype = 0;
+    }
+
+   /*  ------------------------------------------------------- 
+  
+           KERNEL SET UP   
+  
+       ------------------------------------------------------- */
+
+    float kernel[ksize][ksize];
+    float knorm = 0;
+    int khalfsize   = (ksize-1)/2; // radius of the kernel
+
+
+    // ---------------------------------------------
+    // average kernel, also left in place by the median and morphological filters
+    median_filter = (ktype==3);
+    if (ktype==0 || ktype==3 || ktype>=5) {
+      for (int i=0; i<ksize;i++){
+        for (int j=0; j<ksize;j++){
+          kernel[i][j]=1;
+	  knorm += kernel[i][j];
+        }
+      }
+    }
+    else if (ktype==1) {
+    // ---------------------------------------------
+    // weight kernel
+      for (int i=0; i<ksize;i++){
+        for (int j=0; j<ksize;j++){
+          kernel[i][j]=1-kfactor;
+        }
+      }
+      knorm = (ksize*ksize-1);
+      kernel[khalfsize][khalfsize]=kfactor*(ksize*ksize-1);
     }
     else if (ktype==2) {
     
@@ -583,154 +2853,315 @@ int main( int argc, char *argv[ ] )
 	}
       }
     }
+    else if (ktype==4) {
 
- /*  ------------------------------------------------------- 
+    // ---------------------------------------------
+    // bilateral filter: no kernel, the halos are the apron of its grid (see bilateral_padded)
+      if (ksize < 3 || kfactor <= 0){
+        MPI_Comm_rank(MPI_COMM_WORLD, &thid);
+        if (thid==master) printf("The bilateral filter needs ksize >= 3 and a range sigma > 0\n");
+        MPI_Finalize();
+        return 0;
+      }
+      bil.on    = 1;
+      bil.ss    = khalfsize;
+      bil.range = kfactor;
+      khalfsize = BILATERAL_APRON(bil.ss);
+    }
+    if (ktype>=5) {
+    // ---------------------------------------------
+    // morphology: opening and closing have halos of twice the radius (see morph_padded), also for the planner
+      morph_op = ktype-4;
+      if (morph_op == MORPH_OPEN || morph_op == MORPH_CLOSE)
+        khalfsize *= 2;
+    }
+    if (custom != NULL) {
+    // ---------------------------------------------
+    // custom kernel: its separable terms, if cheaper than the kernel (see separate_kernel)
+      knorm = 0;
+      for (int i=0; i<ksize;i++){
+        for (int j=0; j<ksize;j++){
+          kernel[i][j] = custom[i*ksize+j];
+          knorm += kernel[i][j];
+        }
+      }
+      if (knorm == 0)
+        knorm = 1;
+      free(custom);
+      double error;
+      ckernel.terms = (float*)malloc( 2*ksize*ksize*sizeof(float) );
+      ckernel.rank  = separate_kernel( ksize, &kernel[0][0], opts.kernel_tol, ckernel.terms, &error );
+      MPI_Comm_rank(MPI_COMM_WORLD, &thid);
+      if (2*ckernel.rank < ksize){
+        if (thid==master) printf("Kernel %s: %dx%d of rank %d within %.1e (error %.1e), %d taps per pixel instead of %d: expected speedup %.1fx\n", 
+                                 opts.kernel_name, ksize, ksize, ckernel.rank, opts.kernel_tol, error, 2*ckernel.rank*ksize, ksize*ksize, ksize/(2.*ckernel.rank));
+      }
+      else {
+        if (thid==master) printf("Kernel %s: %dx%d of rank %d within %.1e, applied directly (%d taps per pixel)\n", 
+                                 opts.kernel_name, ksize, ksize, ckernel.rank, opts.kernel_tol, ksize*ksize);
+        ckernel.rank = 0;
+      }
+    }
 
-         HALO LAYERS   
 
-     ------------------------------------------------------- */
+  // a list of images instead of one, each blurred by a team of ranks
+  if ( opts.batch_name != NULL ){
+    MPI_Comm_rank(MPI_COMM_WORLD, &thid);
+    if ( opts.dynamic >= 0 || opts.roi[2] > 0 || opts.shm || opts.nthsx > 0 || opts.halo != HALO_SENDRECV ){
+      if (thid==master) printf("--batch is not available with --dynamic, --roi, --shm, --grid or --halo rma\n");
+      MPI_Finalize();
+      return 0;
+    }
+    blur_batch( opts.batch_name, opts.iterations, opts.halo_depth, ksize, kernel, knorm, khalfsize, opts.edge, MPI_COMM_WORLD );
+    stopt = MPI_Wtime();
+    if (thid==master) printf("time: %f\n", stopt-startt);
+    if ( opts.trace_name != NULL )
+      trace_write( opts.trace_name, MPI_COMM_WORLD );
+    MPI_Finalize();
+    return 0;
+  }
 
-  // ---------------------------------------------
+  void *ptr; 
+  int skip_counter=0;
+  FILE *file;
+
+   /*  ------------------------------------------------------- 
   
-  unsigned short int *halo[4];
-  halo[UP]    = (unsigned short int*)calloc( (xpxl)*khalfsize, sizeof(short int) );
-  halo[DOWN]  = (unsigned short int*)calloc( (xpxl)*khalfsize, sizeof(short int) );
-  halo[RIGHT] = (unsigned short int*)calloc( (ypxl+2*khalfsize)*khalfsize, sizeof(short int) );
-  halo[LEFT]  = (unsigned short int*)calloc( (ypxl+2*khalfsize)*khalfsize, sizeof(short int) );
+           THREADS SET UP     
   
-  int datatype_count;   
-  int datatype_block; 
-  int datatype_stride; 
-  int nn_source, nn_dest;
-  // 
-  // vertical and horizontal
-  for(int disp=-1; disp<=1; disp+=2){
-    for(int dir=0; dir<2; dir++){
-      MPI_Cart_shift(grid_communicator, dir, disp, &nn_source, &nn_dest);
-      //set sending datatype
-      datatype_count  = ypxl;
-      datatype_block  = khalfsize;
-      datatype_stride = xpxl;
-      //since all has same size, should work 
-      MPI_Datatype type, finaltype;     
-      MPI_Type_vector( datatype_count, datatype_block, datatype_stride , MPI_UNSIGNED_SHORT, &type);
-      MPI_Type_commit(&type);
-      MPI_Aint unshortlb, unshortsize, lb = 0;
-      MPI_Type_get_extent(MPI_UNSIGNED_SHORT, &unshortlb, &unshortsize);   
-      MPI_Type_create_resized(type, lb, unshortsize, &finaltype);
-      MPI_Type_commit(&finaltype);
-
-      MPI_Request req;
-      MPI_Status status;
-      if(nn_source != MPI_PROC_NULL) {
-        // UP
-	if (dir==1 && disp==1){
-	  MPI_Recv(&(((unsigned short int*)halo[UP])[0]),xpxl*khalfsize,MPI_UNSIGNED_SHORT,nn_source,123,grid_communicator,&status);
-	} // DOWN
-	if (dir==1 && disp==-1){
-	  MPI_Recv(&(((unsigned short int*)halo[DOWN])[0]),xpxl*khalfsize,MPI_UNSIGNED_SHORT,nn_source,123,grid_communicator,&status);
-	} // RIGHT
-	if (dir==0 && disp==-1){
-	  MPI_Recv(&(((unsigned short int*)halo[RIGHT])[khalfsize*khalfsize]),khalfsize*ypxl,MPI_UNSIGNED_SHORT,nn_source,789,grid_communicator,&status);
-	} // LEFT
-	if (dir==0 && disp==1){
-	  MPI_Recv(&(((unsigned short int*)halo[LEFT])[khalfsize*khalfsize]),khalfsize*ypxl,MPI_UNSIGNED_SHORT,nn_source,789,grid_communicator,&status);
-	}
-      }
-      if(nn_dest != MPI_PROC_NULL) {
-        // UP
-        if (dir==1 && disp==1){
-	  MPI_Send(&(((unsigned short int*)ptr)[xpxl*(ypxl - khalfsize)]),xpxl*khalfsize,MPI_UNSIGNED_SHORT,nn_dest,123,grid_communicator );
-        } // DOWN
-        if (dir==1 && disp==-1){
-	  MPI_Send(&(((unsigned short int*)ptr)[0]),xpxl*khalfsize,MPI_UNSIGNED_SHORT,nn_dest,123,grid_communicator );
-        } // RIGHT
-        if (dir==0 && disp==-1){
-	  MPI_Send(&(((unsigned short int*)ptr)[0]),1,finaltype,nn_dest,789,grid_communicator );
-        } // LEFT
-        if (dir==0 && disp==1){
-	  MPI_Send(&(((unsigned short int*)ptr)[xpxl-khalfsize]),1,finaltype,nn_dest,789,grid_communicator );
-        } 
-      }
-      
-    } // end for dir
-  } //end for disp
+       -------------------------------------------------------
 
-  // ---------------------------------------------
-  // corners
-  for (int deltax=1; deltax>=-1; deltax-=2){
-    for (int deltay=1; deltay>=-1; deltay-=2){
-      nn_source = MPI_PROC_NULL;
-      nn_dest   = MPI_PROC_NULL;
-      int nn_source_coord[2] = {xyth[0]-deltax, xyth[1]-deltay};
-      int nn_dest_coord[2]   = {xyth[0]+deltax, xyth[1]+deltay};
-      
-      if(nn_dest_coord[0]>=0   && nn_dest_coord[1]>=0   && nn_dest_coord[0]<thpos[0]   && nn_dest_coord[1]<thpos[1]  ) 
-        MPI_Cart_rank(grid_communicator, nn_dest_coord,   &nn_dest);
-      if(nn_source_coord[0]>=0 && nn_source_coord[1]>=0 && nn_source_coord[0]<thpos[0] && nn_source_coord[1]<thpos[1] )
-        MPI_Cart_rank(grid_communicator, nn_source_coord, &nn_source);
-    
-      datatype_count  = khalfsize;
-      datatype_block  = khalfsize;
-      datatype_stride = xpxl;
-      
-      MPI_Datatype type, finaltype;     
-      MPI_Type_vector( datatype_count, datatype_block, datatype_stride , MPI_UNSIGNED_SHORT, &type);
-      MPI_Type_commit(&type);
-      MPI_Aint unshortlb, unshortsize, lb = 0;
-      MPI_Type_get_extent(MPI_UNSIGNED_SHORT, &unshortlb, &unshortsize);   
-      MPI_Type_create_resized(type, lb, unshortsize, &finaltype);
-      MPI_Type_commit(&finaltype);
-    
-      MPI_Request req;
-      MPI_Status status;
-      if (nn_source != MPI_PROC_NULL)
-        {  // 0
-        if (deltax==-1 && deltay==1){
-          MPI_Recv(&(((unsigned short int*)halo[RIGHT])[0]),khalfsize*khalfsize,MPI_UNSIGNED_SHORT,nn_source,789,grid_communicator,&status);
-        }  // 1
-        if (deltax==-1 && deltay==-1){
-          MPI_Recv(&(((unsigned short int*)halo[RIGHT])[(ypxl+khalfsize)*khalfsize]),khalfsize*khalfsize,MPI_UNSIGNED_SHORT,nn_source,789,grid_communicator,&status);
-        }  // 2
-        if (deltax==1 && deltay==-1){
-          MPI_Recv(&(((unsigned short int*)halo[LEFT])[(ypxl+khalfsize)*khalfsize]),khalfsize*khalfsize,MPI_UNSIGNED_SHORT,nn_source,789,grid_communicator,&status);
-        }  // 3
-        if (deltax==1 && deltay==1){
-          MPI_Recv(&(((unsigned short int*)halo[LEFT])[0]),khalfsize*khalfsize,MPI_UNSIGNED_SHORT,nn_source,789,grid_communicator,&status);
-        }
-      }
-      
-      if  (nn_dest != MPI_PROC_NULL)
-        {  // 0
-        if (deltax==-1 && deltay==1){
-	  MPI_Send(&(((unsigned short int*)ptr)[xpxl*(ypxl -khalfsize)]),1,finaltype,nn_dest,789,grid_communicator );
-        }  // 1
-        if (deltax==-1 && deltay==-1){
-	  MPI_Send(&(((unsigned short int*)ptr)[0]),1,finaltype,nn_dest,789,grid_communicator );
-        }  // 2
-        if (deltax==1 && deltay==-1){
-	  MPI_Send(&(((unsigned short int*)ptr)[xpxl-khalfsize]),1,finaltype,nn_dest,789,grid_communicator );
-        }  // 3
-        if (deltax==1 && deltay==1){
-	  MPI_Send(&(((unsigned short int*)ptr)[xpxl*(ypxl -khalfsize)+xpxl-khalfsize]),1,finaltype,nn_dest,789,grid_communicator );
-        }
+       The original image is divided into a grid of subimages.
+
+         * nths        - total number of threads = number of 
+	                 subimages to be considered
+	 * thpos[0]    - number of division along the x axis
+	 * thpos[1]    - number of division along the y axis
+	 * xpxl        - number of pixel in the x axis that 
+	                 each column of subimages should have
+	 * ypxl        - number of pixel in the y axis that 
+	                 each row of subimages should have
+         * thid        - number of the current thread
+         * xyth[0]     - x coordinate of the sub image (see below)
+         * xyth[1]     - y coordinate of the sub image (see below)
+
+
+          illustration with 9 threads (nths=9):
+          best division: 3x3 grid (i.e. thpos[0]=3 and thpos[1]=3)
+
+	       _________________________          original image       
+          ^   |  (0,0) '  (0,1) '  (0,2) |        divided in 9 subimages          
+          |   |      0 '      1 '      2 |        following a 3x3 grid
+          |   |--------'--------'--------|       / 
+    ysize |   |  (1,0) '  (1,1) '  (1,2) |   <--ˊ
+          |   |      3 '      4 '      5 |            where the subimage is:
+          |   |--------'--------'--------|            ---------------------  ^
+          |   |  (2,0) '  (2,1) '  (2,2) |           '                    '  |
+	  ˅   | _____6_'______7_'______8_|           '  (xyth[0],xxth[1]) '  |
+                                                     '            thid    '  |  ypxl
+	      <-------------------------->	     '                    '  |
+                        xsize                        '--------------------'  ˅
+						                                     
+						              xpxl 
+						      <------------------->            
+
+       ------------------------------------------------------- */
+  
+  // of a tiled image only the header is read here, every rank reads its own tiles below
+  tt = MPI_Wtime();
+  tiled_image timg;
+  int tiled = tiled_is_tiled( input_image_name );
+  if ( tiled ){
+    file = NULL;
+    if ( tiled_open( &timg, input_image_name ) != 0 ){
+      printf("Invalid tiled image %s\n", input_image_name);
+      MPI_Finalize();
+      return 0;
+    }
+    xsize  = timg.xsize;
+    ysize  = timg.ysize;
+    maxval = timg.maxval;
+    nch    = timg.nch;
+  }
+  else
+    read_header( &maxval, &xsize, &ysize, &nch, input_image_name, &file);
+  bil.sr = bil.range*maxval;
+  ckernel.maxval = maxval;
+
+  // region of interest: its blur needs the pixels within the radius of the kernel, times the
+  // iterations. Only this window of the image is decomposed and read, and from now on it takes
+  // the place of the image: its borders inside the image are treated as those of the image, 
+  // but the pixels blurred wrongly there never reach the ROI.
+  int roi = ( opts.roi[2] > 0 );
+  int image_xsize = xsize, image_ysize = ysize;
+  int wx0 = 0, wy0 = 0;                                   // window in the image
+  long data_start = (file != NULL)? ftell(file) : 0;
+  if ( roi ){
+    int *r = opts.roi;
+    MPI_Comm_rank(MPI_COMM_WORLD, &thid);
+    if ( r[0]+r[2] > xsize || r[1]+r[3] > ysize || opts.dynamic >= 0 || bil.on ){
+      if (thid==master){
+        if ( opts.dynamic >= 0 ) printf("--roi is not available with --dynamic\n");
+        else if ( bil.on ) printf("--roi is not available with the bilateral filter\n");
+        else printf("ROI %d,%d,%d,%d is outside the %dx%d image\n", r[0], r[1], r[2], r[3], xsize, ysize);
       }
-    
-    }//end for
-  }//end for
+      MPI_Finalize();
+      return 0;
+    }
+    int radius = opts.iterations*khalfsize;
+    wx0   = (r[0]-radius < 0)? 0 : r[0]-radius;
+    wy0   = (r[1]-radius < 0)? 0 : r[1]-radius;
+    xsize = ((r[0]+r[2]+radius > image_xsize)? image_xsize : r[0]+r[2]+radius) - wx0;
+    ysize = ((r[1]+r[3]+radius > image_ysize)? image_ysize : r[1]+r[3]+radius) - wy0;
+    if (thid==master) printf("ROI %dx%d at (%d,%d): window of %dx%d pixels\n", r[2], r[3], r[0], r[1], xsize, ysize);
+  }
+
+  // tiles handed out on demand instead of a fixed block per rank
+  if ( opts.dynamic >= 0 ){
+    if ( opts.iterations > 1 ){
+      MPI_Comm_rank(MPI_COMM_WORLD, &thid);
+      if (thid==master) printf("--iterations is not available with --dynamic\n");
+      MPI_Finalize();
+      return 0;
+    }
+    blur_dynamic( file, (tiled)? &timg : NULL, xsize, ysize, maxval, nch, opts.dynamic, ksize, kernel, knorm, khalfsize, opts.edge, output_image_name, MPI_COMM_WORLD );
+    if ( tiled )
+      tiled_close( &timg );
+    stopt = MPI_Wtime();
+    MPI_Comm_rank(MPI_COMM_WORLD, &thid);
+    if (thid==master) printf("time: %f\n", stopt-startt);
+    if ( opts.trace_name != NULL )
+      trace_write( opts.trace_name, MPI_COMM_WORLD );
+    MPI_Finalize();
+    return 0;
+  }
+
+  // decompose in a 2D cartesian grid, chosen by the planner given the image and the kernel
+  if ( opts.nthsx*opts.nthsy != 0 && opts.nthsx*opts.nthsy != nths ){
+    MPI_Comm_rank(MPI_COMM_WORLD, &thid);
+    if (thid==master) printf("Invalid grid %dx%d for %d processes\n", opts.nthsx, opts.nthsy, nths);
+    MPI_Finalize();
+    return 0;
+  }
+  // with the final depth of the halo, e.g. the apron of the bilateral filter or the doubled radius of opening and closing
+  plan pl = plan_decomposition( nths, xsize, ysize, khalfsize, opts.plan_kind, opts.nthsx, opts.nthsy );
+  if ( !plan_fits( &pl, xsize, ysize, khalfsize ) ){
+    MPI_Comm_rank(MPI_COMM_WORLD, &thid);
+    if ( opts.nthsx > 0 ){
+      if (thid==master) printf("Invalid grid %dx%d: its sub-images are smaller than the halo of %d pixels\n", opts.nthsx, opts.nthsy, khalfsize);
+      MPI_Finalize();
+      return 0;
+    }
+    if (thid==master) printf("warning: no decomposition has sub-images as large as the halo of %d pixels, the result will differ near their borders; use fewer processes\n", khalfsize);
+  }
+  int thpos[2] = {pl.thpos[0], pl.thpos[1]};
+
+  //set no periodicity
+  int periods[2] = {0,0};
+
+  // MPI assignes arbitrary ranks
+  int reorder=1;
+
+  // halos: through shared memory with --shm, one-sided with --halo rma
+  halo_xsize = xsize;
+  halo_ysize = ysize;
+  rma.on     = ( opts.halo == HALO_RMA );
+
+  // with --shm the ranks of a node take a block of the grid
+  MPI_Comm cart_base = MPI_COMM_WORLD;
+  if ( opts.shm ){
+    MPI_Comm_rank(MPI_COMM_WORLD, &thid);
+#ifdef SHM_NODE_SIZE
+    MPI_Comm_split(MPI_COMM_WORLD, thid/SHM_NODE_SIZE, thid, &shm.node);
+#else
+    MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, thid, MPI_INFO_NULL, &shm.node);
+#endif
+    int key = shm_grid_order( shm.node, thpos );
+    if ( key >= 0 ){
+      MPI_Comm_split(MPI_COMM_WORLD, 0, key, &cart_base);
+      reorder = 0;
+    }
+  }
   
-  // ---------------------------------------------
+  // Create a communicator given the 2D torus topology.
+  MPI_Comm grid_communicator;
+  MPI_Cart_create(cart_base, 2, thpos, periods, reorder, &grid_communicator);
+
+  //my thread id in the new communicator
+  MPI_Comm_rank(grid_communicator, &thid);
+  if (thid==master) print_plan( &pl );
+
+  //get coordinate in the new communicator
+  int    xyth[2];
+  MPI_Cart_coords(grid_communicator, thid, 2, xyth);
+
+  int xpxl, ypxl;
+  int start_x, start_y;
+  long start_idx;
+
+  identify_thread(xyth[0], xyth[1], &xpxl, &ypxl, &start_idx, &start_x, &start_y, thpos, thid, xsize, ysize);
+  
+  // the full image of --roi-full is read by the master only
+  unsigned char *full_raw = NULL;
+  if ( roi ){
+    int color_depth = (1 + (maxval > 255))*nch;
+    ptr = malloc( (size_t)xpxl*ypxl*color_depth );
+    read_tile( file, (tiled)? &timg : NULL, data_start, image_xsize, image_ysize, wx0+start_x, wy0+start_y, xpxl, ypxl, 0, color_depth, ptr );
+    if ( opts.roi_full && thid == master ){
+      full_raw = (unsigned char*)malloc( (size_t)image_xsize*image_ysize*color_depth );
+      read_tile( file, (tiled)? &timg : NULL, data_start, image_xsize, image_ysize, 0, 0, image_xsize, image_ysize, 0, color_depth, full_raw );
+    }
+    if ( tiled )
+      tiled_close( &timg );
+    else
+      fclose( file );
+  }
+  else if ( tiled ){
+    ptr = malloc( (size_t)xpxl*ypxl*nch*(1 + (maxval > 255)) );
+    if ( tiled_read_region( &timg, start_x, start_y, xpxl, ypxl, ptr, xpxl ) != 0 )
+      printf("wrong size\n");
+    tiled_close( &timg );
+  }
+  else
+    read_pixels2( &ptr, &maxval, &xpxl, &ypxl, nch, input_image_name, &file, start_idx, nths, thid, thpos, xyth, ysize, xsize);
+  trace_record( "read", tt, MPI_Wtime() );
+
+
+  // the sharing of pixel dimensions of subimages and their starting points is useful now
+  // and necessary in the final stage.
+  void *xpxlrcounts, *ypxlrcounts, *startidxrcounts;
+  xpxlrcounts   = malloc(nths * sizeof(int));
+  ypxlrcounts   = malloc(nths * sizeof(int));
+  startidxrcounts = malloc(nths * sizeof(long));
+
+  MPI_Allgather(&xpxl,      1, MPI_INT, xpxlrcounts,     1, MPI_INT, grid_communicator);;
+  MPI_Allgather(&ypxl,      1, MPI_INT, ypxlrcounts,     1, MPI_INT, grid_communicator);
+  MPI_Allgather(&start_idx, 1, MPI_LONG, startidxrcounts, 1, MPI_LONG, grid_communicator);
   
+  // split the channels in planes of host order samples
+  tt = MPI_Wtime();
+  unsigned short int *planar = (unsigned short int*)malloc( (size_t)xpxl*ypxl*nch*sizeof(short int) );
+  deinterleave_image( ptr, planar, xpxl, ypxl, maxval, nch );
+  free(ptr);
+  ptr = planar;
+  trace_record( "deinterleave", tt, MPI_Wtime() );
 
-  void *rptr;
-  rptr = (void*)ptr;
 
 
+ /*  ------------------------------------------------------- 
 
-  rptr = blur( ptr, xsize, ysize, start_idx, start_x, start_y, xyth[0], xyth[1], xpxl, ypxl, maxval, ksize, kernel, knorm, khalfsize, halo);
-  //rptr = ptr;
+         BLURRING   
 
+     ------------------------------------------------------- */
 
+  // every rank holds its sub-image in a buffer padded by the halos of its neighbours
+  // the depth of the halos is bounded by the smallest sub-image
+  int min_pxl = xsize;
+  for (int i=0; i<nths; i++){
+    if (((int *)xpxlrcounts)[i] < min_pxl) min_pxl = ((int *)xpxlrcounts)[i];
+    if (((int *)ypxlrcounts)[i] < min_pxl) min_pxl = ((int *)ypxlrcounts)[i];
+  }
+  void *rptr = blur_iterations( ptr, xsize, ysize, nch, start_x, start_y, xpxl, ypxl, min_pxl, opts.iterations, opts.halo_depth, ksize, kernel, knorm, khalfsize, opts.edge, grid_communicator, xyth, thpos );
 
 
   // ---------------------------------------------
@@ -819,20 +3250,25 @@ int main( int argc, char *argv[ ] )
 
 
   MPI_Group world_group;
-  MPI_Comm_group(MPI_COMM_WORLD, &world_group);
+  MPI_Comm_group(grid_communicator, &world_group);   // the ranks of the cases are those of the grid
 
   // Construct a group containing all of the prime ranks in world_group
   MPI_Group mpi_group[cases];
   MPI_Comm mpi_group_communicator[cases];
   for(int c=0; c<cases;c++){
     MPI_Group_incl(world_group, cases_counter[c], cases_thid[c], &mpi_group[c] );
-    MPI_Comm_create_group(MPI_COMM_WORLD, mpi_group[c], c, &mpi_group_communicator[c]  );
+    MPI_Comm_create_group(grid_communicator, mpi_group[c], c, &mpi_group_communicator[c]  );
   }
 
   MPI_Group_free(&world_group);
   
-  short int *final_pointer;   // the image when a two bytes are used for each pixel
-  final_pointer = (unsigned short int*)calloc( xsize*ysize, sizeof(short int) );
+  short int *final_pointer = NULL;   // the image when a two bytes are used for each pixel, on the master
+  size_t plane  = (size_t)xsize*ysize;
+  if (thid == master)
+    final_pointer = (unsigned short int*)calloc( plane*nch, sizeof(short int) );
+  // the displacements of Gatherv index the whole image: beyond GATHER_MAX pixels they 
+  // no longer fit an int, and the sub-images are sent in bands of rows (see gather_rows)
+  int large = (plane > GATHER_MAX);
   
 
 
@@ -854,6 +3290,7 @@ int main( int argc, char *argv[ ] )
   */
 
   // for every communicatore
+  tt = MPI_Wtime();
   for(int g=cases-1; g>=0;g--){
     // create a MPI_Datatype corresponding to a row of a sub image 
     MPI_Datatype type, finaltype;      //group g, element 1 (I non master)
@@ -876,16 +3313,21 @@ int main( int argc, char *argv[ ] )
       // master receives a single row at every iteration
       ((int *)rcounts)[i]  = 1; 
       // at the beginning the masters receives the first row positione at the start of the subimage
-      ((int *)displs )[i]  = ((int *)startidxrcounts)[cases_thid[g][i]] ;  
+      ((int *)displs )[i]  = ((long *)startidxrcounts)[cases_thid[g][i]] ;  
     }
   
   
     if (mpi_group_communicator[g] != MPI_COMM_NULL){
-      MPI_Gatherv( rptr,((int *)xpxlrcounts)[cases_thid[g][1]]*((int *)ypxlrcounts)[cases_thid[g][1]] , MPI_UNSIGNED_SHORT, final_pointer, rcounts, displs, finaltype, master, mpi_group_communicator[g]); 
+      // one plane after the other
+      for (int c=0; c<nch && !large; c++)
+        MPI_Gatherv( (unsigned short int*)rptr + c*(size_t)xpxl*ypxl,((int *)xpxlrcounts)[cases_thid[g][1]]*((int *)ypxlrcounts)[cases_thid[g][1]] , MPI_UNSIGNED_SHORT, (thid == master)? final_pointer + c*plane : NULL, rcounts, displs, finaltype, master, mpi_group_communicator[g]); 
       MPI_Group_free(&mpi_group[g]);
       MPI_Comm_free(&mpi_group_communicator[g]);
   }
   }
+  if (large)
+    gather_rows( rptr, xpxl, ypxl, nch, (unsigned short int*)final_pointer, xsize, ysize, (long*)startidxrcounts, (int*)xpxlrcounts, (int*)ypxlrcounts, master, grid_communicator );
+  trace_record( "gather", tt, MPI_Wtime() );
 
    /*  ------------------------------------------------------- 
   
@@ -894,17 +3336,48 @@ int main( int argc, char *argv[ ] )
        ------------------------------------------------------- */
   
   // reverse and save image
+  unsigned char *raw_image = NULL;
   if(thid == master){
-   if ( I_M_LITTLE_ENDIAN )
-     swap_image( final_pointer, xsize, ysize, maxval);
-     write_pgm_image( final_pointer, maxval, xsize, ysize, output_image_name);
+   tt = MPI_Wtime();
+   // of a ROI only the ROI is cut out of the window, and possibly pasted into the image
+   int oxsize = xsize, oysize = ysize;
+   unsigned short int *out_image = (unsigned short int*)final_pointer;
+   if ( roi ){
+     oxsize = opts.roi[2];
+     oysize = opts.roi[3];
+     size_t oplane = (size_t)oxsize*oysize;
+     out_image = (unsigned short int*)malloc( oplane*nch*sizeof(short int) );
+     for ( int c = 0; c < nch; c++ )
+       for ( int y = 0; y < oysize; y++ )
+         memcpy( out_image + c*oplane + (size_t)y*oxsize, (unsigned short int*)final_pointer + c*plane + (size_t)(opts.roi[1]-wy0+y)*xsize + opts.roi[0]-wx0, oxsize*sizeof(short int) );
+   }
+   int color_depth = (1 + (maxval > 255))*nch;
+   raw_image = (unsigned char*)malloc( (size_t)oxsize*oysize*color_depth );
+   interleave_image( out_image, raw_image, oxsize, oysize, maxval, nch );
+   if ( full_raw != NULL ){
+     for ( int y = 0; y < oysize; y++ )
+       memcpy( full_raw + ((size_t)(opts.roi[1]+y)*image_xsize + opts.roi[0])*color_depth, raw_image + (size_t)y*oxsize*color_depth, (size_t)oxsize*color_depth );
+     free(raw_image);
+     raw_image = full_raw;
+     oxsize    = image_xsize;
+     oysize    = image_ysize;
+   }
+   if ( out_image != (unsigned short int*)final_pointer )
+     free(out_image);
+   trace_record( "interleave", tt, MPI_Wtime() );
+   tt = MPI_Wtime();
+   write_pgm_image( raw_image, maxval, oxsize, oysize, nch, output_image_name);
+   trace_record( "write", tt, MPI_Wtime() );
   }
 
   stopt = MPI_Wtime();
   if (thid==master) printf("time: %f\n", stopt-startt);
+  if ( opts.trace_name != NULL )
+    trace_write( opts.trace_name, grid_communicator );
   free(ptr);
   free(rptr);
   free(final_pointer);
+  free(raw_image);
   free(xpxlrcounts);
   free(ypxlrcounts);
   free(startidxrcounts);
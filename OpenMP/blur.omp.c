@@ -4,6 +4,7 @@
 #include <stdio.h> 
 #include <math.h>
 #include <time.h>
+#include "../Tiled/tiled.h"
 #define KSIDE 3 
 #define NTHS  8
 #define XWIDTH 256
@@ -27,22 +28,92 @@
 // ============================================================================================================================================================
 // 1. utilities for managinf pgm files
 //
+//  * write_pgm_frame
 //  * write_pgm_image
+//  * parse_pgm_header
+//  * read_pgm_header
 //  * read_pgm_image
-//  * swap_image
+//  * read_pgm_region
+//  * deinterleave_image
+//  * interleave_image
 //  
 // 2. routine for bluring an image
 //
+//  * build_gaussian
+//  * build_kernel
 //  * blur
+//  * blur_padded
+//  * median_padded
+//  * bilateral_blur_line
+//  * bilateral_padded
+//  * morph_line
+//  * morph_rows
+//  * morph_padded
+//  * read_kernel
+//  * separate_kernel
+//  * custom_padded
+//  * make_stage
+//  * blur_stages
+//
+// 3. domain decomposition
+//
+//  * plan_tiles
+//  * plan_cost
+//  * plan_decomposition
+//  * print_plan
+//
+// 4. run time options and profiling
+//
+//  * read_options
+//  * trace_start
+//  * trace_record
+//  * trace_write
+//
+// 5. iterated and fused blur
+//
+//  * parse_pipeline
+//  * blur_iterations
+//  * bilateral_iterations
+//
+// 6. stream of frames
+//
+//  * read_pgm_frame
+//  * blur_stream
+//
+// 7. in-place blur
+//
+//  * read_planar
+//  * write_planar
+//  * blur_in_place
+//
+// 8. scale space
+//
+//  * scale_space
 //
 // ============================================================================================================================================================
 //  WRITE 
 
-void write_pgm_image( void *image, int maxval, int xsize, int ysize, const char *image_name)
+void write_pgm_frame( FILE *image_file, void *image, int maxval, int xsize, int ysize, int nch )
+/*
+ * writes header and pixels of the image at the current position of an open file, so that
+ * a sequence of frames can be written one after the other
+ */
+{
+  int color_depth = 1 + ( maxval > 255 );
+
+  fprintf(image_file, "P%d\n# generated by\n# M. Danese \n%d %d\n%d\n", (nch==3)? 6 : 5, xsize, ysize, maxval);
+  
+  // Writing file
+  fwrite( image, 1, (size_t)xsize*ysize*color_depth*nch, image_file);  
+}
+
+
+void write_pgm_image( void *image, int maxval, int xsize, int ysize, int nch, const char *image_name)
 /*
  * image        : a pointer to the memory region that contains the image
  * maxval       : either 255 or 65536
  * xsize, ysize : x and y dimensions of the image
+ * nch          : number of channels, 1 (P5, grey) or 3 (P6, RGB)
  * image_name   : the name of the file to be written
  *
  */
@@ -63,151 +134,2108 @@ void write_pgm_image( void *image, int maxval, int xsize, int ysize, const char
   //
   //
 
-  int color_depth = 1 + ( maxval > 255 );
+  write_pgm_frame( image_file, image, maxval, xsize, ysize, nch );
+
+  fclose(image_file); 
+  return ;
+
+  /* ---------------------------------------------------------------
+
+     TYPE    MAGIC NUM     EXTENSION   COLOR RANGE
+           ASCII  BINARY
+
+     PBM   P1     P4       .pbm        [0-1]
+     PGM   P2     P5       .pgm        [0-255]
+     PPM   P3     P6       .ppm        [0-2^16[
+  
+  ------------------------------------------------------------------ */
+}
+
+
+// ============================================================================================================================================================
+
+
+//                               READ PGM
+
+
+void parse_pgm_header( FILE *image_file, int *maxval, int *xsize, int *ysize, int *nch )
+/*
+ * maxval       : a pointer to the int that will store the maximum intensity in the image
+ * xsize, ysize : pointers to the x and y sizes
+ * nch          : a pointer to the number of channels, 1 for P5 and 3 for P6 images
+ * image_file   : the open file, left at the first pixel
+ *
+ */
+{
+  *xsize = *ysize = *maxval = 0;
+  
+  char    MagicN[3];
+  char   *line = NULL;
+  size_t  k, n = 0;
+  
+  /* --------------------------------------------------------------- */
+
+
+  // get the Magic Number - first element
+  if ( fscanf(image_file, "%2s%*c", MagicN ) != 1 ){
+    *maxval = -1;         // no image, e.g. at the end of a stream of frames
+    return;
+  }
+  *nch = (strcmp(MagicN, "P6") == 0)? 3 : 1;
+
+
+    
+  /* --------------------------------------------------------------- */
+
+
+  // skip all the comments
+  k = getline( &line, &n, image_file);
+  while ( (k > 0) && (line[0]=='#') )
+    k = getline( &line, &n, image_file);
+
+    
+  /* --------------------------------------------------------------- */
+
+
+  if (k > 0)
+    {
+      k = sscanf(line, "%d%*c%d%*c%d%*c", xsize, ysize, maxval);
+      if ( k < 3 )
+	if(fscanf(image_file, "%d%*c", maxval)!=1){
+	  printf("no maxval was provided\n");
+	  *maxval = -1;
+	}
+    }
+  // in the case I am givning some bad input
+  else
+    *maxval = -1;         // this is the signal that there was an I/O error
+			  // while reading the image header
+  free( line );
+}
+
+
+void read_pgm_header( int *maxval, int *xsize, int *ysize, int *nch, const char *image_name, FILE **file )
+/*
+ * opens the file and reads the header with parse_pgm_header
+ */
+{
+  *file = fopen(image_name, "r"); 
+  parse_pgm_header( *file, maxval, xsize, ysize, nch );
+}
+
+
+void read_pgm_image( void **image, int *maxval, int *xsize, int *ysize, int *nch, const char *image_name)
+/*
+ * image        : a pointer to the pointer that will contain the image
+ * maxval       : a pointer to the int that will store the maximum intensity in the image
+ * xsize, ysize : pointers to the x and y sizes
+ * nch          : a pointer to the number of channels, 1 for P5 and 3 for P6 images
+ * image_name   : the name of the file to be read
+ *
+ */
+{
+  FILE* image_file; 
+
+  *image = NULL;
+  read_pgm_header( maxval, xsize, ysize, nch, image_name, &image_file );
+  if ( *maxval <= 0 )
+    return;
+
+    
+  /* --------------------------------------------------------------- */
+
+
+  int color_depth = 1 + ( *maxval > 255 );
+  size_t size = (size_t)*xsize * *ysize * color_depth * *nch;
+  
+  if ( (*image = (char*)malloc( size )) == NULL )
+    {
+      fclose(image_file);
+      *maxval = -2;         // this is the signal that memory was insufficient
+      *xsize  = 0;
+      *ysize  = 0;
+      return;
+    }
+  
+  if ( fread( *image, 1, size, image_file) != size )
+    {
+      free( image );
+      image   = NULL;
+      *maxval = -3;         // this is the signal that there was an i/o error
+      *xsize  = 0;
+      *ysize  = 0;
+    }  
+
+  fclose(image_file);
+  return;
+}
+
+
+int read_pgm_region( FILE *image_file, long data_start, int xsize, int pixel_bytes, int x0, int y0, int xpxl, int ypxl, unsigned char *region )
+/*
+ * reads the xpxl x ypxl pixels starting at (x0, y0) of an image of xsize columns, whose
+ * pixels (of pixel_bytes bytes each) start at data_start in the file. Only the needed part
+ * of each row is read: region holds them contiguously, as in a file of xpxl columns.
+ * Returns 0 on success.
+ */
+{
+  for (int y=0; y<ypxl; y++){
+    fseek( image_file, data_start + ((long)(y0+y)*xsize + x0)*pixel_bytes, SEEK_SET );
+    if ( fread( region + (size_t)y*xpxl*pixel_bytes, pixel_bytes, xpxl, image_file ) != (size_t)xpxl )
+      return -1;
+  }
+  return 0;
+}
+
+
+// ============================================================================================================================================================
+
+
+//                               PLANAR LAYOUT
+
+
+/*
+  Pixels are stored in the files as 1 or 2 big endian bytes per sample (maxval > 255), and 
+  the 3 samples of a P6 pixel are interleaved (RGBRGB...). The blur works instead on planar
+  images of unsigned short in the host order: channel c of pixel idx is at c*xsize*ysize+idx, 
+  so that every channel is a contiguous grey image sharing the indices of the others.
+*/
+
+
+void deinterleave_image( const unsigned char *raw, unsigned short int *planar, int xsize, int ysize, int maxval, int nch )
+/*
+ * raw    : the pixels as read from the file
+ * planar : nch planes of xsize*ysize samples
+ */
+{
+  size_t plane = (size_t)xsize*ysize;
+  if ( maxval > 255 )
+    for ( size_t i = 0; i < plane; i++ )
+      for ( int c = 0; c < nch; c++ )
+        planar[c*plane+i] = (raw[2*(i*nch+c)] << 8) | raw[2*(i*nch+c)+1];
+  else
+    for ( size_t i = 0; i < plane; i++ )
+      for ( int c = 0; c < nch; c++ )
+        planar[c*plane+i] = raw[i*nch+c];
+  return;
+}
+
+
+void interleave_image( const unsigned short int *planar, unsigned char *raw, int xsize, int ysize, int maxval, int nch )
+/*
+ * the inverse of deinterleave_image
+ */
+{
+  size_t plane = (size_t)xsize*ysize;
+  if ( maxval > 255 )
+    for ( size_t i = 0; i < plane; i++ )
+      for ( int c = 0; c < nch; c++ ){
+        raw[2*(i*nch+c)]   = planar[c*plane+i] >> 8;
+        raw[2*(i*nch+c)+1] = planar[c*plane+i] & 0xff;
+      }
+  else
+    for ( size_t i = 0; i < plane; i++ )
+      for ( int c = 0; c < nch; c++ )
+        raw[i*nch+c] = planar[c*plane+i];
+  return;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               KERNEL
+
+
+float build_gaussian( int ksize, float sigma, float *kernel )
+/*
+ * fills kernel (ksize*ksize values, row by row) with the gaussian of the given sigma and
+ * returns its normalisation
+ */
+{
+  float knorm = 0;
+  int khalfsize = (ksize-1)/2; // radius of the kernel
+  float kden  = 1./(2.*sigma*sigma);
+  for (int i=0; i<ksize;i++){
+    float ky=i-khalfsize;
+    for (int j=0; j<ksize;j++){
+      float kx=j-khalfsize;
+      kernel[i*ksize+j]=expf( -((kx*kx)+(ky*ky))*kden );
+      knorm += kernel[i*ksize+j];
+    }
+  }
+  return knorm;
+}
+
+
+float build_kernel( int ktype, int ksize, float kfactor, float *kernel )
+/*
+ * fills kernel (ksize*ksize values, row by row) with the kernel of the given type and
+ * returns its normalisation:
+ *   0 - average kernel
+ *   1 - weight kernel, the central pixel weighting kfactor
+ *   2 - gaussian kernel
+ *   3 - median filter: no kernel, the average one is filled in (see median_padded)
+ *   4 - bilateral filter: no kernel (see bilateral_padded)
+ *   5 to 8 - erosion, dilation, opening, closing: no kernel, the average one is filled in
+ */
+{
+  float knorm = 0;
+  int khalfsize = (ksize-1)/2; // radius of the kernel
+
+  // ---------------------------------------------
+  // average kernel
+  if (ktype==0 || ktype==3 || ktype>=5) {
+    for (int i=0; i<ksize*ksize;i++){
+      kernel[i]=1;
+      knorm += kernel[i];
+    }
+  }
+  else if (ktype==1) {
+  // ---------------------------------------------
+  // weight kernel
+    for (int i=0; i<ksize*ksize;i++){
+      kernel[i]=1-kfactor;
+    }
+    knorm = (ksize*ksize-1);
+    kernel[khalfsize*ksize+khalfsize]=kfactor*(ksize*ksize-1);
+  }
+  else if (ktype==2) {
+  // ---------------------------------------------
+  // gaussian kernel, as wide as the kernel
+    knorm = build_gaussian( ksize, khalfsize, kernel );
+  }
+  return knorm;
+}
+
+
+
+
+// ============================================================================================================================================================
+
+
+//                               BLUR PGM
+
+
+void * blur( void *image, int xsize, int ysize, int nch, size_t start_idx, int start_x, int start_y, int xxth, int yyth, int xpxl, int ypxl, int maxval, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize)
+/*
+  This routine takes as input the image to blur, its x and y size, its maxval (as above), 
+  the kernel size (ksize), the kernel matrix valuse and its normalisation.
+  All the nch planes of the image are blurred in the same pass, the result has nch 
+  planes of xpxl*ypxl pixels.
+  start_idx is the index of the first pixel of the sub-image, start_y its first row: 
+  indices are size_t, as images may exceed 2^31 pixels.
+ */
+{
+  short int *sImage;   
+  void      *tempptr;
+
+      size_t plane  = (size_t)xsize*ysize;
+      size_t splane = (size_t)xpxl*ypxl;
+      sImage = (unsigned short int*)malloc( splane*nch*sizeof(short int) );
+      unsigned short int _maxval = swap((unsigned short int)maxval);
+      for ( int yy = 0; yy < ypxl; yy++ ){
+        for( int xx = 0; xx < xpxl; xx++ ){
+        size_t idx = start_idx + (size_t)yy*xsize + xx; 
+	  //to store partial results, one for each channel
+	  double xxyy[nch];
+	  for (int c=0; c<nch; c++) xxyy[c] = 0;
+	  //loop over the kernel
+	  for (int yks=-khalfsize; yks<khalfsize+1; yks++){
+	    for (int xks=-khalfsize; xks<khalfsize+1; xks++){
+	      if (start_x + xx + xks < xsize && start_y + yy + yks < ysize  && start_x+xx+xks >= 0 && start_y+yy+yks >=0){
+	        size_t sidx = idx + (long)yks*xsize + xks; 
+	        for (int c=0; c<nch; c++)
+	          xxyy[c] += kernel[khalfsize+yks][khalfsize+xks]*((unsigned short int*)image)[c*plane+sidx];
+	        }
+              }
+	    }
+	    for (int c=0; c<nch; c++)
+	      sImage[c*splane+(size_t)yy*xpxl+xx] = round(xxyy[c]/knorm);
+	    idx++;
+          }
+	}
+      tempptr = (void*)sImage;	
+
+  return tempptr;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               BLUR PADDED REGION
+
+
+void blur_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize )
+/*
+  Same as blur, but image points to the first pixel of a region of xpxl x ypxl pixels
+  (rows of istride pixels) surrounded by an apron of at least khalfsize pixels on every 
+  side, with zeros outside the image. Thus no border check is needed inside the kernel 
+  loops. The result is stored in out (rows of ostride pixels).
+ */
+{
+  for ( int yy = 0; yy < ypxl; yy++ ){
+    for( int xx = 0; xx < xpxl; xx++ ){
+      unsigned short int *center = image + yy*istride + xx;
+      double xxyy = 0;
+      for (int yks=-khalfsize; yks<khalfsize+1; yks++){
+        unsigned short int *row = center + yks*istride;
+        for (int xks=-khalfsize; xks<khalfsize+1; xks++)
+          xxyy += kernel[khalfsize+yks][khalfsize+xks]*row[xks];
+      }
+      out[yy*ostride+xx] = round(xxyy/knorm);
+    }
+  }
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               MEDIAN FILTER
+
+
+/*
+  ktype 3 replaces the kernel by the median of the ksize x ksize pixels around each pixel,
+  computed with the constant-time algorithm of Perreault and Hebert: every column of the
+  region keeps the histogram of its ksize pixels around the current row, and the 
+  histogram of the window is the sum of ksize column histograms. Moving right, one column
+  histogram is added and one subtracted; moving down, every column histogram loses a 
+  pixel and gains one. No step depends on ksize, so a radius-50 median costs about as 
+  much per pixel as a radius-2 one.
+
+  Histograms are in two tiers, with the bits of the largest sample split between a coarse
+  and a fine level (16 x 16 bins for 8-bit samples, 256 x 256 for 16-bit ones): the window
+  keeps all its coarse bins up to date, which locate the coarse bin of the median, while 
+  the fine bins of a coarse bin are brought up to date lazily, only when the median falls
+  in it, from the position of their last update. The region is walked in vertical strips, 
+  as wide as MEDIAN_MEMORY bytes of column histograms allow.
+*/
+
+#define MEDIAN_MEMORY (32*1024*1024)   // bytes of the column histograms
+
+
+void median_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, int khalfsize )
+/*
+ * median filter of a region, with the same conventions as blur_padded
+ */
+{
+  int r     = khalfsize;
+  int ksize = 2*r+1;
+  int half  = ksize*ksize/2;          // rank of the median in the window
+
+  // bins: coarse bits, then fine bits, of the largest sample of the region and its apron
+  unsigned short int vmax = 0;
+  for (int y=-r; y<ypxl+r; y++)
+    for (int x=-r; x<xpxl+r; x++)
+      if (image[(long)y*istride+x] > vmax) vmax = image[(long)y*istride+x];
+  int bits = 1;
+  while ((1 << bits) <= vmax) bits++;
+  int fbits = (bits+1)/2;
+  int nc    = 1 << (bits-fbits);      // coarse bins
+  int nf    = 1 << fbits;             // fine bins of a coarse bin
+
+  int strip = (int)(MEDIAN_MEMORY/(nc*nf*sizeof(short int))) - 2*r;
+  if (strip < 16)   strip = 16;
+  if (strip > xpxl) strip = xpxl;
+  int ncols = strip + 2*r;
+  unsigned short int *ccol = (unsigned short int*)calloc( (size_t)ncols*nc,    sizeof(short int) );  // column histograms, the fine ones
+  unsigned short int *fcol = (unsigned short int*)calloc( (size_t)ncols*nc*nf, sizeof(short int) );  // grouped by coarse bin
+  unsigned int *hc0  = (unsigned int*)calloc( nc,    sizeof(int) );   // window at the start of the row
+  unsigned int *hf0  = (unsigned int*)calloc( nc*nf, sizeof(int) );
+  unsigned int *hc   = (unsigned int*)malloc( nc*sizeof(int) );       // window at the current pixel
+  unsigned int *hf   = (unsigned int*)malloc( nc*nf*sizeof(int) );
+  int          *last = (int*)malloc( nc*sizeof(int) );                 // position of the fine bins of hf
+
+  #define MEDIAN_COLUMN(c, v, d) { ccol[(size_t)(c)*nc + ((v) >> fbits)] += (d); fcol[((size_t)((v) >> fbits)*ncols + (c))*nf + ((v) & (nf-1))] += (d); }
+  #define MEDIAN_WINDOW(v, d)    { hc0[(v) >> fbits] += (d); hf0[v] += (d); }
+
+  for (int sx=0; sx<xpxl; sx+=strip){
+    int w = (xpxl-sx < strip)? xpxl-sx : strip;
+    unsigned short int *base = image + sx - r;       // column c of the histograms
+
+    // columns and window of the first row
+    for (int y=-r; y<=r; y++)
+      for (int c=0; c<w+2*r; c++){
+        unsigned short int v = base[(long)y*istride+c];
+        MEDIAN_COLUMN(c, v, 1);
+        if (c < ksize) MEDIAN_WINDOW(v, 1);
+      }
+
+    for (int y=0; y<ypxl; y++){
+      memcpy(hc, hc0, nc*sizeof(int));
+      for (int b=0; b<nc; b++)
+        last[b] = -1;                                // fine bins still in hf0
+
+      for (int x=0; x<w; x++){
+        if (x > 0)
+          for (int b=0; b<nc; b++)
+            hc[b] += ccol[(size_t)(x+2*r)*nc+b] - ccol[(size_t)(x-1)*nc+b];
+        int acc = 0, b = 0;
+        while (acc + (int)hc[b] <= half)
+          acc += hc[b++];
+
+        // fine bins of b at x: from the start of the row, or the last update, or the columns
+        unsigned int *seg = hf + (size_t)b*nf;
+        if (last[b] < 0){
+          memcpy(seg, hf0 + (size_t)b*nf, nf*sizeof(int));
+          last[b] = 0;
+        }
+        if (x - last[b] > ksize){
+          memset(seg, 0, nf*sizeof(int));
+          for (int c=x; c<x+ksize; c++)
+            for (int f=0; f<nf; f++)
+              seg[f] += fcol[((size_t)b*ncols+c)*nf+f];
+        }
+        else
+          for (int j=last[b]+1; j<=x; j++)
+            for (int f=0; f<nf; f++)
+              seg[f] += fcol[((size_t)b*ncols+j+2*r)*nf+f] - fcol[((size_t)b*ncols+j-1)*nf+f];
+        last[b] = x;
+        int f = 0;
+        while (acc + (int)seg[f] <= half)
+          acc += seg[f++];
+        out[(long)y*ostride+sx+x] = b*nf + f;
+      }
+
+      // down one row: row y-r leaves, row y+r+1 enters
+      if (y < ypxl-1)
+        for (int c=0; c<w+2*r; c++){
+          unsigned short int vout = base[(long)(y-r)*istride+c];
+          unsigned short int vin  = base[(long)(y+r+1)*istride+c];
+          MEDIAN_COLUMN(c, vout, -1);
+          MEDIAN_COLUMN(c, vin,   1);
+          if (c < ksize){
+            MEDIAN_WINDOW(vout, -1);
+            MEDIAN_WINDOW(vin,   1);
+          }
+        }
+    }
+
+    // empty the histograms for the next strip
+    for (int y=ypxl-1-r; y<=ypxl-1+r; y++)
+      for (int c=0; c<w+2*r; c++){
+        unsigned short int v = base[(long)y*istride+c];
+        MEDIAN_COLUMN(c, v, -1);
+        if (c < ksize) MEDIAN_WINDOW(v, -1);
+      }
+  }
+  #undef MEDIAN_COLUMN
+  #undef MEDIAN_WINDOW
+
+  free(ccol);
+  free(fcol);
+  free(hc0);
+  free(hf0);
+  free(hc);
+  free(hf);
+  free(last);
+}
+
+
+// ============================================================================================================================================================
+
+
+//                               BILATERAL GRID
+
+
+/*
+  ktype 4 is an edge-preserving bilateral filter: the gaussian of ksize weights the pixels
+  by their distance (sigma_s = khalfsize, as for ktype 2) and by the difference of their 
+  values (sigma_r, a fraction of maxval given as the additional parameter). The direct 
+  filter costs ksize*ksize exponentials per pixel; instead, as in the bilateral grid of 
+  Chen, Paris and Durand, the pixels are splatted into a coarse 3D grid of cells sigma_s 
+  wide in space and sigma_r in value, each cell summing values and weights, the grid is 
+  blurred with the small separable kernel 1 4 6 4 1 along its three axes, and every pixel
+  is sliced out of it by trilinear interpolation at its position and value. The grid has 
+  about npixels/sigma_s^2 * maxval/sigma_r cells, so the cost is linear in the pixels 
+  whatever sigma_s.
+
+  The cells are aligned to the image, not to the region: a region needs the cells within
+  BILATERAL_CELLS of its own, and the pixels of the image within BILATERAL_APRON(sigma_s)
+  of it to fill them, so that any decomposition gives the same result. Pixels outside the
+  image are not splatted.
+*/
+
+#define BILATERAL_CELLS    2                                      // half-size of the kernel of the grid
+#define BILATERAL_APRON(ss) ((int)ceil((BILATERAL_CELLS+1.5)*(ss)) + 1)
+
+
+void bilateral_blur_line( float *first, int n, size_t stride, float *line )
+/*
+ * blurs with 1 4 6 4 1 a line of n cells of the grid (value and weight), stride floats
+ * apart, cells beyond the line counting as empty; line holds 2*n floats
+ */
+{
+  const float k[2*BILATERAL_CELLS+1] = {1./16, 4./16, 6./16, 4./16, 1./16};
+  for (int i=0; i<n; i++){
+    line[2*i]   = first[i*stride];
+    line[2*i+1] = first[i*stride+1];
+  }
+  for (int i=0; i<n; i++){
+    float v = 0, w = 0;
+    for (int j=-BILATERAL_CELLS; j<=BILATERAL_CELLS; j++)
+      if (i+j >= 0 && i+j < n){
+        v += k[j+BILATERAL_CELLS]*line[2*(i+j)];
+        w += k[j+BILATERAL_CELLS]*line[2*(i+j)+1];
+      }
+    first[i*stride]   = v;
+    first[i*stride+1] = w;
+  }
+}
+
+
+void bilateral_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, int x0, int y0, int xsize, int ysize, float ss, float sr )
+/*
+ * bilateral filter of a region of xpxl x ypxl pixels at (x0, y0) in an image of xsize x 
+ * ysize, with spatial and range sigmas ss and sr: image points to the first pixel of the 
+ * region and must hold the pixels of the image within BILATERAL_APRON(ss) of it, rows of 
+ * istride pixels. The result is stored in out (rows of ostride pixels).
+ */
+{
+  // cells around the region, and the pixels of the image splatted into them
+  int cx0 = (int)floor(x0/ss) - BILATERAL_CELLS, cx1 = (int)floor((x0+xpxl-1)/ss) + 1 + BILATERAL_CELLS;
+  int cy0 = (int)floor(y0/ss) - BILATERAL_CELLS, cy1 = (int)floor((y0+ypxl-1)/ss) + 1 + BILATERAL_CELLS;
+  int nx  = cx1-cx0+1, ny = cy1-cy0+1;
+  int apron = BILATERAL_APRON(ss);
+  int px0 = (x0-apron < 0)? 0 : x0-apron, px1 = (x0+xpxl+apron > xsize)? xsize : x0+xpxl+apron;
+  int py0 = (y0-apron < 0)? 0 : y0-apron, py1 = (y0+ypxl+apron > ysize)? ysize : y0+ypxl+apron;
+
+  // cells in value: up to the largest sample, plus one for the interpolation
+  unsigned short int vmax = 0;
+  for (int y=py0; y<py1; y++)
+    for (int x=px0; x<px1; x++)
+      if (image[(long)(y-y0)*istride+x-x0] > vmax) vmax = image[(long)(y-y0)*istride+x-x0];
+  int nz = (int)(vmax/sr + 0.5) + 2;
+
+  // ---------------------------------------------
+  // splat: cells of [y][x][z], each a sum of values and a weight
+  size_t zs = 2, xs = 2*(size_t)nz, ys = xs*nx;
+  float *grid = (float*)calloc( ys*ny, sizeof(float) );
+  for (int y=py0; y<py1; y++){
+    int iy = (int)floor(y/ss + 0.5) - cy0;
+    if (iy < 0 || iy >= ny) continue;
+    for (int x=px0; x<px1; x++){
+      int ix = (int)floor(x/ss + 0.5) - cx0;
+      if (ix < 0 || ix >= nx) continue;
+      unsigned short int v = image[(long)(y-y0)*istride+x-x0];
+      float *cell = grid + iy*ys + ix*xs + (int)(v/sr + 0.5)*zs;
+      cell[0] += v;
+      cell[1] += 1;
+    }
+  }
+
+  // ---------------------------------------------
+  // blur along z, x and y
+  int nmax = (nz > nx)? nz : nx;
+  if (ny > nmax) nmax = ny;
+  float *line = (float*)malloc( 2*nmax*sizeof(float) );
+  for (int iy=0; iy<ny; iy++)
+    for (int ix=0; ix<nx; ix++)
+      bilateral_blur_line( grid + iy*ys + ix*xs, nz, zs, line );
+  for (int iy=0; iy<ny; iy++)
+    for (int iz=0; iz<nz; iz++)
+      bilateral_blur_line( grid + iy*ys + iz*zs, nx, xs, line );
+  for (int ix=0; ix<nx; ix++)
+    for (int iz=0; iz<nz; iz++)
+      bilateral_blur_line( grid + ix*xs + iz*zs, ny, ys, line );
+  free(line);
+
+  // ---------------------------------------------
+  // slice: trilinear interpolation at the position and value of every pixel
+  // (fractions taken before the offset of the cells, to be the same in any region)
+  for (int yy=0; yy<ypxl; yy++){
+    float gy = (y0+yy)/ss;
+    int   iy = (int)gy;
+    float fy = gy - iy;
+    iy -= cy0;
+    for (int xx=0; xx<xpxl; xx++){
+      float gx = (x0+xx)/ss;
+      int   ix = (int)gx;
+      float fx = gx - ix;
+      ix -= cx0;
+      unsigned short int v = image[(long)yy*istride+xx];
+      float gz = v/sr;
+      int   iz = (int)gz;
+      float fz = gz - iz;
+      float *c = grid + iy*ys + ix*xs + iz*zs;
+      float sum[2];
+      for (int k=0; k<2; k++)
+        sum[k] = (1-fy)*( (1-fx)*((1-fz)*c[k]       + fz*c[zs+k])       + fx*((1-fz)*c[xs+k]    + fz*c[xs+zs+k]) )
+                +   fy *( (1-fx)*((1-fz)*c[ys+k]    + fz*c[ys+zs+k])    + fx*((1-fz)*c[ys+xs+k] + fz*c[ys+xs+zs+k]) );
+      out[(long)yy*ostride+xx] = (sum[1] > 0)? round(sum[0]/sum[1]) : v;
+    }
+  }
+  free(grid);
+}
+
+
+// ============================================================================================================================================================
+
+
+//                               MORPHOLOGY
+
+
+/*
+  ktypes 5 to 8 are the grey-level erosion, dilation, opening and closing with a square
+  ksize x ksize structuring element. Both operators are separable, a row pass then a 
+  column pass, and each pass uses the algorithm of van Herk and Gil-Werman: the line is cut
+  into blocks of ksize values, within which the running maxima g from the start of the 
+  block and h to its end are taken; the window starting at i then spans at most two 
+  blocks, and its maximum is max(h[i], g[i+ksize-1]). That is 3 comparisons per value and 
+  pass, whatever ksize. The column pass works on whole rows at a time, so that its loops
+  run along contiguous memory, where the compiler vectorises them.
+  The erosion is computed as the dilation of the complement (65535 - value), and opening
+  and closing chain the two operators in the same call, on a region extended by the radius
+  of the second one: their apron is twice the radius. Pixels outside the image take no 
+  part, as if they were neutral for the operator (0 for a dilation, 65535 for an erosion).
+*/
+
+#define MORPH_ERODE  1
+#define MORPH_DILATE 2
+#define MORPH_OPEN   3     // erosion, then dilation
+#define MORPH_CLOSE  4     // dilation, then erosion
+
+#define MORPH_MAX(a,b) (((a) > (b))? (a) : (b))
+
+
+void morph_line( const unsigned short int *in, unsigned short int *out, int n, int w, unsigned short int *g, unsigned short int *h )
+/*
+ * out[i] = max of in[i ... i+w-1], for n outputs; g and h hold n+w-1 values
+ */
+{
+  int m = n+w-1;
+  for (int b=0; b<m; b+=w){
+    int e = (b+w < m)? b+w : m;
+    g[b] = in[b];
+    for (int i=b+1; i<e; i++)
+      g[i] = MORPH_MAX(g[i-1], in[i]);
+    h[e-1] = in[e-1];
+    for (int i=e-2; i>=b; i--)
+      h[i] = MORPH_MAX(h[i+1], in[i]);
+  }
+  for (int i=0; i<n; i++)
+    out[i] = MORPH_MAX(h[i], g[i+w-1]);
+}
+
+
+void morph_rows( const unsigned short int *in, int istride, unsigned short int *out, int ostride, int width, int n, int w, unsigned short int *g, unsigned short int *h )
+/*
+ * as morph_line, along the columns of n+w-1 rows of width values: row i of out is the 
+ * maximum of the rows i ... i+w-1 of in; g and h hold (n+w-1)*width values
+ */
+{
+  int m = n+w-1;
+  for (int b=0; b<m; b+=w){
+    int e = (b+w < m)? b+w : m;
+    memcpy( g + (size_t)b*width, in + (long)b*istride, width*sizeof(short int) );
+    for (int i=b+1; i<e; i++){
+      unsigned short int *gi = g + (size_t)i*width, *gp = gi - width;
+      const unsigned short int *ii = in + (long)i*istride;
+      for (int x=0; x<width; x++)
+        gi[x] = MORPH_MAX(gp[x], ii[x]);
+    }
+    memcpy( h + (size_t)(e-1)*width, in + (long)(e-1)*istride, width*sizeof(short int) );
+    for (int i=e-2; i>=b; i--){
+      unsigned short int *hi = h + (size_t)i*width, *hn = hi + width;
+      const unsigned short int *ii = in + (long)i*istride;
+      for (int x=0; x<width; x++)
+        hi[x] = MORPH_MAX(hn[x], ii[x]);
+    }
+  }
+  for (int i=0; i<n; i++){
+    unsigned short int *oi = out + (long)i*ostride;
+    const unsigned short int *hi = h + (size_t)i*width, *gi = g + (size_t)(i+w-1)*width;
+    for (int x=0; x<width; x++)
+      oi[x] = MORPH_MAX(hi[x], gi[x]);
+  }
+}
+
+
+void morph_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, int x0, int y0, int xsize, int ysize, int khalfsize, int op )
+/*
+ * operator op (MORPH_*) on a region of xpxl x ypxl pixels at (x0, y0) in an image of 
+ * xsize x ysize: image points to the first pixel of the region, with an apron of 
+ * khalfsize pixels (the radius, twice for opening and closing) wherever it falls inside
+ * the image; rows of istride pixels. The result is stored in out (rows of ostride pixels).
+ */
+{
+  int twice = (op == MORPH_OPEN || op == MORPH_CLOSE);
+  int r     = (twice)? khalfsize/2 : khalfsize;
+  int w     = 2*r+1;
+  int e     = khalfsize - r;                 // extension of the result of the first operator
+  int bx    = xpxl + 2*khalfsize, by = ypxl + 2*khalfsize;
+  int flip  = (op == MORPH_ERODE || op == MORPH_OPEN);   // the first operator is an erosion
+
+  unsigned short int *a   = (unsigned short int*)calloc( (size_t)bx*by, sizeof(short int) );
+  unsigned short int *b   = (unsigned short int*)malloc( (size_t)bx*by*sizeof(short int) );
+  unsigned short int *row = (unsigned short int*)malloc( (size_t)bx*by*sizeof(short int) );
+  unsigned short int *g   = (unsigned short int*)malloc( (size_t)bx*by*sizeof(short int) );
+  unsigned short int *h   = (unsigned short int*)malloc( (size_t)bx*by*sizeof(short int) );
+
+  // the pixels of the image around the region, complemented for an erosion, 0 outside
+  for (int y=-khalfsize; y<ypxl+khalfsize; y++){
+    if (y0+y < 0 || y0+y >= ysize) continue;
+    for (int x=-khalfsize; x<xpxl+khalfsize; x++)
+      if (x0+x >= 0 && x0+x < xsize){
+        unsigned short int v = image[(long)y*istride+x];
+        a[(size_t)(y+khalfsize)*bx+x+khalfsize] = (flip)? 65535-v : v;
+      }
+  }
+
+  // first operator, on the region extended by e
+  int bw = xpxl+2*e, bh = ypxl+2*e;
+  for (int y=0; y<bh+2*r; y++)
+    morph_line( a + (size_t)y*bx, row + (size_t)y*bw, bw, w, g, h );
+  morph_rows( row, bw, b, bw, bw, bh, w, g, h );
+
+  if (twice){
+    // the second operator is the opposite one: complement, 0 outside the image
+    for (int y=0; y<bh; y++)
+      for (int x=0; x<bw; x++){
+        int inside = (x0+x-e >= 0 && x0+x-e < xsize && y0+y-e >= 0 && y0+y-e < ysize);
+        b[(size_t)y*bw+x] = (inside)? 65535-b[(size_t)y*bw+x] : 0;
+      }
+    flip = !flip;
+    for (int y=0; y<bh; y++)
+      morph_line( b + (size_t)y*bw, row + (size_t)y*xpxl, xpxl, w, g, h );
+    morph_rows( row, xpxl, b, xpxl, xpxl, ypxl, w, g, h );
+  }
+
+  // (e = 0 without a second operator, the result is xpxl wide in any case)
+  for (int y=0; y<ypxl; y++)
+    for (int x=0; x<xpxl; x++){
+      unsigned short int v = b[(size_t)y*xpxl+x];
+      out[(long)y*ostride+x] = (flip)? 65535-v : v;
+    }
+
+  free(a);
+  free(b);
+  free(row);
+  free(g);
+  free(h);
+}
+
+
+// ============================================================================================================================================================
+
+
+//                               CUSTOM KERNELS
+
+
+/*
+  --kernel reads a ksize x ksize kernel from a text file: ksize, then the ksize*ksize
+  weights row by row, separated by blanks, with "#" starting a comment up to the end of
+  the line. The result is normalised by the sum of the weights (by 1 if they sum to 0, as
+  for edge detectors) and clipped to [0, maxval].
+
+  Applied directly, the kernel costs ksize^2 taps per pixel. separate_kernel decomposes it
+  instead with the singular value decomposition K = sum_i s_i u_i v_i^T, computed with the
+  one-sided Jacobi method, and keeps the fewest rank-1 terms whose neglected singular
+  values weigh at most tol of the kernel (relative Frobenius norm): each term is a column
+  u_i and a row v_i, applied as two passes of ksize taps, for 2*rank*ksize taps per pixel,
+  a speedup of ksize/(2*rank). A gaussian kernel has rank 1, a disc a few terms; when the
+  terms would cost as much as the kernel (2*rank >= ksize), it is applied directly.
+*/
+
+#define KERNEL_TOL 1e-3   // default of --kernel-tol
+
+
+float * read_kernel( const char *kernel_name, int *ksize )
+/*
+ * reads a kernel file and returns its ksize*ksize weights, NULL if it is not valid
+ */
+{
+  FILE *file = fopen( kernel_name, "r" );
+  if ( file == NULL )
+    return NULL;
+
+  float *kernel = NULL;
+  int    n = 0, nread = -1;
+  for (;;){
+    int c = fgetc(file);
+    while ( c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == ',' )
+      c = fgetc(file);
+    if ( c == '#' ){
+      while ( c != '\n' && c != EOF )
+        c = fgetc(file);
+      continue;
+    }
+    if ( c == EOF )
+      break;
+    ungetc(c, file);
+    if ( nread < 0 ){
+      if ( fscanf(file, "%d", ksize) != 1 || *ksize < 1 || *ksize%2 == 0 )
+        break;
+      kernel = (float*)malloc( (size_t)(*ksize)*(*ksize)*sizeof(float) );
+      nread  = 0;
+      n      = (*ksize)*(*ksize);
+    }
+    else if ( nread == n || fscanf(file, "%f", &kernel[nread++]) != 1 ){
+      nread = -1;
+      break;
+    }
+  }
+  fclose(file);
+
+  if ( nread != n || n == 0 ){
+    free(kernel);
+    return NULL;
+  }
+  return kernel;
+}
+
+
+int separate_kernel( int ksize, const float *kernel, double tol, float *terms, double *error )
+/*
+ * rank-1 terms of the kernel within the relative error tol: returns their number (the 
+ * rank) and stores them in terms (up to 2*ksize*ksize values), each one as a column of 
+ * ksize weights followed by a row of ksize weights, and the error of the truncation
+ */
+{
+  int n = ksize;
+  double *a = (double*)malloc( (size_t)n*n*sizeof(double) );   // columns: s_i u_i
+  double *v = (double*)calloc( (size_t)n*n, sizeof(double) );  // columns: v_i
+  for (int i=0; i<n*n; i++)
+    a[i] = kernel[i];
+  for (int i=0; i<n; i++)
+    v[i*n+i] = 1;
+
+  // ---------------------------------------------
+  // one-sided Jacobi: rotate pairs of columns of a until they are orthogonal, then
+  // a = K V holds the singular values times the left vectors
+  for (int sweep=0; sweep<60; sweep++){
+    int rotated = 0;
+    for (int p=0; p<n-1; p++)
+      for (int q=p+1; q<n; q++){
+        double alpha = 0, beta = 0, gamma = 0;
+        for (int i=0; i<n; i++){
+          alpha += a[i*n+p]*a[i*n+p];
+          beta  += a[i*n+q]*a[i*n+q];
+          gamma += a[i*n+p]*a[i*n+q];
+        }
+        if ( fabs(gamma) <= 1e-15*sqrt(alpha*beta) )
+          continue;
+        rotated = 1;
+        double zeta = (beta-alpha)/(2*gamma);
+        double t    = ((zeta >= 0)? 1 : -1)/(fabs(zeta) + sqrt(1+zeta*zeta));
+        double c    = 1/sqrt(1+t*t), s = c*t;
+        for (int i=0; i<n; i++){
+          double ap = a[i*n+p], aq = a[i*n+q];
+          a[i*n+p] = c*ap - s*aq;
+          a[i*n+q] = s*ap + c*aq;
+          double vp = v[i*n+p], vq = v[i*n+q];
+          v[i*n+p] = c*vp - s*vq;
+          v[i*n+q] = s*vp + c*vq;
+        }
+      }
+    if ( !rotated )
+      break;
+  }
+
+  // ---------------------------------------------
+  // singular values in decreasing order, and the fewest terms within tol
+  double sv[n], total = 0;
+  int    order[n];
+  for (int j=0; j<n; j++){
+    sv[j] = 0;
+    for (int i=0; i<n; i++)
+      sv[j] += a[i*n+j]*a[i*n+j];
+    total   += sv[j];
+    order[j] = j;
+    for (int k=j; k>0 && sv[order[k]] > sv[order[k-1]]; k--){
+      int swap_j = order[k];
+      order[k]   = order[k-1];
+      order[k-1] = swap_j;
+    }
+  }
+  int    rank = n;
+  double left = 0;                  // squared singular values of the neglected terms
+  while ( rank > 1 && sqrt(left + sv[order[rank-1]]) <= tol*sqrt(total) )
+    left += sv[order[--rank]];
+  *error = (total > 0)? sqrt(left/total) : 0;
+
+  // the singular value is split evenly between the column and the row
+  for (int r=0; r<rank; r++){
+    int    j = order[r];
+    double s = sqrt(sqrt(sv[j]));
+    for (int i=0; i<n; i++){
+      terms[(size_t)r*2*n + i]     = (s > 0)? a[i*n+j]/s : 0;
+      terms[(size_t)r*2*n + n + i] = v[i*n+j]*s;
+    }
+  }
+
+  free(a);
+  free(v);
+  return rank;
+}
+
+
+void custom_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, int ksize, const float *kernel, float knorm, int maxval, int rank, const float *terms )
+/*
+ * a custom kernel on a region, with the conventions of blur_padded: as rank separable
+ * terms (see separate_kernel), or directly if rank is 0; results are clipped to [0, maxval]
+ */
+{
+  int    khalfsize = (ksize-1)/2;
+  float *acc = (float*)calloc( (size_t)xpxl*ypxl, sizeof(float) );
+
+  if ( rank == 0 ){
+    for (int yy=0; yy<ypxl; yy++)
+      for (int yks=-khalfsize; yks<=khalfsize; yks++){
+        const float *krow = kernel + (khalfsize+yks)*ksize + khalfsize;
+        for (int xks=-khalfsize; xks<=khalfsize; xks++){
+          float w = krow[xks];
+          unsigned short int *row = image + (long)(yy+yks)*istride + xks;
+          float *arow = acc + (size_t)yy*xpxl;
+          for (int xx=0; xx<xpxl; xx++)
+            arow[xx] += w*row[xx];
+        }
+      }
+  }
+  else {
+    // the row of every term along the rows of the region and of its apron, then its column
+    float *tmp = (float*)malloc( (size_t)xpxl*(ypxl+2*khalfsize)*sizeof(float) );
+    for (int r=0; r<rank; r++){
+      const float *col  = terms + (size_t)r*2*ksize;
+      const float *trow = col + ksize;
+      for (int y=-khalfsize; y<ypxl+khalfsize; y++){
+        float *t = tmp + (size_t)(y+khalfsize)*xpxl;
+        for (int xx=0; xx<xpxl; xx++)
+          t[xx] = 0;
+        for (int xks=-khalfsize; xks<=khalfsize; xks++){
+          float w = trow[khalfsize+xks];
+          unsigned short int *row = image + (long)y*istride + xks;
+          for (int xx=0; xx<xpxl; xx++)
+            t[xx] += w*row[xx];
+        }
+      }
+      for (int yy=0; yy<ypxl; yy++){
+        float *arow = acc + (size_t)yy*xpxl;
+        for (int i=0; i<ksize; i++){
+          float  w = col[i];
+          float *t = tmp + (size_t)(yy+i)*xpxl;
+          for (int xx=0; xx<xpxl; xx++)
+            arow[xx] += w*t[xx];
+        }
+      }
+    }
+    free(tmp);
+  }
+
+  for (int yy=0; yy<ypxl; yy++)
+    for (int xx=0; xx<xpxl; xx++){
+      float v = roundf( acc[(size_t)yy*xpxl+xx]/knorm );
+      out[(long)yy*ostride+xx] = (v < 0)? 0 : ((v > maxval)? maxval : v);
+    }
+  free(acc);
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               BLUR STAGES ON A TILE
+
+
+/*
+  A stage is one application of a kernel, either as a blur or as an unsharp mask 
+  (in + amount*(in - blurred in), clipped to [0, maxval]). Several stages can be applied 
+  to a tile of the image one after the other while the tile stays in cache: the tile is 
+  loaded together with an apron as deep as the sum of the half-sizes of all the stages, 
+  and each stage blurs the tile extended by what is left of the apron, which shrinks by 
+  the half-size of the stage. Only the last stage writes, the tile alone, to the output 
+  image.
+*/
+
+typedef struct {
+  int    ksize, khalfsize;
+  float *kernel;         // ksize*ksize values
+  float  knorm;
+  float  amount;         // unsharp masks only, 0 for a plain blur
+  int    maxval;         // unsharp masks only, results are clipped to [0, maxval]
+  int    median;         // median of ksize x ksize pixels instead of the kernel
+  int    morph;          // MORPH_* operator instead of the kernel, 0 for none
+  float *terms;          // custom kernels only (see custom_padded), NULL for the others
+  int    rank;           // number of separable terms, 0 to apply the custom kernel directly
+} stage;
+
+
+stage make_stage( int ktype, int ksize, float *kernel, float knorm, int maxval )
+/*
+ * stage applying the filter ktype (0-3, 5-8) of size ksize, with the kernel of build_kernel
+ */
+{
+  stage st = {ksize, (ksize-1)/2, kernel, knorm, 0, maxval, (ktype == 3), (ktype >= 5)? ktype-4 : 0, NULL, 0};
+  // opening and closing need the first operator on the apron of the second one
+  if (st.morph == MORPH_OPEN || st.morph == MORPH_CLOSE)
+    st.khalfsize *= 2;
+  return st;
+}
+
+
+void unsharp_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, stage *st )
+/*
+ * unsharp mask of a region, with the same conventions as blur_padded
+ */
+{
+  int khalfsize = st->khalfsize;
+  int ksize     = st->ksize;
+  for ( int yy = 0; yy < ypxl; yy++ ){
+    for( int xx = 0; xx < xpxl; xx++ ){
+      unsigned short int *center = image + yy*istride + xx;
+      double xxyy = 0;
+      for (int yks=-khalfsize; yks<khalfsize+1; yks++){
+        unsigned short int *row = center + yks*istride;
+        float *krow = st->kernel + (khalfsize+yks)*ksize + khalfsize;
+        for (int xks=-khalfsize; xks<khalfsize+1; xks++)
+          xxyy += krow[xks]*row[xks];
+      }
+      double sharp = *center + st->amount*(*center - xxyy/st->knorm);
+      out[yy*ostride+xx] = (sharp < 0)? 0 : ((sharp > st->maxval)? st->maxval : round(sharp));
+    }
+  }
+}
+
+
+void blur_stages( unsigned short int *image, int xsize, int ysize, int x0, int y0, int xpxl, int ypxl, int nstages, stage *stages, unsigned short int *buf0, unsigned short int *buf1, unsigned short int *out )
+/*
+ * image, out   : input and output images (xsize x ysize)
+ * x0, y0       : first pixel of the tile, of xpxl x ypxl pixels
+ * buf0, buf1   : work buffers of (xpxl+2*halo)*(ypxl+2*halo) pixels, halo being the 
+ *                sum of the half-sizes of the stages
+ */
+{
+  int halo = 0;
+  for (int s=0; s<nstages; s++)
+    halo += stages[s].khalfsize;
+  int xstride = xpxl + 2*halo;
+  size_t bufsize = (size_t)xstride*(ypxl+2*halo)*sizeof(short int);
+
+  // load the tile and its apron, zeros outside the image
+  memset(buf0, 0, bufsize);
+  memset(buf1, 0, bufsize);
+  int xfirst = (x0-halo < 0)? 0 : x0-halo;
+  int xlast  = (x0+xpxl+halo > xsize)? xsize : x0+xpxl+halo;
+  for (int y=y0-halo; y<y0+ypxl+halo; y++){
+    if (y < 0 || y >= ysize) continue;
+    memcpy( buf0 + (size_t)(y-y0+halo)*xstride + (xfirst-x0+halo), image + (long)y*xsize + xfirst, (xlast-xfirst)*sizeof(short int) );
+  }
+
+  int e = halo;
+  for (int s=0; s<nstages; s++){
+    stage *st = &stages[s];
+    e -= st->khalfsize;
+    // region still needed by the next stages, clipped to the image
+    int rx0 = (x0-e < 0)? -x0 : -e;
+    int ry0 = (y0-e < 0)? -y0 : -e;
+    int rx1 = (x0+xpxl+e > xsize)? xsize-x0 : xpxl+e;
+    int ry1 = (y0+ypxl+e > ysize)? ysize-y0 : ypxl+e;
+    unsigned short int *src = buf0 + (halo+ry0)*xstride + halo+rx0;
+    unsigned short int *dst = buf1 + (halo+ry0)*xstride + halo+rx0;
+    int dstride = xstride;
+    if (s == nstages-1){
+      // the last stage (e = 0) writes the tile alone into the output image
+      dst     = out + (long)y0*xsize + x0;
+      dstride = xsize;
+    }
+    if (st->median)
+      median_padded( src, xstride, dst, dstride, rx1-rx0, ry1-ry0, st->khalfsize );
+    else if (st->morph)
+      morph_padded( src, xstride, dst, dstride, rx1-rx0, ry1-ry0, x0+rx0, y0+ry0, xsize, ysize, st->khalfsize, st->morph );
+    else if (st->terms != NULL)
+      custom_padded( src, xstride, dst, dstride, rx1-rx0, ry1-ry0, st->ksize, st->kernel, st->knorm, st->maxval, st->rank, st->terms );
+    else if (st->amount != 0)
+      unsharp_padded( src, xstride, dst, dstride, rx1-rx0, ry1-ry0, st );
+    else
+      blur_padded( src, xstride, dst, dstride, rx1-rx0, ry1-ry0, st->ksize, (float (*)[st->ksize])st->kernel, st->knorm, st->khalfsize );
+    if (s < nstages-1){
+      unsigned short int *swap_ptr = buf0;
+      buf0 = buf1;
+      buf1 = swap_ptr;
+    }
+  }
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               DECOMPOSITION PLANNER
+
+
+/*
+  The image can be divided among the nths threads in three ways:
+
+    * grid   - nthsx x nthsy grid of sub-images, with nthsx*nthsy = nths
+    * strips - nths row strips, i.e. a 1 x nths grid
+    * uneven - nthsy rows of sub-images, each row holding either floor(nths/nthsy)
+               or ceil(nths/nthsy) of them. The height of every row is proportional
+               to the number of its sub-images, so that all of them have about the
+               same area: e.g. 7 threads become a row of 4 and a row of 3 sub-images,
+               instead of 7 thin strips.
+
+  Every candidate is scored with a cost model in units of kernel taps: every thread
+  costs xpxl*ypxl*ksize*ksize for the blurring plus HALO_COST for each pixel outside
+  its sub-image (but inside the image) that it has to read. The slowest thread sets
+  the elapsed time, so the cost of a plan is the maximum over the threads: in this
+  way compute, halo volume and load imbalance are all accounted for.
+*/
+
+#define PLAN_GRID   0
+#define PLAN_STRIPS 1
+#define PLAN_UNEVEN 2
+#define HALO_COST   1.0    // cost of reading a pixel of another sub-image, in kernel taps
+
+const char *plan_names[3] = {"grid", "strips", "uneven"};
+
+typedef struct {
+  int    kind;                // PLAN_GRID, PLAN_STRIPS or PLAN_UNEVEN
+  int    nthsx, nthsy;        // divisions along x and y (for uneven plans nthsx is the longest row)
+  double cost;                // max over the threads of compute + halo
+  double compute;             // mean compute per thread
+  double imbalance;           // cost - mean cost per thread
+  double halo;                // total number of halo pixels
+} plan;
+
+
+void plan_tiles( plan *pl, int nths, int xsize, int ysize, int *start_x, int *start_y, int *xpxl, int *ypxl, int *xxth, int *yyth )
+/*
+ * fills, for every thread, the starting point, the number of pixels and the position
+ * in the grid of its sub-image. Extra pixels are given to the first sub-images of each
+ * row (column), as in the even division.
+ */
+{
+  int nrows = pl->nthsy;
+  int thid  = 0;
+  int done  = 0;  // sub-images in the rows above the current one
+  for (int row=0; row<nrows; row++){
+    int ncols = pl->nthsx;
+    int y0, y1;
+    if (pl->kind == PLAN_UNEVEN){
+      ncols = nths/nrows + (row < nths%nrows);
+      y0 = (int)(((long)ysize*done)/nths);
+      y1 = (int)(((long)ysize*(done+ncols))/nths);
+    } else {
+      y0 = row*(ysize/nrows) + ((row <= ysize%nrows)? row : ysize%nrows);
+      y1 = y0 + ysize/nrows + (row < ysize%nrows);
+    }
+    for (int col=0; col<ncols; col++, thid++){
+      xpxl[thid]    = xsize/ncols + (col < xsize%ncols);
+      start_x[thid] = col*(xsize/ncols) + ((col <= xsize%ncols)? col : xsize%ncols);
+      ypxl[thid]    = y1 - y0;
+      start_y[thid] = y0;
+      xxth[thid]    = col;
+      yyth[thid]    = row;
+    }
+    done += ncols;
+  }
+}
+
+
+void plan_cost( plan *pl, int nths, int xsize, int ysize, int khalfsize )
+{
+  int ksize = 2*khalfsize+1;
+  int start_x[nths], start_y[nths], xpxl[nths], ypxl[nths], xxth[nths], yyth[nths];
+  plan_tiles( pl, nths, xsize, ysize, start_x, start_y, xpxl, ypxl, xxth, yyth );
+
+  double sum = 0;
+  pl->cost = pl->compute = pl->halo = 0;
+  for (int thid=0; thid<nths; thid++){
+    // the halo is not needed on the borders of the image
+    int left  = (start_x[thid] > 0)?                    khalfsize : 0;
+    int right = (start_x[thid]+xpxl[thid] < xsize)?     khalfsize : 0;
+    int up    = (start_y[thid] > 0)?                    khalfsize : 0;
+    int down  = (start_y[thid]+ypxl[thid] < ysize)?     khalfsize : 0;
+    double halo    = (double)(xpxl[thid]+left+right)*(ypxl[thid]+up+down) - (double)xpxl[thid]*ypxl[thid];
+    double compute = (double)xpxl[thid]*ypxl[thid]*ksize*ksize;
+    double cost    = compute + HALO_COST*halo;
+
+    if (cost > pl->cost) pl->cost = cost;
+    pl->compute += compute/nths;
+    pl->halo    += halo;
+    sum         += cost;
+  }
+  pl->imbalance = pl->cost - sum/nths;
+}
+
+
+plan plan_decomposition( int nths, int xsize, int ysize, int khalfsize, int kind, int nthsx, int nthsy )
+/*
+ * returns the cheapest plan. kind < 0 lets the planner choose among all kinds; a
+ * grid given by the user (nthsx*nthsy = nths) is used as it is.
+ */
+{
+  plan best, pl;
+  best.cost = -1;
+
+  if (nthsx > 0 && nthsy > 0){
+    best.kind  = (nthsx == 1 && nthsy > 1)? PLAN_STRIPS : PLAN_GRID;
+    best.nthsx = nthsx;
+    best.nthsy = nthsy;
+    plan_cost( &best, nths, xsize, ysize, khalfsize );
+    return best;
+  }
+
+  for (int ny=1; ny<=nths; ny++){
+    if (ny > ysize) break;
+    if (nths%ny == 0){
+      // regular grids, including the 1 x nths strips
+      pl.kind  = (ny == nths && nths > 1)? PLAN_STRIPS : PLAN_GRID;
+      pl.nthsy = ny;
+      pl.nthsx = nths/ny;
+      if (pl.nthsx > xsize || (kind >= 0 && kind != pl.kind)) continue;
+    } else {
+      pl.kind  = PLAN_UNEVEN;
+      pl.nthsy = ny;
+      pl.nthsx = nths/ny + 1;
+      if (pl.nthsx > xsize || (kind >= 0 && kind != pl.kind)) continue;
+    }
+    plan_cost( &pl, nths, xsize, ysize, khalfsize );
+    if (best.cost < 0 || pl.cost < best.cost) best = pl;
+  }
+
+  // e.g. strips requested but impossible: fall back to any plan
+  if (best.cost < 0 && kind >= 0)
+    return plan_decomposition( nths, xsize, ysize, khalfsize, -1, 0, 0 );
+  // more threads than pixels along both sides: a single row, whose last sub-images are empty
+  if (best.cost < 0){
+    best.kind  = PLAN_GRID;
+    best.nthsx = nths;
+    best.nthsy = 1;
+    plan_cost( &best, nths, xsize, ysize, khalfsize );
+  }
+  return best;
+}
+
+
+void print_plan( plan *pl, int nths )
+{
+  if (pl->kind == PLAN_UNEVEN)
+    printf("Decomposition: %s, %d rows of %d-%d sub-images", plan_names[pl->kind], pl->nthsy, nths/pl->nthsy, pl->nthsx);
+  else
+    printf("Decomposition: %s %dx%d", plan_names[pl->kind], pl->nthsx, pl->nthsy);
+  printf(" (cost %.4g taps: compute %.4g, imbalance %.4g, halo %.0f pixels)\n", pl->cost, pl->compute, pl->imbalance, pl->halo);
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               OPTIONS
+
+
+typedef struct {
+  char *trace_name;     // --trace file : timeline in Chrome trace-event format
+  int   plan_kind;      // --plan grid|strips|uneven : kind of decomposition (-1 = auto)
+  int   nthsx, nthsy;   // --grid NXxNY : decomposition given by the user
+  int   iterations;     // --iterations N : number of times the blur is applied
+  int   tblock;         // --tblock T : iterations applied to a tile while in cache (0 = automatic)
+  char *pipeline;       // --pipeline list : stages fused at tile level, see parse_pipeline
+  int   roi[4];         // --roi x,y,w,h : blur only this region of interest (w = 0: the whole image)
+  int   roi_full;       // --roi-full : write the whole image with the ROI blurred, instead of the ROI alone
+  int   stream;         // --stream : blur a sequence of frames, see blur_stream
+  int   in_place;       // --in-place : the blur overwrites the image, see blur_in_place
+  char *kernel_name;    // --kernel file : custom kernel, see read_kernel
+  double kernel_tol;    // --kernel-tol eps : relative error of its separable terms, see separate_kernel
+  char *scale_space;    // --scale-space list : sigmas of the levels of a gaussian scale space, see scale_space (for its error)
+  int   octaves;        // --octaves : with --scale-space, subsample the levels by 2 at every octave
+} options;
+
+
+int read_options( int argc, char **argv, options *opts )
+/*
+ * Optional "--name value" arguments can be placed anywhere on the command line.
+ * They are removed from argv, so that the positional parameters keep their meaning,
+ * and the new argc is returned.
+ */
+{
+  opts->trace_name = NULL;
+  opts->plan_kind  = -1;
+  opts->nthsx      = 0;
+  opts->nthsy      = 0;
+  opts->iterations = 1;
+  opts->tblock     = 0;
+  opts->pipeline   = NULL;
+  opts->roi[0] = opts->roi[1] = opts->roi[2] = opts->roi[3] = 0;
+  opts->roi_full   = 0;
+  opts->stream     = 0;
+  opts->in_place   = 0;
+  opts->kernel_name = NULL;
+  opts->kernel_tol  = KERNEL_TOL;
+  opts->scale_space = NULL;
+  opts->octaves     = 0;
+
+  int nargs = 1;
+  for (int i=1; i<argc; i++){
+    if ( strcmp(argv[i], "--trace")==0 && i+1<argc ){
+      opts->trace_name = argv[++i];
+    }
+    else if ( strcmp(argv[i], "--plan")==0 && i+1<argc ){
+      i++;
+      for (int k=0; k<3; k++)
+        if ( strcmp(argv[i], plan_names[k])==0 ) opts->plan_kind = k;
+      if ( opts->plan_kind < 0 && strcmp(argv[i], "auto")!=0 ){
+        printf("Invalid plan %s\n", argv[i]);
+        return -1;
+      }
+    }
+    else if ( strcmp(argv[i], "--iterations")==0 && i+1<argc ){
+      opts->iterations = atoi(argv[++i]);
+      if ( opts->iterations < 1 ){
+        printf("Invalid number of iterations\n");
+        return -1;
+      }
+    }
+    else if ( strcmp(argv[i], "--pipeline")==0 && i+1<argc ){
+      opts->pipeline = argv[++i];
+    }
+    else if ( strcmp(argv[i], "--tblock")==0 && i+1<argc ){
+      opts->tblock = atoi(argv[++i]);
+    }
+    else if ( strcmp(argv[i], "--roi")==0 && i+1<argc ){
+      int *r = opts->roi;
+      if ( sscanf(argv[++i], "%d,%d,%d,%d", &r[0], &r[1], &r[2], &r[3])!=4 || r[0]<0 || r[1]<0 || r[2]<1 || r[3]<1 ){
+        printf("Invalid ROI %s\n", argv[i]);
+        return -1;
+      }
+    }
+    else if ( strcmp(argv[i], "--roi-full")==0 ){
+      opts->roi_full = 1;
+    }
+    else if ( strcmp(argv[i], "--stream")==0 ){
+      opts->stream = 1;
+    }
+    else if ( strcmp(argv[i], "--in-place")==0 ){
+      opts->in_place = 1;
+    }
+    else if ( strcmp(argv[i], "--kernel")==0 && i+1<argc ){
+      opts->kernel_name = argv[++i];
+    }
+    else if ( strcmp(argv[i], "--kernel-tol")==0 && i+1<argc ){
+      opts->kernel_tol = atof(argv[++i]);
+      if ( opts->kernel_tol < 0 ){
+        printf("Invalid kernel tolerance %s\n", argv[i]);
+        return -1;
+      }
+    }
+    else if ( strcmp(argv[i], "--scale-space")==0 && i+1<argc ){
+      opts->scale_space = argv[++i];
+    }
+    else if ( strcmp(argv[i], "--octaves")==0 ){
+      opts->octaves = 1;
+    }
+    else if ( strcmp(argv[i], "--grid")==0 && i+1<argc ){
+      if ( sscanf(argv[++i], "%dx%d", &opts->nthsx, &opts->nthsy)!=2 || opts->nthsx<1 || opts->nthsy<1 ){
+        printf("Invalid grid %s\n", argv[i]);
+        return -1;
+      }
+    }
+    else if ( strncmp(argv[i], "--", 2)==0 ){
+      printf("Unknown option %s\n", argv[i]);
+      return -1;
+    }
+    else argv[nargs++] = argv[i];
+  }
+  argv[nargs] = NULL;
+  return nargs;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               TRACE
+
+
+/*
+  Timeline of the run in Chrome trace-event format, to be opened with chrome://tracing
+  or ui.perfetto.dev. Every thread records its events in its own block of trace_ev, so
+  recording needs no synchronisation; trace_write merges them with one track per thread.
+*/
+
+#define TRACE_MAXEV 64
+
+typedef struct {
+  char   name[32];
+  double begin, end;  // seconds, as given by omp_get_wtime
+} trace_event;
+
+int          trace_on  = 0;
+int          trace_nths;
+double       trace_t0;
+trace_event *trace_ev  = NULL;  // trace_nths blocks of TRACE_MAXEV events
+int         *trace_nev = NULL;  // number of events recorded by each thread
+
+
+void trace_start( int nths )
+{
+  trace_on   = 1;
+  trace_nths = nths;
+  trace_t0   = omp_get_wtime();
+  trace_ev   = (trace_event*)malloc( nths*TRACE_MAXEV*sizeof(trace_event) );
+  trace_nev  = (int*)calloc( nths, sizeof(int) );
+}
+
+
+void trace_record( int thid, const char *name, double begin, double end )
+{
+  if ( !trace_on || thid >= trace_nths || trace_nev[thid] == TRACE_MAXEV )
+    return;
+  trace_event *ev = &trace_ev[thid*TRACE_MAXEV + trace_nev[thid]++];
+  strncpy(ev->name, name, sizeof(ev->name)-1);
+  ev->name[sizeof(ev->name)-1] = '\0';
+  ev->begin = begin;
+  ev->end   = end;
+}
+
+
+void trace_write( const char *trace_name )
+/*
+ * one complete ("X") event per record, timestamps in microseconds from trace_start
+ */
+{
+  FILE *trace_file = fopen(trace_name, "w");
+  if ( trace_file == NULL ){
+    printf("cannot open trace file %s\n", trace_name);
+    return;
+  }
+
+  fprintf(trace_file, "{\"traceEvents\":[\n");
+  fprintf(trace_file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"blur.omp\"}}");
+  for (int thid=0; thid<trace_nths; thid++){
+    fprintf(trace_file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", thid, thid);
+    for (int e=0; e<trace_nev[thid]; e++){
+      trace_event *ev = &trace_ev[thid*TRACE_MAXEV + e];
+      fprintf(trace_file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+	      ev->name, thid, (ev->begin-trace_t0)*1e6, (ev->end-ev->begin)*1e6);
+    }
+  }
+  fprintf(trace_file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(trace_file);
+
+  free(trace_ev);
+  free(trace_nev);
+  trace_on = 0;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               PIPELINE OF FILTERS
+
+
+int parse_pipeline( const char *spec, int maxval, stage **stages )
+/*
+ * spec is a comma separated list of stages, applied in order, each given as
+ *
+ *   ktype:ksize[:kfactor]    blur with one of the kernels of build_kernel (kfactor for ktype 1),
+ *                            median filter (ktype 3) or morphological operator (ktypes 5 to 8)
+ *   u:ksize[:amount]         unsharp mask with a gaussian kernel (amount 1 by default)
+ *
+ * e.g. "2:5,u:7:1.5,0:3". Returns the number of stages, or -1 if spec is not valid.
+ */
+{
+  int nst = 1;
+  for (const char *c=spec; *c; c++)
+    if (*c == ',') nst++;
+  *stages = (stage*)malloc( nst*sizeof(stage) );
+
+  const char *item = spec;
+  for (int s=0; s<nst; s++){
+    stage *st = &(*stages)[s];
+    char  type[8];
+    float param = -1;
+    // type, ksize and the optional parameter, each of them a whole field
+    int   len = strcspn(item, ":,");
+    int   valid = ( len > 0 && len < (int)sizeof(type) && item[len] == ':' );
+    char *end = (char*)item + len;
+    if (valid){
+      memcpy(type, item, len);
+      type[len]  = '\0';
+      st->ksize  = strtol(item+len+1, &end, 10);
+      valid      = ( end != item+len+1 && st->ksize >= 1 && st->ksize%2 == 1 );
+    }
+    if (valid && *end == ':'){
+      const char *field = end+1;
+      param = strtof(field, &end);
+      valid = ( end != field && param >= 0 );
+    }
+    if (!valid || (*end != ',' && *end != '\0')){
+      printf("Invalid stage %d of the pipeline\n", s);
+      return -1;
+    }
+    float *kernel = (float*)malloc( st->ksize*st->ksize*sizeof(float) );
+
+    if (strcmp(type, "u") == 0 || strcmp(type, "unsharp") == 0){
+      *st = make_stage( 2, st->ksize, kernel, build_kernel( 2, st->ksize, 0, kernel ), maxval );
+      st->amount = (param >= 0)? param : 1;
+    }
+    else {
+      long  ktype = strtol(type, &end, 10);
+      if (end == type || *end != '\0' || ktype > 8 || ktype < 0 || ktype == 4 || (ktype == 1 && param > 1)){
+        printf("Invalid stage %d of the pipeline\n", s);
+        return -1;
+      }
+      *st = make_stage( ktype, st->ksize, kernel, build_kernel( ktype, st->ksize, (param >= 0)? param : 0.2, kernel ), maxval );
+    }
+
+    item = strchr(item, ',');
+    if (item) item++;
+  }
+  return nst;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               ITERATED BLUR WITH TEMPORAL BLOCKING
+
+
+/*
+  Applying the blur niter times would stream the whole image through the memory at every
+  iteration. Instead, every thread walks the sub-image assigned to it by the decomposition 
+  in square tiles sized to stay in cache (TB_CACHE bytes), and applies tblock iterations to
+  each tile before moving to the next one, as stages of blur_stages: the overlapped tiles 
+  recompute a little of their neighbours' work, but the image crosses the memory once every 
+  tblock iterations instead of at each of them. 
+  Threads only synchronise between blocks of iterations, when input and output swap.
+
+  An iteration can itself be a pipeline of several stages (see parse_pipeline), which are
+  then fused in the same way: each tile is read once, goes through all the stages, and is
+  written once, with no intermediate image.
+
+  When not given, tblock is the largest depth for which the redundant work on the overlap 
+  stays below TB_OVERHEAD, and the tiles are as large as the cache allows.
+*/
+
+#define TB_CACHE    (256*1024)   // bytes of cache available to each thread (L2)
+#define TB_OVERHEAD 0.25         // maximum fraction of redundant work chosen automatically
+#define TB_MAXDEPTH 16
+// smallest tile: when the apron alone exceeds the cache (the large median and morphological
+// filters), the tile grows with it so that the overlap costs at most 1.25 times the tile
+#define TB_MINTILE(halo) (((halo) > 4)? 4*(halo) : 16)
+
+
+void * blur_iterations( unsigned short int *image, int xsize, int ysize, int nch, int *start_x, int *start_y, int *xpxl, int *ypxl, int niter, int tblock, int nst, stage *st )
+/*
+ * applies niter times the nst stages of st to the nch planes of the image and returns 
+ * the result; start_y is the first row (not index) of each sub-image
+ */
+{
+  // halo of one iteration
+  int khalfsize = 0;
+  for (int s=0; s<nst; s++)
+    khalfsize += st[s].khalfsize;
+
+  // largest tile whose two work buffers fit in cache, given the depth
+  #define TB_TILE(depth) ((int)sqrt(TB_CACHE/(2.*sizeof(short int))) - 2*(depth)*khalfsize)
+
+  if (tblock <= 0){
+    tblock = 1;
+    for (int depth=2; depth<=TB_MAXDEPTH && depth<=niter; depth++){
+      int tile = TB_TILE(depth);
+      if (tile < 16) break;
+      // mean extension of the blurred region over the stages
+      double ext = (depth-1)*khalfsize;
+      if ( (tile+ext)*(tile+ext)/((double)tile*tile) - 1 > TB_OVERHEAD ) break;
+      tblock = depth;
+    }
+  }
+  if (tblock > niter) tblock = niter;
+  int tile = TB_TILE(tblock);
+  if (tile < TB_MINTILE(tblock*khalfsize)) tile = TB_MINTILE(tblock*khalfsize);
+  #undef TB_TILE
+  if (niter > 1)
+    printf("Iterations: %d, temporal blocking depth %d, tiles of %dx%d pixels\n", niter, tblock, tile, tile);
+
+  size_t plane = (size_t)xsize*ysize;
+  unsigned short int *out = (unsigned short int*)malloc( plane*nch*sizeof(short int) );
+  unsigned short int *result;
+  stage stages[tblock*nst];
+  for (int s=0; s<tblock*nst; s++)
+    stages[s] = st[s%nst];
+
+  #pragma omp parallel proc_bind(close)
+  {
+    int thid = omp_get_thread_num();
+    int halo = tblock*khalfsize;
+    size_t bufsize = (size_t)(tile+2*halo)*(tile+2*halo);
+    unsigned short int *buf0 = (unsigned short int*)malloc( bufsize*sizeof(short int) );
+    unsigned short int *buf1 = (unsigned short int*)malloc( bufsize*sizeof(short int) );
+    unsigned short int *myin = image, *myout = out;
+
+    for (int it=0; it<niter; it+=tblock){
+      int depth = (niter-it < tblock)? niter-it : tblock;
+      double tt = omp_get_wtime();
+      for (int ty=start_y[thid]; ty<start_y[thid]+ypxl[thid]; ty+=tile){
+        for (int tx=start_x[thid]; tx<start_x[thid]+xpxl[thid]; tx+=tile){
+          int txpxl = (tx+tile > start_x[thid]+xpxl[thid])? start_x[thid]+xpxl[thid]-tx : tile;
+          int typxl = (ty+tile > start_y[thid]+ypxl[thid])? start_y[thid]+ypxl[thid]-ty : tile;
+          for (int c=0; c<nch; c++)
+            blur_stages( myin + c*plane, xsize, ysize, tx, ty, txpxl, typxl, depth*nst, stages, buf0, buf1, myout + c*plane );
+        }
+      }
+      trace_record( thid, "blur", tt, omp_get_wtime() );
 
-  fprintf(image_file, "P5\n# generated by\n# M. Danese \n%d %d\n%d\n", xsize, ysize, maxval);
-  
-  // Writing file
-  fwrite( image, 1, xsize*ysize*color_depth, image_file);  
+      // all the tiles must be done before they are read again
+      #pragma omp barrier
+      unsigned short int *swap_ptr = myin;
+      myin  = myout;
+      myout = swap_ptr;
+    }
+    free(buf0);
+    free(buf1);
 
-  fclose(image_file); 
-  return ;
+    // the result is in myin after the last swap, the same for all the threads
+    #pragma omp single
+    result = myin;
+  }
 
-  /* ---------------------------------------------------------------
+  // the input image is released by the caller, so the result is always returned in out
+  if (result == image)
+    memcpy(out, image, plane*nch*sizeof(short int));
+  return (void*)out;
+}
 
-     TYPE    MAGIC NUM     EXTENSION   COLOR RANGE
-           ASCII  BINARY
 
-     PBM   P1     P4       .pbm        [0-1]
-     PGM   P2     P5       .pgm        [0-255]
-     PPM   P3     P6       .ppm        [0-2^16[
-  
-  ------------------------------------------------------------------ */
+void * bilateral_iterations( unsigned short int *image, int xsize, int ysize, int nch, int *start_x, int *start_y, int *xpxl, int *ypxl, int niter, float ss, float sr )
+/*
+ * applies niter times the bilateral filter to the nch planes of the image and returns the
+ * result: every thread filters its sub-image, reading the pixels of the image around it 
+ * (see bilateral_padded), and threads synchronise between iterations
+ */
+{
+  size_t plane = (size_t)xsize*ysize;
+  unsigned short int *out = (unsigned short int*)malloc( plane*nch*sizeof(short int) );
+  unsigned short int *result;
+
+  #pragma omp parallel proc_bind(close)
+  {
+    int thid = omp_get_thread_num();
+    size_t first = (size_t)start_y[thid]*xsize + start_x[thid];
+    unsigned short int *myin = image, *myout = out;
+
+    for (int it=0; it<niter; it++){
+      double tt = omp_get_wtime();
+      for (int c=0; c<nch; c++)
+        bilateral_padded( myin + c*plane + first, xsize, myout + c*plane + first, xsize, xpxl[thid], ypxl[thid], start_x[thid], start_y[thid], xsize, ysize, ss, sr );
+      trace_record( thid, "bilateral", tt, omp_get_wtime() );
+
+      // the whole image must be done before it is read again
+      #pragma omp barrier
+      unsigned short int *swap_ptr = myin;
+      myin  = myout;
+      myout = swap_ptr;
+    }
+
+    #pragma omp single
+    result = myin;
+  }
+
+  if (result == image)
+    memcpy(out, image, plane*nch*sizeof(short int));
+  return (void*)out;
 }
 
 
 // ============================================================================================================================================================
 
 
-//                               READ PGM
+//                               STREAM OF FRAMES
 
 
-void read_pgm_image( void **image, int *maxval, int *xsize, int *ysize, const char *image_name)
 /*
- * image        : a pointer to the pointer that will contain the image
- * maxval       : a pointer to the int that will store the maximum intensity in the image
- * xsize, ysize : pointers to the x and y sizes
- * image_name   : the name of the file to be read
- *
+  With --stream the input is a sequence of concatenated PGM/PPM frames of the same size, 
+  maxval and channels, e.g. coming from a camera through a pipe or a FIFO ("-" is the 
+  standard input), and the blurred frames are written one after the other to the output 
+  ("-" is the standard output). Threads, kernel, stages, decomposition and buffers are set
+  up once for the whole stream, with the first frame.
+  Frames go through a pipeline of three steps: while the nths workers blur frame n, one
+  more thread writes frame n-1 and reads frame n+1, converting them from and to the planar
+  layout, in double buffers. All the threads meet once per frame, when the buffers swap.
+  At the end the sustained rate and the percentiles of the latency of a frame, from the 
+  start of its reading to the end of its writing, are reported on stderr.
+*/
+
+int read_pgm_frame( FILE *image_file, unsigned char *raw, unsigned short int *planar, int maxval, int xsize, int ysize, int nch )
+/*
+ * reads the next frame into planar, through raw (the bytes of a frame). The frame must 
+ * have the given size, maxval and channels. Returns 0, or -1 at the end of the stream.
  */
 {
-  FILE* image_file; 
-  image_file = fopen(image_name, "r"); 
-
-  *image = NULL;
-  *xsize = *ysize = *maxval = 0;
-  
-  char    MagicN[2];
-  char   *line = NULL;
-  size_t  k, n = 0;
+  int fmaxval, fxsize, fysize, fnch;
+  parse_pgm_header( image_file, &fmaxval, &fxsize, &fysize, &fnch );
+  if ( fmaxval <= 0 )
+    return -1;
+  if ( fmaxval != maxval || fxsize != xsize || fysize != ysize || fnch != nch ){
+    fprintf(stderr, "Frame of %dx%d pixels (maxval %d, %d channels) unlike the first one: end of the stream\n", fxsize, fysize, fmaxval, fnch);
+    return -1;
+  }
+  size_t size = (size_t)xsize*ysize*nch*(1 + (maxval > 255));
+  if ( fread( raw, 1, size, image_file ) != size )
+    return -1;
+  deinterleave_image( raw, planar, xsize, ysize, maxval, nch );
+  return 0;
+}
 
-    
-  /* --------------------------------------------------------------- */
 
+int compare_doubles( const void *a, const void *b )
+{
+  double d = *(const double*)a - *(const double*)b;
+  return (d > 0) - (d < 0);
+}
 
-  // get the Magic Number - first element
-  k = fscanf(image_file, "%2s%*c", MagicN );
 
+int blur_stream( const char *input_name, const char *output_name, int nths, options *opts, int ktype, int ksize, float *kernel, float knorm )
+{
+  FILE *in_file  = (strcmp(input_name, "-") == 0)?  stdin  : fopen(input_name, "r");
+  FILE *out_file = (strcmp(output_name, "-") == 0)? stdout : fopen(output_name, "w");
+  if ( in_file == NULL || out_file == NULL ){
+    fprintf(stderr, "Cannot open %s\n", (in_file == NULL)? input_name : output_name);
+    return -1;
+  }
 
-    
-  /* --------------------------------------------------------------- */
+  // ---------------------------------------------
+  // the first frame fixes size, maxval and channels
+  double t0 = omp_get_wtime();
+  int maxval, xsize, ysize, nch;
+  parse_pgm_header( in_file, &maxval, &xsize, &ysize, &nch );
+  if ( maxval <= 0 ){
+    fprintf(stderr, "No frame in %s\n", input_name);
+    return -1;
+  }
 
+  // ---------------------------------------------
+  // stages of a frame: the kernel or the pipeline, times the iterations
+  stage  single = make_stage( ktype, ksize, kernel, knorm, maxval );
+  stage *st     = &single;
+  int    nst    = 1;
+  if ( opts->pipeline != NULL ){
+    nst = parse_pipeline( opts->pipeline, maxval, &st );
+    if ( nst < 0 ) 
+      return -1;
+  }
+  int nstages = nst*opts->iterations;
+  stage stages[nstages];
+  int halo = 0;
+  for (int s=0; s<nstages; s++){
+    stages[s] = st[s%nst];
+    halo     += stages[s].khalfsize;
+  }
 
-  // skip all the comments
-  k = getline( &line, &n, image_file);
-  while ( (k > 0) && (line[0]=='#') )
-    k = getline( &line, &n, image_file);
+  // ---------------------------------------------
+  // decomposition among the workers, walked in cache-sized tiles
+  plan pl = plan_decomposition( nths, xsize, ysize, halo, opts->plan_kind, opts->nthsx, opts->nthsy );
+  int xpxl[nths], ypxl[nths], xxth[nths], yyth[nths], start_x[nths], start_y[nths];
+  plan_tiles( &pl, nths, xsize, ysize, start_x, start_y, xpxl, ypxl, xxth, yyth );
+  int tile = (int)sqrt(TB_CACHE/(2.*sizeof(short int))) - 2*halo;
+  if (tile < TB_MINTILE(halo)) tile = TB_MINTILE(halo);
+  fprintf(stderr, "Stream of %dx%d frames, %d channels, maxval %d: %d workers (%s %dx%d), tiles of %dx%d pixels, 1 I/O thread\n", 
+	  xsize, ysize, nch, maxval, nths, plan_names[pl.kind], pl.nthsx, pl.nthsy, tile, tile);
+
+  // ---------------------------------------------
+  // double buffers of input and output, in the planar layout
+  size_t plane  = (size_t)xsize*ysize;
+  size_t fbytes = plane*nch*(1 + (maxval > 255));
+  unsigned char      *raw_in  = (unsigned char*)malloc( fbytes );
+  unsigned char      *raw_out = (unsigned char*)malloc( fbytes );
+  unsigned short int *in[2], *out[2];
+  for (int b=0; b<2; b++){
+    in[b]  = (unsigned short int*)malloc( plane*nch*sizeof(short int) );
+    out[b] = (unsigned short int*)malloc( plane*nch*sizeof(short int) );
+  }
 
-    
-  /* --------------------------------------------------------------- */
+  // start of the reading of every frame, latency of the frames written
+  int     maxframes = 1024, nframes = 0;
+  double *t_start   = (double*)malloc( maxframes*sizeof(double) );
+  double *latency   = (double*)malloc( maxframes*sizeof(double) );
+  t_start[0] = t0;
+
+  // got[b]: the frame in in[b] was read
+  int got[2] = {0, 0};
+  if ( fread( raw_in, 1, fbytes, in_file ) == fbytes ){
+    deinterleave_image( raw_in, in[0], xsize, ysize, maxval, nch );
+    got[0] = 1;
+  }
 
+  #pragma omp parallel num_threads(nths+1) proc_bind(close)
+  {
+    int thid = omp_get_thread_num();
+    unsigned short int *buf0 = NULL, *buf1 = NULL;
+    if ( thid < nths ){
+      buf0 = (unsigned short int*)malloc( (size_t)(tile+2*halo)*(tile+2*halo)*sizeof(short int) );
+      buf1 = (unsigned short int*)malloc( (size_t)(tile+2*halo)*(tile+2*halo)*sizeof(short int) );
+    }
+    int prev = 0;  // frame n-1 was blurred
+
+    for (int n=0; ; n++){
+      int cur = got[n%2];
+      if ( !cur && !prev )
+        break;
+      double tt = omp_get_wtime();
+
+      if ( thid == nths ){
+        // ---------------------------------------------
+        // I/O thread: write frame n-1, read frame n+1
+        if ( prev ){
+          interleave_image( out[(n-1)%2], raw_out, xsize, ysize, maxval, nch );
+          write_pgm_frame( out_file, raw_out, maxval, xsize, ysize, nch );
+          fflush( out_file );
+          latency[nframes] = omp_get_wtime() - t_start[nframes];
+          nframes++;
+        }
+        if ( cur ){
+          // frames are written after they are read: this is the largest index
+          if ( n+1 == maxframes ){
+            maxframes *= 2;
+            t_start = (double*)realloc( t_start, maxframes*sizeof(double) );
+            latency = (double*)realloc( latency, maxframes*sizeof(double) );
+          }
+          t_start[n+1]   = omp_get_wtime();
+          got[(n+1)%2]   = ( read_pgm_frame( in_file, raw_in, in[(n+1)%2], maxval, xsize, ysize, nch ) == 0 );
+        }
+        else
+          got[(n+1)%2] = 0;
+        trace_record( thid, "read/write", tt, omp_get_wtime() );
+      }
+      else if ( cur ){
+        // ---------------------------------------------
+        // workers: blur frame n
+        for (int ty=start_y[thid]; ty<start_y[thid]+ypxl[thid]; ty+=tile){
+          for (int tx=start_x[thid]; tx<start_x[thid]+xpxl[thid]; tx+=tile){
+            int txpxl = (tx+tile > start_x[thid]+xpxl[thid])? start_x[thid]+xpxl[thid]-tx : tile;
+            int typxl = (ty+tile > start_y[thid]+ypxl[thid])? start_y[thid]+ypxl[thid]-ty : tile;
+            for (int c=0; c<nch; c++)
+              blur_stages( in[n%2] + c*plane, xsize, ysize, tx, ty, txpxl, typxl, nstages, stages, buf0, buf1, out[n%2] + c*plane );
+          }
+        }
+        trace_record( thid, "blur", tt, omp_get_wtime() );
+      }
 
-  if (k > 0)
-    {
-      k = sscanf(line, "%d%*c%d%*c%d%*c", xsize, ysize, maxval);
-      if ( k < 3 )
-	if(fscanf(image_file, "%d%*c", maxval)!=1){
-	  printf("no maxval was provided\n");
-	  return;
-	}
+      // buffers swap
+      #pragma omp barrier
+      prev = cur;
     }
-  // in the case I am givning some bad input
+    free(buf0);
+    free(buf1);
+  }
+  double elapsed = omp_get_wtime() - t0;
+
+  // ---------------------------------------------
+  // report
+  if ( nframes > 0 ){
+    qsort( latency, nframes, sizeof(double), compare_doubles );
+    fprintf(stderr, "Frames: %d in %f s, %.1f frames/s\n", nframes, elapsed, nframes/elapsed);
+    fprintf(stderr, "Latency per frame (ms): p50 %.3f  p90 %.3f  p99 %.3f  max %.3f\n", 
+	    1e3*latency[(int)(0.50*(nframes-1))], 1e3*latency[(int)(0.90*(nframes-1))], 
+	    1e3*latency[(int)(0.99*(nframes-1))], 1e3*latency[nframes-1]);
+  }
   else
-    {
-      *maxval = -1;         // this is the signal that there was an I/O error
-			    // while reading the image header
-      free( line );
-      return;
-    }
-  free( line );
-  
+    fprintf(stderr, "No complete frame in %s\n", input_name);
+
+  if ( in_file != stdin )   fclose(in_file);
+  if ( out_file != stdout ) fclose(out_file);
+  if ( opts->pipeline != NULL ){
+    for (int s=0; s<nst; s++)
+      free(st[s].kernel);
+    free(st);
+  }
+  for (int b=0; b<2; b++){
+    free(in[b]);
+    free(out[b]);
+  }
+  free(raw_in);
+  free(raw_out);
+  free(t_start);
+  free(latency);
+  return 0;
+}
 
-    
-  /* --------------------------------------------------------------- */
 
 
-  int color_depth = 1 + ( *maxval > 255 );
-  unsigned int size = *xsize * *ysize * color_depth;
-  
-  if ( (*image = (char*)malloc( size )) == NULL )
-    {
-      fclose(image_file);
-      *maxval = -2;         // this is the signal that memory was insufficient
-      *xsize  = 0;
-      *ysize  = 0;
-      return;
-    }
-  
-  if ( fread( *image, 1, size, image_file) != size )
-    {
-      free( image );
-      image   = NULL;
-      *maxval = -3;         // this is the signal that there was an i/o error
-      *xsize  = 0;
-      *ysize  = 0;
-    }  
+// ============================================================================================================================================================
 
-  fclose(image_file);
-  return;
-}
 
+//                               IN-PLACE BLUR
 
-// ============================================================================================================================================================
 
+/*
+  The default path holds at the same time the planar image, the sub-images blurred by the
+  threads and the gathered final image, besides the bytes of the file: about 3 times the 
+  image. With --in-place the pixels of the file are converted to the planar image a band
+  of rows at a time, the blur overwrites the planar image itself, and the result is 
+  converted back a band at a time while writing, so that the image is held only once.
+
+  A thread can only overwrite its sub-image once its neighbours no longer need the pixels
+  there: every thread first saves the apron of its sub-image, the khalfsize rows above and
+  below and the khalfsize columns on either side, which belong to the neighbours, and all 
+  the threads meet at a barrier. Then each thread walks its sub-image row by row, keeping
+  in a ring the ksize source rows (extended by the apron) around the row it writes: the 
+  next source row is copied into the ring before the row khalfsize above it is 
+  overwritten. The ring holds every row twice, at slots r and r+ksize, so that the ksize 
+  rows around any output row are contiguous and blur_padded applies as it is.
+  The result is the same as that of the default path.
+*/
+
+#define INPLACE_ROWS 64     // rows of the file converted at a time
+
+
+int read_planar( FILE *image_file, const tiled_image *timg, unsigned short int *planar, int xsize, int ysize, int maxval, int nch )
+/*
+ * reads the pixels of the image straight into its nch planes, from a tiled image (timg 
+ * not NULL) or from the current position of the file, through a band of rows in the 
+ * byte layout of the file. Returns 0, or -1 on I/O errors.
+ */
+{
+  size_t plane = (size_t)xsize*ysize;
+  int    pixel_bytes = (1 + (maxval > 255))*nch;
+  int    band = (timg != NULL)? timg->tile_h : INPLACE_ROWS;
+  unsigned char *raw = (unsigned char*)malloc( (size_t)xsize*band*pixel_bytes );
+  int    err = 0;
+  for (int y0=0; y0<ysize && err == 0; y0+=band){
+    int    rows  = (ysize-y0 < band)? ysize-y0 : band;
+    size_t n     = (size_t)xsize*rows;
+    size_t first = (size_t)y0*xsize;
+    if ( timg != NULL )
+      err = tiled_read_region( timg, 0, y0, xsize, rows, raw, xsize );
+    else if ( fread( raw, pixel_bytes, n, image_file ) != n )
+      err = -1;
+    if ( maxval > 255 )
+      for ( size_t i = 0; i < n; i++ )
+        for ( int c = 0; c < nch; c++ )
+          planar[c*plane+first+i] = (raw[2*(i*nch+c)] << 8) | raw[2*(i*nch+c)+1];
+    else
+      for ( size_t i = 0; i < n; i++ )
+        for ( int c = 0; c < nch; c++ )
+          planar[c*plane+first+i] = raw[i*nch+c];
+  }
+  free(raw);
+  return err;
+}
 
-//                               SWAP PGM
 
+void write_planar( const unsigned short int *planar, int maxval, int xsize, int ysize, int nch, const char *image_name )
+/*
+ * writes the image of nch planes as write_pgm_image, through a band of rows
+ */
+{
+  FILE *image_file = fopen(image_name, "w");
+  size_t plane = (size_t)xsize*ysize;
+  int    pixel_bytes = (1 + (maxval > 255))*nch;
+  unsigned char *raw = (unsigned char*)malloc( (size_t)xsize*INPLACE_ROWS*pixel_bytes );
+  fprintf(image_file, "P%d\n# generated by\n# M. Danese \n%d %d\n%d\n", (nch==3)? 6 : 5, xsize, ysize, maxval);
+  for (int y0=0; y0<ysize; y0+=INPLACE_ROWS){
+    int    rows  = (ysize-y0 < INPLACE_ROWS)? ysize-y0 : INPLACE_ROWS;
+    size_t n     = (size_t)xsize*rows;
+    size_t first = (size_t)y0*xsize;
+    if ( maxval > 255 )
+      for ( size_t i = 0; i < n; i++ )
+        for ( int c = 0; c < nch; c++ ){
+          raw[2*(i*nch+c)]   = planar[c*plane+first+i] >> 8;
+          raw[2*(i*nch+c)+1] = planar[c*plane+first+i] & 0xff;
+        }
+    else
+      for ( size_t i = 0; i < n; i++ )
+        for ( int c = 0; c < nch; c++ )
+          raw[i*nch+c] = planar[c*plane+first+i];
+    fwrite( raw, pixel_bytes, n, image_file );
+  }
+  fclose(image_file);
+  free(raw);
+}
 
 
-void swap_image( void *image, int xsize, int ysize, int maxval )
+size_t blur_in_place( unsigned short int *image, int xsize, int ysize, int nch, int *start_x, int *start_y, int *xpxl, int *ypxl, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize )
 /*
- * This routine swaps the endianism of the memory area pointed
- * to by ptr, by blocks of 2 bytes
- *
+ * blurs the nch planes of image into themselves, every thread its sub-image. Returns the
+ * bytes of the buffers of all the threads (aprons and rings).
  */
 {
-  if ( maxval > 255 )
-    {
-      // pgm files has the short int written in
-      // big endian;
-      // here we swap the content of the image from
-      // one to another
-      //
-      unsigned int size = xsize * ysize;
-      for ( int i = 0; i < size; i++ )
-  	((unsigned short int*)image)[i] = swap(((unsigned short int*)image)[i]);
+  size_t plane = (size_t)xsize*ysize;
+  size_t total = 0;
+  #pragma omp parallel proc_bind(close) reduction(+:total)
+  {
+    int thid = omp_get_thread_num();
+    double tt = omp_get_wtime();
+    int x0 = start_x[thid], y0 = start_y[thid];
+    int w  = xpxl[thid],    h  = ypxl[thid];
+    int kh = khalfsize;
+    int stride = w + 2*kh;
+
+    // ---------------------------------------------
+    // apron of every plane: kh rows above and below (corners included) and kh columns 
+    // on either side of every row, zero outside the image
+    size_t apron = 2*(size_t)kh*stride + 2*(size_t)h*kh;
+    unsigned short int *saved = (unsigned short int*)calloc( apron*nch, sizeof(short int) );
+    unsigned short int *ring  = (unsigned short int*)calloc( 2*(size_t)ksize*stride, sizeof(short int) );
+    total = (apron*nch + 2*(size_t)ksize*stride)*sizeof(short int);
+    for (int c=0; c<nch; c++){
+      unsigned short int *src    = image + c*plane;
+      unsigned short int *top    = saved + c*apron;
+      unsigned short int *bottom = top    + (size_t)kh*stride;
+      unsigned short int *left   = bottom + (size_t)kh*stride;
+      unsigned short int *right  = left   + (size_t)h*kh;
+      for (int r=0; r<kh; r++)
+        for (int x=-kh; x<w+kh; x++){
+          if (x0+x < 0 || x0+x >= xsize) continue;
+          if (y0-kh+r >= 0)    top[(size_t)r*stride+kh+x]    = src[(size_t)(y0-kh+r)*xsize+x0+x];
+          if (y0+h+r < ysize)  bottom[(size_t)r*stride+kh+x] = src[(size_t)(y0+h+r)*xsize+x0+x];
+        }
+      for (int r=0; r<h; r++)
+        for (int x=0; x<kh; x++){
+          if (x0-kh+x >= 0)    left[(size_t)r*kh+x]  = src[(size_t)(y0+r)*xsize+x0-kh+x];
+          if (x0+w+x < xsize)  right[(size_t)r*kh+x] = src[(size_t)(y0+r)*xsize+x0+w+x];
+        }
     }
-  return;
+    // nobody overwrites its sub-image before all the aprons are saved
+    #pragma omp barrier
+
+    // ---------------------------------------------
+    // walk the sub-image: source row r (from -kh to h+kh-1) goes to slots (r+kh)%ksize 
+    // and (r+kh)%ksize+ksize, output row y reads the slots from y%ksize on
+    for (int c=0; c<nch; c++){
+      unsigned short int *dst    = image + c*plane;
+      unsigned short int *top    = saved + c*apron;
+      unsigned short int *bottom = top    + (size_t)kh*stride;
+      unsigned short int *left   = bottom + (size_t)kh*stride;
+      unsigned short int *right  = left   + (size_t)h*kh;
+      for (int r=-kh; r<h+kh; r++){
+        unsigned short int *slot = ring + (size_t)((r+kh)%ksize)*stride;
+        if (r < 0)
+          memcpy( slot, top + (size_t)(r+kh)*stride, stride*sizeof(short int) );
+        else if (r >= h)
+          memcpy( slot, bottom + (size_t)(r-h)*stride, stride*sizeof(short int) );
+        else {
+          memcpy( slot,        left + (size_t)r*kh,                 kh*sizeof(short int) );
+          memcpy( slot + kh,   dst + (size_t)(y0+r)*xsize + x0,      w*sizeof(short int) );
+          memcpy( slot + kh+w, right + (size_t)r*kh,                kh*sizeof(short int) );
+        }
+        memcpy( slot + (size_t)ksize*stride, slot, stride*sizeof(short int) );
+
+        // all the source rows of output row y = r-kh are in the ring
+        int y = r - kh;
+        if (y >= 0)
+          blur_padded( ring + (size_t)(y%ksize + kh)*stride + kh, stride, dst + (size_t)(y0+y)*xsize + x0, xsize, w, 1, ksize, kernel, knorm, kh );
+      }
+    }
+    free(saved);
+    free(ring);
+    trace_record( thid, "blur in place", tt, omp_get_wtime() );
+  }
+  return total;
 }
 
 
@@ -215,43 +2243,165 @@ void swap_image( void *image, int xsize, int ysize, int maxval )
 // ============================================================================================================================================================
 
 
-//                               BLUR PGM
+//                               SCALE SPACE
 
 
-void * blur( void *image, int xsize, int ysize, int start_idx, int start_x, int start_y, int xxth, int yyth, int xpxl, int ypxl, int maxval, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize)
 /*
-  This routine takes as input the image to blur, its x and y size, its maxval (as above), 
-  the kernel size (ksize), the kernel matrix valuse and its normalisation  
+  --scale-space s0,s1,...,sn blurs the image with gaussians of increasing sigmas (in pixels
+  of the image) and writes every level, as the output file with _0, _1, ... before its 
+  extension. Instead of independent blurs, each with a kernel of 3 sigmas and a new read of
+  the image, the levels are computed in a cascade from the image read once: two gaussian 
+  blurs make one of sigma sqrt(sigma_a^2 + sigma_b^2), so level n is level n-1 blurred by 
+  sigma_delta = sqrt(s_n^2 - s_(n-1)^2), a much smaller kernel. The kernel of build_gaussian
+  for sigma_delta, SCALE_RADIUS sigmas wide, is applied as its single separable term (see 
+  separate_kernel and custom_padded), through blur_iterations.
+
+  With --octaves, as in the pyramids of SIFT, a level that reaches twice the first sigma of
+  its octave is subsampled by 2 (every other pixel) once written, and starts the next 
+  octave: the levels after it are computed on an image 4 times smaller, with kernels half
+  as wide, and written at that size.
+
+  The pixels outside the image are zeros for the direct blur of every sigma, but for the
+  cascade they are the blurred previous level, which spreads beyond the image: were every
+  level cut to the image, the border would lose more at each level (up to a tenth of maxval
+  within the radius of the last sigma). The cascade therefore runs on the image surrounded 
+  by a margin of zeros as wide as the sum of the radii of its kernels, which nothing within
+  the image can reach, and the levels are cut out of it when written. What is left is the 
+  rounding of every level and the kernels being cut at SCALE_RADIUS sigmas: within 1 of the
+  direct blurs (subsampled as the octaves) for 8-bit images, 7e-4 of maxval for 16-bit ones.
+*/
+
+#define SCALE_RADIUS 3   // radius of the kernels, in sigmas
+
+
+int scale_space( unsigned short int *image, int xsize, int ysize, int nch, int maxval, int nths, options *opts, const char *output_name )
+/*
+ * computes and writes the levels of the scale space of the nch planes of the image, and 
+ * returns their number, or -1 if the list of sigmas is not valid
  */
 {
-  short int *sImage;   
-  void      *tempptr;
- 
-  start_y /= xsize; // instead of repeating this division at every loop
+  // ---------------------------------------------
+  // sigmas of the levels, in pixels of the image
+  int nlev = 1;
+  for (const char *c=opts->scale_space; *c; c++)
+    nlev += (*c == ',');
+  float sigma[nlev];
+  const char *item = opts->scale_space;
+  for (int l=0; l<nlev; l++){
+    if ( sscanf(item, "%f", &sigma[l]) != 1 || sigma[l] <= 0 || (l > 0 && sigma[l] <= sigma[l-1]) ){
+      printf("Invalid scale space %s: the sigmas must be positive and increasing\n", opts->scale_space);
+      return -1;
+    }
+    item = strchr(item, ',');
+    if (item) item++;
+  }
 
-      sImage = (unsigned short int*)malloc( xpxl*ypxl*sizeof(short int) );
-      unsigned short int _maxval = swap((unsigned short int)maxval);
-      for ( int yy = 0; yy < ypxl; yy++ ){
-        for( int xx = 0; xx < xpxl; xx++ ){
-        int idx = start_idx + yy*xsize + xx; 
-	  //to store partial results
-	  double xxyy = 0;
-	  //loop over the kernel
-	  for (int yks=-khalfsize; yks<khalfsize+1; yks++){
-	    for (int xks=-khalfsize; xks<khalfsize+1; xks++){
-	      if (start_x + xx + xks < xsize && start_y + yy + yks < ysize  && start_x+xx+xks >= 0 && start_y+yy+yks >=0){
-	        int sidx = idx + yks*xsize + xks; 
-	        xxyy += kernel[khalfsize+yks][khalfsize+xks]*((unsigned short int*)image)[sidx];
-	        }
-              }
-	    }
-	    sImage[yy*xpxl+xx] = round(xxyy/knorm);
-	    idx++;
-          }
-	}
-      tempptr = (void*)sImage;	
+  // names of the levels: _level before the extension of output_name
+  const char *ext = strrchr(output_name, '.');
+  int    stem = (ext != NULL && strchr(ext, '/') == NULL)? ext-output_name : (int)strlen(output_name);
+  char   level_name[strlen(output_name)+16];
 
-  return tempptr;
+  // ---------------------------------------------
+  // the margin: the sum of the radii of the kernels, in pixels of the image, rounded up so
+  // that it is still a whole, even number of pixels at every octave
+  int margin = 0;
+  {
+    float scale = 1, base = sigma[0], prev = 0;
+    for (int l=0; l<nlev; l++){
+      float s = sigma[l]/scale;
+      margin += (int)ceilf(SCALE_RADIUS*sqrtf(s*s - prev*prev))*(int)scale;
+      prev    = s;
+      if ( opts->octaves && l < nlev-1 && sigma[l] >= 2*base ){
+        scale *= 2;
+        prev   = sigma[l]/scale;
+        base   = sigma[l];
+      }
+    }
+    margin = (margin + (int)scale-1)/(int)scale*(int)scale;
+  }
+
+  int    image_xsize = xsize, image_ysize = ysize;
+  int    pad = margin;         // margin of the level, in its own pixels
+  xsize += 2*margin;
+  ysize += 2*margin;
+  size_t plane = (size_t)xsize*ysize, iplane = (size_t)image_xsize*image_ysize;
+  unsigned short int *level = (unsigned short int*)calloc( plane*nch, sizeof(short int) );
+  for (int c=0; c<nch; c++)
+    for (int y=0; y<image_ysize; y++)
+      memcpy( level + c*plane + (size_t)(y+pad)*xsize + pad, image + c*iplane + (size_t)y*image_xsize, image_xsize*sizeof(short int) );
+  unsigned short int *cut = (unsigned short int*)malloc( iplane*nch*sizeof(short int) );
+
+  int    wxsize = image_xsize, wysize = image_ysize;   // size of the written levels
+  float  scale = 1;          // pixels of the image per pixel of the level
+  float  base  = sigma[0];   // first sigma of the octave, in pixels of the image
+  float  prev  = 0;          // sigma of the level, in its own pixels
+  double taps  = 0, direct = 0;
+  for (int l=0; l<nlev; l++){
+    // ---------------------------------------------
+    // the previous level blurred by the difference of the sigmas
+    float  s     = sigma[l]/scale;
+    float  delta = sqrtf(s*s - prev*prev);
+    int    ksize = 2*(int)ceilf(SCALE_RADIUS*delta) + 1;
+    float *kernel = (float*)malloc( ksize*ksize*sizeof(float) );
+    float *terms  = (float*)malloc( 2*ksize*ksize*sizeof(float) );
+    double error;
+    stage  st = make_stage( 2, ksize, kernel, build_gaussian( ksize, delta, kernel ), maxval );
+    st.terms  = terms;
+    st.rank   = separate_kernel( ksize, kernel, KERNEL_TOL, terms, &error );
+
+    plan pl = plan_decomposition( nths, xsize, ysize, st.khalfsize, opts->plan_kind, opts->nthsx, opts->nthsy );
+    int  xpxl[nths], ypxl[nths], xxth[nths], yyth[nths], start_x[nths], start_y[nths];
+    plan_tiles( &pl, nths, xsize, ysize, start_x, start_y, xpxl, ypxl, xxth, yyth );
+    unsigned short int *next = blur_iterations( level, xsize, ysize, nch, start_x, start_y, xpxl, ypxl, 1, 1, 1, &st );
+    free(level);
+    level = next;
+    prev  = s;
+    free(kernel);
+    free(terms);
+
+    // taps per channel, and those of a blur of the image with the whole sigma
+    int dsize = 2*(int)ceilf(SCALE_RADIUS*sigma[l]) + 1;
+    taps   += (double)xsize*ysize*2*st.rank*ksize;
+    direct += (double)image_xsize*image_ysize*dsize*dsize;
+
+    double tt = omp_get_wtime();
+    size_t wplane = (size_t)wxsize*wysize;
+    plane = (size_t)xsize*ysize;
+    for (int c=0; c<nch; c++)
+      for (int y=0; y<wysize; y++)
+        memcpy( cut + c*wplane + (size_t)y*wxsize, level + c*plane + (size_t)(y+pad)*xsize + pad, wxsize*sizeof(short int) );
+    snprintf( level_name, sizeof(level_name), "%.*s_%d%s", stem, output_name, l, output_name+stem );
+    write_planar( cut, maxval, wxsize, wysize, nch, level_name );
+    trace_record( 0, "write level", tt, omp_get_wtime() );
+    printf("Level %d: sigma %.2f, %dx%d pixels, blurred by sigma %.2f (ksize %d, rank %d)\n", l, sigma[l], wxsize, wysize, delta, ksize, st.rank);
+
+    // ---------------------------------------------
+    // a new octave: the level subsampled by 2, the margin being even
+    if ( opts->octaves && l < nlev-1 && sigma[l] >= 2*base ){
+      int hxsize = (xsize+1)/2, hysize = (ysize+1)/2;
+      size_t hplane = (size_t)hxsize*hysize;
+      unsigned short int *half = (unsigned short int*)malloc( hplane*nch*sizeof(short int) );
+      for (int c=0; c<nch; c++)
+        for (int y=0; y<hysize; y++)
+          for (int x=0; x<hxsize; x++)
+            half[c*hplane + (size_t)y*hxsize + x] = level[c*plane + (size_t)2*y*xsize + 2*x];
+      free(level);
+      level  = half;
+      xsize  = hxsize;
+      ysize  = hysize;
+      wxsize = (wxsize+1)/2;
+      wysize = (wysize+1)/2;
+      pad   /= 2;
+      scale *= 2;
+      prev   = sigma[l]/scale;
+      base   = sigma[l];
+    }
+  }
+  free(level);
+  free(cut);
+
+  printf("Scale space: %d levels, %.3g taps per channel instead of %.3g for independent blurs (%.1fx)\n", nlev, taps, direct, direct/taps);
+  return nlev;
 }
 
 
@@ -277,7 +2427,8 @@ int main( int argc, char **argv )
     char *input_image_name;
     char *output_image_name;
     double startt, stopt;
-    int nths=NTHS, nthsx, nthsy;
+    int nths=NTHS;
+    int nch;
   
     
     xsize  = 0;
@@ -285,6 +2436,13 @@ int main( int argc, char **argv )
     maxval = 0;
     ksize  = 25;
     void *ptr; 
+    double tt;
+
+    // read optional parameters first: they are removed from argv
+    options opts;
+    argc = read_options( argc, argv, &opts );
+    if ( argc < 0 )
+      return 0;
 
     // read input parameters
     int arg_num=1;
@@ -295,14 +2453,14 @@ int main( int argc, char **argv )
     if ( argc > arg_num ) {
      ktype   = atoi( argv[arg_num] );
      arg_num++;
-     if (ktype>2 || ktype <0){
+     if (ktype>8 || ktype <0){
        printf("Invalid ktype\n");
        return 0;
        }
     if ( argc > arg_num ) {
      ksize   = atoi( argv[arg_num] );
      arg_num++;
-    if (ktype==1) {if ( argc > arg_num) {
+    if (ktype==1 || ktype==4) {if ( argc > arg_num) {
                      kfactor = atof( argv[arg_num]);
                      arg_num++;
                      if (kfactor>1 || kfactor<0){
@@ -322,18 +2480,31 @@ int main( int argc, char **argv )
      } } } } }
     
     //if no output image name is provided
-    if(arg_num<(6+ktype%2)) {
+    if(arg_num<(6+(ktype==1 || ktype==4))) {
      output_image_name  = malloc(15);
      strcpy(output_image_name, "omp_output.pgm");
     }
-    if(arg_num<(5+ktype%2)) {
+    if(arg_num<(5+(ktype==1 || ktype==4))) {
      input_image_name   = malloc(16);
      strcpy(input_image_name, "../check_me.pgm");
     }
 
 
 
+    // a custom kernel takes the place of kernel-type and kernel-size
+    float *custom = NULL;
+    if ( opts.kernel_name != NULL ){
+      custom = read_kernel( opts.kernel_name, &ksize );
+      if ( custom == NULL ){
+        printf("Invalid kernel file %s\n", opts.kernel_name);
+        return 0;
+      }
+      ktype = 0;
+    }
+
     startt = omp_get_wtime();
+    if ( opts.trace_name != NULL )
+      trace_start( nths + opts.stream );
    /*  ------------------------------------------------------- 
   
            KERNEL SET UP   
@@ -346,41 +2517,64 @@ int main( int argc, char **argv )
     int kfactor_int = round(100*kfactor);
 
 
-    // ---------------------------------------------
-    // average kernel
-    if (ktype==0) {
-      for (int i=0; i<ksize;i++){
-        for (int j=0; j<ksize;j++){
-          kernel[i][j]=1;
-	  knorm += kernel[i][j];
-        }
+    knorm = build_kernel( ktype, ksize, kfactor, &kernel[0][0] );
+
+    // custom kernel: its separable terms, if cheaper than the kernel (see separate_kernel)
+    float *terms = NULL;
+    int    rank  = 0;
+    if ( custom != NULL ){
+      knorm = 0;
+      for (int i=0; i<ksize*ksize; i++){
+        kernel[i/ksize][i%ksize] = custom[i];
+        knorm += custom[i];
       }
-    }
-    else if (ktype==1) {
-    // ---------------------------------------------
-    // weight kernel
-      for (int i=0; i<ksize;i++){
-        for (int j=0; j<ksize;j++){
-          kernel[i][j]=1-kfactor;
-        }
+      if ( knorm == 0 )
+        knorm = 1;
+      free(custom);
+      double error;
+      terms = (float*)malloc( 2*ksize*ksize*sizeof(float) );
+      rank  = separate_kernel( ksize, &kernel[0][0], opts.kernel_tol, terms, &error );
+      if ( 2*rank < ksize )
+        printf("Kernel %s: %dx%d of rank %d within %.1e (error %.1e), %d taps per pixel instead of %d: expected speedup %.1fx\n", 
+               opts.kernel_name, ksize, ksize, rank, opts.kernel_tol, error, 2*rank*ksize, ksize*ksize, ksize/(2.*rank));
+      else {
+        printf("Kernel %s: %dx%d of rank %d within %.1e, applied directly (%d taps per pixel)\n", 
+               opts.kernel_name, ksize, ksize, rank, opts.kernel_tol, ksize*ksize);
+        rank = 0;
       }
-      knorm = (ksize*ksize-1);
-      kernel[khalfsize][khalfsize]=kfactor*(ksize*ksize-1);
     }
-    else if (ktype==2) {
-    
-    // ---------------------------------------------
-    // gaussian kernel
-      float kden  = 1./(2.*khalfsize*khalfsize);
-      knorm = 0;
-      for (int i=0; i<ksize;i++){
-	float ky=i-khalfsize;
-        for (int j=0; j<ksize;j++){
-	  float kx=j-khalfsize;
-          kernel[i][j]=expf( -((kx*kx)+(ky*ky))*kden );
-	  knorm += kernel[i][j];
-	}
-      }
+
+    if ( opts.in_place && (opts.stream || opts.iterations > 1 || opts.pipeline != NULL || opts.roi[2] > 0) ){
+      printf("--in-place is available for a single blur of a whole image only\n");
+      return 0;
+    }
+    if ( opts.in_place && (ktype == 3 || ktype >= 5) ){
+      printf("--in-place is not available for the median and morphological filters\n");
+      return 0;
+    }
+    if ( opts.scale_space != NULL && (opts.stream || opts.pipeline != NULL || opts.in_place || opts.roi[2] > 0 || opts.iterations > 1 || terms != NULL) ){
+      printf("--stream, --pipeline, --in-place, --roi, --iterations and --kernel are not available with --scale-space\n");
+      return 0;
+    }
+    if ( terms != NULL && (opts.stream || opts.pipeline != NULL || opts.in_place) ){
+      printf("--stream, --pipeline and --in-place are not available with --kernel\n");
+      return 0;
+    }
+    if ( ktype == 4 && (ksize < 3 || kfactor <= 0) ){
+      printf("The bilateral filter needs ksize >= 3 and a range sigma > 0\n");
+      return 0;
+    }
+    if ( ktype == 4 && (opts.stream || opts.pipeline != NULL || opts.roi[2] > 0 || opts.in_place) ){
+      printf("--stream, --pipeline, --roi and --in-place are not available for the bilateral filter\n");
+      return 0;
+    }
+
+    // a sequence of frames instead of an image
+    if ( opts.stream ){
+      blur_stream( input_image_name, output_image_name, nths, &opts, ktype, ksize, &kernel[0][0], knorm );
+      if ( opts.trace_name != NULL )
+        trace_write( opts.trace_name );
+      return 0;
     }
 
 
@@ -391,16 +2585,17 @@ int main( int argc, char **argv )
   
        -------------------------------------------------------
 
-       The original image is divided into a grid of subimages.
+       The original image is divided into a grid of subimages,
+       chosen by the decomposition planner (see plan_decomposition).
 
          * nths        - total number of threads = number of 
 	                 subimages to be considered
 	 * nthsx       - number of division along the x axis
 	 * nthsy       - number of division along the y axis
-	 * xpxl[nthsx] - number of pixel in the x axis that 
-	                 each column of subimages should have
-	 * ypxl[nthsy] - number of pixel in the y axis that 
-	                 each row of subimages should have
+	 * xpxl[thid]  - number of pixel in the x axis of the 
+	                 subimage of each thread
+	 * ypxl[thid]  - number of pixel in the y axis of the 
+	                 subimage of each thread
          * thid        - number of the current thread
          * xxth        - x coordinate of the sub image (see below)
          * yyth        - y coordinate of the sub image (see below)
@@ -417,10 +2612,10 @@ int main( int argc, char **argv )
               |      3 '      4 '      5 |               subimage:
               |--------'--------'--------|            ---------------  ^
               |  (2,0) '  (2,1) '  (2,2) |           '  (yyth,xxth) '  |
-	      | _____6_'______7_'______8_|           '         thid '  |  ypxl[yyth]
+	      | _____6_'______7_'______8_|           '         thid '  |  ypxl[thid]
                                                      '--------------'  ˅
 
-						        xpxl[xxth] 
+						        xpxl[thid] 
 						      <------------->
 						        
 
@@ -428,47 +2623,182 @@ int main( int argc, char **argv )
   
     
     // ---------------------------------------------
-    //split image in sub images: one for every thread
+    // read image: the decomposition depends on its size
+    // of a tiled image only the header is read here, every thread reads its own tiles below;
+    // with a ROI also a PGM file is read later, unless the whole image has to be written
+    tt = omp_get_wtime();
+    int roi = ( opts.roi[2] > 0 );
+    FILE *image_file = NULL;
+    tiled_image timg;
+    int tiled = tiled_is_tiled( input_image_name );
+    if ( tiled ){
+      maxval = -1;
+      if ( tiled_open( &timg, input_image_name ) == 0 ){
+        xsize  = timg.xsize;
+        ysize  = timg.ysize;
+        maxval = timg.maxval;
+        nch    = timg.nch;
+      }
+    }
+    else if ( (roi && !opts.roi_full) || opts.in_place )
+      read_pgm_header( &maxval, &xsize, &ysize, &nch, input_image_name, &image_file );
+    else
+      read_pgm_image( &ptr, &maxval, &xsize, &ysize, &nch, input_image_name);
+    trace_record( 0, "read", tt, omp_get_wtime() );
+    if ( maxval <= 0 ){
+      printf("Could not read %s\n", input_image_name);
+      return 0;
+    }
 
-    // best division when nthsx and nthsx are as similar as possible
-    if (nths !=1){
-      int div = floor(nths/2);
-      while (nths%div!=0) {
-        div--;
-        }
-      nthsy = nths/div;
-      nthsx = div;
-    
-      while(nthsx%nthsy==0 && nthsx!=nthsy && nthsx>1){
-        nthsx /= 2;
-        nthsy *= 2;
-        }
+    // ---------------------------------------------
+    // stages applied at every iteration: the kernel alone or a pipeline
+    stage  single = make_stage( ktype, ksize, &kernel[0][0], knorm, maxval );
+    single.terms  = terms;
+    single.rank   = rank;
+    stage *st     = &single;
+    int    nst    = 1;
+    if ( opts.pipeline != NULL ){
+      nst = parse_pipeline( opts.pipeline, maxval, &st );
+      if ( nst < 0 ) 
+        return 0;
+      printf("Pipeline: %d fused stages\n", nst);
     }
-    else{ //if just one thread is present, there should be no division
-      nthsx = 1;
-      nthsy = 1;
+
+    // ---------------------------------------------
+    // region of interest: its blur needs the pixels within the radius of the stages, times 
+    // the iterations. Only this window of the image is read, and from now on it takes the 
+    // place of the image: beyond the borders of the image the window holds zeros as before, 
+    // while the pixels blurred wrongly along its other borders never reach the ROI.
+    // A single blur is computed on the ROI alone, iterations on the whole window, since 
+    // each of them needs the previous one on a larger region.
+    int image_xsize = xsize, image_ysize = ysize;
+    int wx0 = 0, wy0 = 0;                                    // window in the image
+    int cx0 = 0, cy0 = 0, cxsize = xsize, cysize = ysize;    // region to blur, in the window
+    unsigned char *full_raw = NULL;                          // the whole image, for --roi-full
+    if ( roi ){
+      int *r = opts.roi;
+      if ( r[0]+r[2] > xsize || r[1]+r[3] > ysize ){
+        printf("ROI %d,%d,%d,%d is outside the %dx%d image\n", r[0], r[1], r[2], r[3], xsize, ysize);
+        return 0;
+      }
+      int radius = 0;
+      for (int s=0; s<nst; s++)
+        radius += st[s].khalfsize;
+      radius *= opts.iterations;
+      wx0 = (r[0]-radius < 0)? 0 : r[0]-radius;
+      wy0 = (r[1]-radius < 0)? 0 : r[1]-radius;
+      int wxpxl = ((r[0]+r[2]+radius > xsize)? xsize : r[0]+r[2]+radius) - wx0;
+      int wypxl = ((r[1]+r[3]+radius > ysize)? ysize : r[1]+r[3]+radius) - wy0;
+
+      tt = omp_get_wtime();
+      int pixel_bytes = (1 + (maxval > 255))*nch;
+      unsigned char *window = (unsigned char*)malloc( (size_t)wxpxl*wypxl*pixel_bytes );
+      int err = 0;
+      if ( opts.roi_full ){
+        if ( tiled ){
+          full_raw = (unsigned char*)malloc( (size_t)xsize*ysize*pixel_bytes );
+          err = tiled_read_region( &timg, 0, 0, xsize, ysize, full_raw, xsize );
+        }
+        else
+          full_raw = ptr;
+        for (int y=0; y<wypxl; y++)
+          memcpy( window + (size_t)y*wxpxl*pixel_bytes, full_raw + ((size_t)(wy0+y)*xsize + wx0)*pixel_bytes, (size_t)wxpxl*pixel_bytes );
+      }
+      else if ( tiled )
+        err = tiled_read_region( &timg, wx0, wy0, wxpxl, wypxl, window, wxpxl );
+      else {
+        err = read_pgm_region( image_file, ftell(image_file), xsize, pixel_bytes, wx0, wy0, wxpxl, wypxl, window );
+        fclose( image_file );
+      }
+      if ( tiled ){
+        tiled_close( &timg );
+        tiled = 0;
+      }
+      if ( err != 0 ){
+        printf("Could not read the ROI of %s\n", input_image_name);
+        return 0;
+      }
+      trace_record( 0, "read roi", tt, omp_get_wtime() );
+      printf("ROI %dx%d at (%d,%d): window of %dx%d pixels\n", r[2], r[3], r[0], r[1], wxpxl, wypxl);
+
+      ptr    = window;
+      xsize  = cxsize = wxpxl;
+      ysize  = cysize = wypxl;
+      if ( opts.iterations == 1 && opts.pipeline == NULL ){
+        cx0    = r[0] - wx0;
+        cy0    = r[1] - wy0;
+        cxsize = r[2];
+        cysize = r[3];
+      }
     }
-  
-  
 
     // ---------------------------------------------
-    // read image
-    read_pgm_image( &ptr, &maxval, &xsize, &ysize, input_image_name);
+    //split image in sub images: one for every thread
+
+    if ( opts.nthsx*opts.nthsy != 0 && opts.nthsx*opts.nthsy != nths ){
+      printf("Invalid grid %dx%d for %d threads\n", opts.nthsx, opts.nthsy, nths);
+      return 0;
+    }
+    plan pl = plan_decomposition( nths, cxsize, cysize, khalfsize, opts.plan_kind, opts.nthsx, opts.nthsy );
+    print_plan( &pl, nths );
 
     // ---------------------------------------------
-    // find best number of pixels for the subimages
+    // find number of pixels and starting point of the subimages
+
+    int xpxl[nths], ypxl[nths];
+    int xxth[nths], yyth[nths];
+    int start_x[nths], start_y[nths];
+    size_t start_idx[nths];
+    plan_tiles( &pl, nths, cxsize, cysize, start_x, start_y, xpxl, ypxl, xxth, yyth );
+    for (int thid=0; thid<nths;thid++){
+      start_x[thid] += cx0;
+      start_y[thid] += cy0;
+      start_idx[thid] = (size_t)start_y[thid]*xsize + start_x[thid];
+    }
 
-    int xpxl[nthsx];
-    int ypxl[nthsy];
-    // x axis
-    for (int i=0; i<nthsx; i++){
-      xpxl[i] = floor(xsize/nthsx); //even division of pixels
-      if (i<xsize%nthsx) xpxl[i]++;  // homogeneous addition of extra pixels
+    // ---------------------------------------------
+    // in place: the planar image is the only copy of the image
+    if ( opts.in_place ){
+      tt = omp_get_wtime();
+      size_t plane = (size_t)xsize*ysize;
+      unsigned short int *planar = (unsigned short int*)malloc( plane*nch*sizeof(short int) );
+      int err = read_planar( image_file, (tiled)? &timg : NULL, planar, xsize, ysize, maxval, nch );
+      if ( tiled )
+        tiled_close( &timg );
+      else
+        fclose( image_file );
+      trace_record( 0, "read", tt, omp_get_wtime() );
+      if ( err != 0 ){
+        printf("Could not read %s\n", input_image_name);
+        return 0;
+      }
+      size_t buffers = blur_in_place( planar, xsize, ysize, nch, start_x, start_y, xpxl, ypxl, ksize, kernel, knorm, khalfsize );
+      printf("In place: image of %.1f MB, buffers of the threads %.2f MB\n", plane*nch*sizeof(short int)/1e6, buffers/1e6);
+      tt = omp_get_wtime();
+      write_planar( planar, maxval, xsize, ysize, nch, output_image_name );
+      trace_record( 0, "write", tt, omp_get_wtime() );
+
+      stopt = omp_get_wtime();
+      printf("Elapsed time  (opm): %f\n", stopt-startt);
+      if ( opts.trace_name != NULL )
+        trace_write( opts.trace_name );
+      free(planar);
+      free(input_image_name);
+      return 0;
     }
-    // y axis is analogous
-    for (int i=0; i<nthsy; i++){
-      ypxl[i] = floor(ysize/nthsy);
-      if (i<ysize%nthsy) ypxl[i]++;
+
+    if ( tiled ){
+      int pixel_bytes = (1 + (maxval > 255))*nch;
+      ptr = malloc( (size_t)xsize*ysize*pixel_bytes );
+      #pragma omp parallel proc_bind(close)
+      {
+        int thid  = omp_get_thread_num();
+        double tt = omp_get_wtime();
+        if ( tiled_read_region( &timg, start_x[thid], start_y[thid], xpxl[thid], ypxl[thid], (unsigned char*)ptr + (size_t)start_idx[thid]*pixel_bytes, xsize ) != 0 )
+          printf("Could not read the tiles of thread %d\n", thid);
+        trace_record( thid, "read tiles", tt, omp_get_wtime() );
+      }
+      tiled_close( &timg );
     }
     
    
@@ -479,64 +2809,106 @@ int main( int argc, char **argv )
        ------------------------------------------------------- */
     
     // ---------------------------------------------
-    // swap the endianism if necessary
-    if ( I_M_LITTLE_ENDIAN )
-      swap_image( ptr, xsize, ysize, maxval);
+    // split the channels in planes of host order samples
+    tt = omp_get_wtime();
+    size_t plane = (size_t)xsize*ysize;
+    unsigned short int *planar = (unsigned short int*)malloc( plane*nch*sizeof(short int) );
+    deinterleave_image( ptr, planar, xsize, ysize, maxval, nch );
+    free(ptr);
+    ptr = planar;
+    trace_record( 0, "deinterleave", tt, omp_get_wtime() );
     //array of pointers where partial results will be stored
     void *rptr[nths];
+    for (int thid=0; thid<nths; thid++)
+      rptr[thid] = NULL;
+    short int *final_image;  
 
-
-    // things that should be done in the parallel region but are actually done outside bc of last part
-    int xxth[nths], yyth[nths];
-    for (int thid=0; thid<nths; thid++){
-      yyth[thid] = floor(thid/nthsx);
-      xxth[thid] = thid%nthsx;
+    if ( opts.scale_space != NULL ){
+      // ---------------------------------------------
+      // levels of a gaussian scale space, written as they are computed
+      scale_space( ptr, xsize, ysize, nch, maxval, nths, &opts, output_image_name );
+      free(ptr);
+      stopt = omp_get_wtime();
+      printf("Elapsed time  (opm): %f\n", stopt-startt);
+      if ( opts.trace_name != NULL )
+        trace_write( opts.trace_name );
+      return 0;
     }
 
-    int thid = omp_get_thread_num();
-    int start_idx[nths], start_x[nths], start_y[nths];
-    
-    // ---------------------------------------------
-    // identify starting index for subimages
-    for (int thid=0; thid<nths;thid++){
-      start_idx[thid] = 0;
-      start_x[thid]   = 0;
-      start_y[thid]   = 0;
-      for (int i=0; i<xxth[thid]; i++){
-        start_x[thid] += xpxl[i];
-      }
-      for (int i=0; i<yyth[thid]; i++){
-        start_y[thid] += ypxl[i];
+    if ( ktype == 4 ){
+      // ---------------------------------------------
+      // bilateral filter: spatial sigma as the gaussian kernel, range sigma a fraction of maxval
+      final_image = bilateral_iterations( ptr, xsize, ysize, nch, start_x, start_y, xpxl, ypxl, opts.iterations, khalfsize, kfactor*maxval );
+    }
+    else if ( opts.iterations > 1 || opts.pipeline != NULL || ktype == 3 || ktype >= 5 || terms != NULL ){
+      // ---------------------------------------------
+      // iterated or fused blur, median, morphology or custom kernel, in tiles: the result is the whole image
+      final_image = blur_iterations( ptr, xsize, ysize, nch, start_x, start_y, xpxl, ypxl, opts.iterations, opts.tblock, nst, st );
+      if ( opts.pipeline != NULL ){
+        for (int s=0; s<nst; s++)
+          free(st[s].kernel);
+        free(st);
       }
-      start_y[thid] *= xsize;
-      start_idx[thid] = start_x[thid] + start_y[thid];
     }
+    else {
 
   #pragma omp parallel proc_bind(close)
   {
     int thid = omp_get_thread_num();
+    double tt = omp_get_wtime();
     // ---------------------------------------------
     // blur sub image
-    rptr[thid] = blur( ptr, xsize, ysize, start_idx[thid], start_x[thid], start_y[thid], xxth[thid], yyth[thid], xpxl[xxth[thid]], ypxl[yyth[thid]], maxval, ksize, kernel, knorm, khalfsize);
+    rptr[thid] = blur( ptr, xsize, ysize, nch, start_idx[thid], start_x[thid], start_y[thid], xxth[thid], yyth[thid], xpxl[thid], ypxl[thid], maxval, ksize, kernel, knorm, khalfsize);
+    trace_record( thid, "blur", tt, omp_get_wtime() );
   }
 
     // write the image
-    short int *final_image;  
-    final_image = (unsigned short int*)malloc( xsize*ysize* sizeof(short int) );
+    tt = omp_get_wtime();
+    final_image = (unsigned short int*)malloc( plane*nch* sizeof(short int) );
     for ( int thid = 0; thid < nths; thid++ ){
-      for ( int yy = 0; yy < ypxl[yyth[thid]]; yy++ ){
-        for ( int xx = 0; xx < xpxl[xxth[thid]]; xx++ ){
-          int idx = start_idx[thid] + yy*xsize + xx; //every row we complete we add it in the index count
-          final_image[idx]=((unsigned short int*)rptr[thid])[yy*xpxl[xxth[thid]]+xx];
+      size_t splane = (size_t)xpxl[thid]*ypxl[thid];
+      for ( int c = 0; c < nch; c++ ){
+      for ( int yy = 0; yy < ypxl[thid]; yy++ ){
+        for ( int xx = 0; xx < xpxl[thid]; xx++ ){
+          size_t idx = start_idx[thid] + (size_t)yy*xsize + xx; //every row we complete we add it in the index count
+          final_image[c*plane+idx]=((unsigned short int*)rptr[thid])[c*splane+(size_t)yy*xpxl[thid]+xx];
         }
       }
+      }
     }
+    trace_record( 0, "gather", tt, omp_get_wtime() );
+    } // end single blur
 
 
     // ---------------------------------------------
-    // swap the endianism back
-    if ( I_M_LITTLE_ENDIAN )
-      swap_image( final_image, xsize, ysize, maxval);
+    // interleave the channels back, in the byte order of the file
+    // of a ROI only the ROI is cut out of the window, and possibly pasted into the image
+    tt = omp_get_wtime();
+    int oxsize = xsize, oysize = ysize;
+    unsigned short int *out_image = (unsigned short int*)final_image;
+    if ( roi ){
+      oxsize = opts.roi[2];
+      oysize = opts.roi[3];
+      size_t oplane = (size_t)oxsize*oysize;
+      out_image = (unsigned short int*)malloc( oplane*nch*sizeof(short int) );
+      for ( int c = 0; c < nch; c++ )
+        for ( int y = 0; y < oysize; y++ )
+          memcpy( out_image + c*oplane + (size_t)y*oxsize, (unsigned short int*)final_image + c*plane + (size_t)(opts.roi[1]-wy0+y)*xsize + opts.roi[0]-wx0, oxsize*sizeof(short int) );
+    }
+    int pixel_bytes = nch*(1 + (maxval > 255));
+    unsigned char *raw_image = (unsigned char*)malloc( (size_t)oxsize*oysize*pixel_bytes );
+    interleave_image( out_image, raw_image, oxsize, oysize, maxval, nch );
+    if ( full_raw != NULL ){
+      for ( int y = 0; y < oysize; y++ )
+        memcpy( full_raw + ((size_t)(opts.roi[1]+y)*image_xsize + opts.roi[0])*pixel_bytes, raw_image + (size_t)y*oxsize*pixel_bytes, (size_t)oxsize*pixel_bytes );
+      free(raw_image);
+      raw_image = full_raw;
+      oxsize    = image_xsize;
+      oysize    = image_ysize;
+    }
+    if ( out_image != (unsigned short int*)final_image )
+      free(out_image);
+    trace_record( 0, "interleave", tt, omp_get_wtime() );
 
 
 
@@ -545,12 +2917,17 @@ int main( int argc, char **argv )
            SAVE AND FINISH
   
        ------------------------------------------------------- */
-    write_pgm_image( final_image, maxval, xsize, ysize, output_image_name);
+    tt = omp_get_wtime();
+    write_pgm_image( raw_image, maxval, oxsize, oysize, nch, output_image_name);
+    trace_record( 0, "write", tt, omp_get_wtime() );
 
     stopt = omp_get_wtime();
     printf("Elapsed time  (opm): %f\n", stopt-startt);
+    if ( opts.trace_name != NULL )
+      trace_write( opts.trace_name );
     free(ptr);
     free(final_image);
+    free(raw_image);
     free(input_image_name);
     for (int i=0; i<nths; i++)
       free(rptr[i]);
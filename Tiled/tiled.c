@@ -0,0 +1,390 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "tiled.h"
+
+
+// ============================================================================================================================================================
+// 1. compression
+//
+//  * lz_compress
+//  * lz_decompress
+//  * shuffle_bytes
+//
+// 2. tiled images
+//
+//  * tiled_is_tiled
+//  * tiled_open
+//  * tiled_read_region
+//  * tiled_close
+//  * tiled_write
+//
+// ============================================================================================================================================================
+
+
+//                               LZ COMPRESSION
+
+
+/*
+  A byte-oriented LZ77 in the style of LZ4: the data are a sequence of
+  
+    token | literal length (extra) | literals | offset | match length (extra)
+
+  where the high nibble of the token is the number of literals and the low nibble the
+  length of the match minus LZ_MINMATCH; a nibble of 15 continues in the following 
+  bytes, which are added up to the first one smaller than 255. The offset is 2 bytes, 
+  little endian, counted back from the current position. The last sequence has only 
+  literals. Matches are found through a hash table of the last position of every 
+  4-byte sequence, which trades some ratio for a single pass at memory speed.
+*/
+
+#define LZ_MINMATCH  4
+#define LZ_HASHLOG   12
+#define LZ_MAXOFFSET 65535
+
+static uint32_t read32( const unsigned char *p )
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+
+static size_t put_length( unsigned char *dst, size_t dp, size_t capacity, size_t len )
+/*
+ * writes the extra bytes of a length of 15 or more, returns the new position or 0
+ */
+{
+  for (len -= 15; len >= 255; len -= 255){
+    if (dp >= capacity) return 0;
+    dst[dp++] = 255;
+  }
+  if (dp >= capacity) return 0;
+  dst[dp++] = (unsigned char)len;
+  return dp;
+}
+
+
+size_t lz_compress( const unsigned char *src, size_t n, unsigned char *dst, size_t capacity )
+{
+  size_t table[1 << LZ_HASHLOG];   // last position + 1 of every hash, 0 = none
+  memset(table, 0, sizeof(table));
+
+  size_t ip = 0, anchor = 0, dp = 0;
+  while (n >= LZ_MINMATCH && ip + LZ_MINMATCH <= n){
+    uint32_t seq = read32(src + ip);
+    uint32_t h   = (seq*2654435761u) >> (32 - LZ_HASHLOG);
+    size_t   ref = table[h];
+    table[h] = ip + 1;
+    if (ref == 0 || ip - (ref-1) > LZ_MAXOFFSET || read32(src + ref - 1) != seq){
+      ip++;
+      continue;
+    }
+    ref--;
+
+    // extend the match
+    size_t len = LZ_MINMATCH;
+    while (ip + len < n && src[ref+len] == src[ip+len])
+      len++;
+
+    // token, literals, offset and match length
+    size_t lit = ip - anchor;
+    size_t mat = len - LZ_MINMATCH;
+    if (dp >= capacity) return 0;
+    dst[dp++] = ((lit < 15)? lit : 15) << 4 | ((mat < 15)? mat : 15);
+    if (lit >= 15 && (dp = put_length(dst, dp, capacity, lit)) == 0) return 0;
+    if (dp + lit + 2 > capacity) return 0;
+    memcpy(dst + dp, src + anchor, lit);
+    dp += lit;
+    dst[dp++] = (ip - ref) & 0xff;
+    dst[dp++] = (ip - ref) >> 8;
+    if (mat >= 15 && (dp = put_length(dst, dp, capacity, mat)) == 0) return 0;
+
+    ip    += len;
+    anchor = ip;
+  }
+
+  // last literals
+  size_t lit = n - anchor;
+  if (dp >= capacity) return 0;
+  dst[dp++] = ((lit < 15)? lit : 15) << 4;
+  if (lit >= 15 && (dp = put_length(dst, dp, capacity, lit)) == 0) return 0;
+  if (dp + lit > capacity) return 0;
+  memcpy(dst + dp, src + anchor, lit);
+  return dp + lit;
+}
+
+
+size_t lz_decompress( const unsigned char *src, size_t n, unsigned char *dst, size_t capacity )
+{
+  size_t sp = 0, dp = 0;
+  while (sp < n){
+    unsigned token = src[sp++];
+    size_t   lit   = token >> 4;
+    if (lit == 15){
+      unsigned char b;
+      do {
+        if (sp >= n) return 0;
+        b = src[sp++];
+        lit += b;
+      } while (b == 255);
+    }
+    if (sp + lit > n || dp + lit > capacity) return 0;
+    memcpy(dst + dp, src + sp, lit);
+    sp += lit;
+    dp += lit;
+    if (sp == n) break;          // the last sequence has no match
+
+    if (sp + 2 > n) return 0;
+    size_t offset = src[sp] | (src[sp+1] << 8);
+    sp += 2;
+    size_t len = token & 15;
+    if (len == 15){
+      unsigned char b;
+      do {
+        if (sp >= n) return 0;
+        b = src[sp++];
+        len += b;
+      } while (b == 255);
+    }
+    len += LZ_MINMATCH;
+    if (offset == 0 || offset > dp || dp + len > capacity) return 0;
+    // byte by byte, as the match may overlap the bytes being written
+    for (size_t i=0; i<len; i++, dp++)
+      dst[dp] = dst[dp-offset];
+  }
+  return dp;
+}
+
+
+static void shuffle_bytes( const unsigned char *src, unsigned char *dst, size_t n, int inverse )
+/*
+ * splits n bytes of 2-byte samples into the plane of the high bytes and the plane of the
+ * low bytes (or joins them back with inverse)
+ */
+{
+  size_t half = n/2;
+  for (size_t i=0; i<half; i++){
+    if (inverse){
+      dst[2*i]   = src[i];
+      dst[2*i+1] = src[half+i];
+    } else {
+      dst[i]      = src[2*i];
+      dst[half+i] = src[2*i+1];
+    }
+  }
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               TILED IMAGES
+
+
+static void put32( unsigned char *p, uint32_t v )
+{
+  for (int i=0; i<4; i++) p[i] = v >> (8*i);
+}
+
+static void put64( unsigned char *p, uint64_t v )
+{
+  for (int i=0; i<8; i++) p[i] = v >> (8*i);
+}
+
+static uint32_t get32( const unsigned char *p )
+{
+  uint32_t v = 0;
+  for (int i=0; i<4; i++) v |= (uint32_t)p[i] << (8*i);
+  return v;
+}
+
+static uint64_t get64( const unsigned char *p )
+{
+  uint64_t v = 0;
+  for (int i=0; i<8; i++) v |= (uint64_t)p[i] << (8*i);
+  return v;
+}
+
+
+int tiled_is_tiled( const char *name )
+{
+  char magic[8];
+  FILE *file = fopen(name, "rb");
+  if (file == NULL) return 0;
+  int ok = (fread(magic, 1, 8, file) == 8 && memcmp(magic, TILED_MAGIC, 8) == 0);
+  fclose(file);
+  return ok;
+}
+
+
+int tiled_open( tiled_image *img, const char *name )
+{
+  unsigned char header[TILED_HEADER];
+  img->offsets = NULL;
+  img->fd = open(name, O_RDONLY);
+  if (img->fd < 0) return -1;
+  if (pread(img->fd, header, TILED_HEADER, 0) != TILED_HEADER || memcmp(header, TILED_MAGIC, 8) != 0 || get32(header+8) != TILED_VERSION){
+    close(img->fd);
+    return -1;
+  }
+  img->xsize   = get32(header+12);
+  img->ysize   = get32(header+16);
+  img->maxval  = get32(header+20);
+  img->nch     = get32(header+24);
+  img->tile_w  = get32(header+28);
+  img->tile_h  = get32(header+32);
+  img->flags   = get32(header+36);
+  if (img->tile_w < 1 || img->tile_h < 1 || (img->nch != 1 && img->nch != 3)){
+    close(img->fd);
+    return -1;
+  }
+  img->ntilesx = (img->xsize + img->tile_w - 1)/img->tile_w;
+  img->ntilesy = (img->ysize + img->tile_h - 1)/img->tile_h;
+
+  size_t nidx = (size_t)img->ntilesx*img->ntilesy + 1;
+  unsigned char *index = (unsigned char*)malloc( nidx*8 );
+  img->offsets = (uint64_t*)malloc( nidx*sizeof(uint64_t) );
+  if (pread(img->fd, index, nidx*8, TILED_HEADER) != (ssize_t)(nidx*8)){
+    free(index);
+    tiled_close(img);
+    return -1;
+  }
+  for (size_t t=0; t<nidx; t++)
+    img->offsets[t] = get64(index + 8*t);
+  free(index);
+  return 0;
+}
+
+
+int tiled_read_region( const tiled_image *img, int x0, int y0, int w, int h, unsigned char *buf, size_t stride )
+{
+  int    depth  = 1 + (img->maxval > 255);
+  int    bpp    = depth*img->nch;
+  size_t tsize  = (size_t)img->tile_w*img->tile_h*bpp;
+  unsigned char *packed = (unsigned char*)malloc( tsize );
+  unsigned char *tile   = (unsigned char*)malloc( tsize );
+  unsigned char *work   = (unsigned char*)malloc( tsize );
+  int ret = 0;
+
+  for (int ty=y0/img->tile_h; ty<=(y0+h-1)/img->tile_h && ret==0; ty++){
+    for (int tx=x0/img->tile_w; tx<=(x0+w-1)/img->tile_w; tx++){
+      int    t   = ty*img->ntilesx + tx;
+      int    tx0 = tx*img->tile_w, ty0 = ty*img->tile_h;
+      int    tw  = (tx0+img->tile_w > img->xsize)? img->xsize-tx0 : img->tile_w;
+      int    th  = (ty0+img->tile_h > img->ysize)? img->ysize-ty0 : img->tile_h;
+      size_t raw_size = (size_t)tw*th*bpp;
+      size_t size     = img->offsets[t+1] - img->offsets[t];
+
+      // ---------------------------------------------
+      // one read for the whole tile
+      if (size > raw_size || pread(img->fd, packed, size, img->offsets[t]) != (ssize_t)size){
+        ret = -1;
+        break;
+      }
+      unsigned char *pixels = packed;
+      if (size < raw_size){
+        if (lz_decompress(packed, size, (depth == 2)? work : tile, tsize) != raw_size){
+          ret = -1;
+          break;
+        }
+        if (depth == 2)
+          shuffle_bytes(work, tile, raw_size, 1);
+        pixels = tile;
+      }
+
+      // ---------------------------------------------
+      // copy the part inside the region
+      int cx0 = (tx0 > x0)? tx0 : x0;
+      int cx1 = (tx0+tw < x0+w)? tx0+tw : x0+w;
+      int cy0 = (ty0 > y0)? ty0 : y0;
+      int cy1 = (ty0+th < y0+h)? ty0+th : y0+h;
+      for (int y=cy0; y<cy1; y++)
+        memcpy( buf + ((size_t)(y-y0)*stride + (cx0-x0))*bpp, pixels + ((size_t)(y-ty0)*tw + (cx0-tx0))*bpp, (size_t)(cx1-cx0)*bpp );
+    }
+  }
+  free(packed);
+  free(tile);
+  free(work);
+  return ret;
+}
+
+
+void tiled_close( tiled_image *img )
+{
+  close(img->fd);
+  free(img->offsets);
+  img->offsets = NULL;
+}
+
+
+int tiled_write( const char *name, const unsigned char *raw, int xsize, int ysize, int maxval, int nch, int tile_w, int tile_h, int flags )
+{
+  FILE *file = fopen(name, "wb");
+  if (file == NULL) return -1;
+
+  int    depth   = 1 + (maxval > 255);
+  int    bpp     = depth*nch;
+  int    ntilesx = (xsize + tile_w - 1)/tile_w;
+  int    ntilesy = (ysize + tile_h - 1)/tile_h;
+  size_t nidx    = (size_t)ntilesx*ntilesy + 1;
+  size_t tsize   = (size_t)tile_w*tile_h*bpp;
+
+  unsigned char header[TILED_HEADER];
+  memcpy(header, TILED_MAGIC, 8);
+  put32(header+8,  TILED_VERSION);
+  put32(header+12, xsize);
+  put32(header+16, ysize);
+  put32(header+20, maxval);
+  put32(header+24, nch);
+  put32(header+28, tile_w);
+  put32(header+32, tile_h);
+  put32(header+36, flags);
+  unsigned char *index  = (unsigned char*)calloc( nidx, 8 );
+  unsigned char *tile   = (unsigned char*)malloc( tsize );
+  unsigned char *work   = (unsigned char*)malloc( tsize );
+  unsigned char *packed = (unsigned char*)malloc( tsize );
+  fwrite(header, 1, TILED_HEADER, file);
+  fwrite(index, 8, nidx, file);          // filled at the end
+
+  uint64_t offset = TILED_HEADER + 8*nidx;
+  for (int ty=0; ty<ntilesy; ty++){
+    for (int tx=0; tx<ntilesx; tx++){
+      int tx0 = tx*tile_w, ty0 = ty*tile_h;
+      int tw  = (tx0+tile_w > xsize)? xsize-tx0 : tile_w;
+      int th  = (ty0+tile_h > ysize)? ysize-ty0 : tile_h;
+      size_t raw_size = (size_t)tw*th*bpp;
+      for (int y=0; y<th; y++)
+        memcpy( tile + (size_t)y*tw*bpp, raw + ((size_t)(ty0+y)*xsize + tx0)*bpp, (size_t)tw*bpp );
+
+      // stored as it is, unless compression makes it smaller
+      const unsigned char *out = tile;
+      size_t size = raw_size;
+      if (flags & TILED_LZ){
+        if (depth == 2)
+          shuffle_bytes(tile, work, raw_size, 0);
+        size_t packed_size = lz_compress((depth == 2)? work : tile, raw_size, packed, raw_size-1);
+        if (packed_size > 0){
+          out  = packed;
+          size = packed_size;
+        }
+      }
+      put64(index + 8*(ty*ntilesx+tx), offset);
+      fwrite(out, 1, size, file);
+      offset += size;
+    }
+  }
+  put64(index + 8*(nidx-1), offset);
+  fseek(file, TILED_HEADER, SEEK_SET);
+  fwrite(index, 8, nidx, file);
+  int ret = ferror(file)? -1 : 0;
+  fclose(file);
+  free(index);
+  free(tile);
+  free(work);
+  free(packed);
+  return ret;
+}
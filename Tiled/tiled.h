@@ -0,0 +1,70 @@
+#ifndef TILED_H
+#define TILED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+  Chunked image format: the image is stored in tiles of tile_w x tile_h pixels (smaller 
+  on the right and bottom borders), row major, each tile holding its pixels as in a PGM/PPM
+  file (interleaved channels, big endian samples when maxval > 255). A header with an 
+  index of the tile offsets allows fetching any region with one contiguous read per tile.
+
+    offset  size
+    0       8       magic "BLURTILE"
+    8       4       version (1)
+    12      4 x 7   xsize, ysize, maxval, nch, tile_w, tile_h, flags
+    40      8 x (ntiles+1)   offsets of the tiles from the start of the file, the last
+                             one being the end of the file
+    ...     tiles
+
+  All the integers are little endian. With flags & TILED_LZ, the tiles are compressed with
+  the LZ4-style compressor below, after the bytes of 2-byte samples are split in two 
+  planes (high bytes, then low bytes), which compress far better; a tile whose compressed 
+  size would not be smaller is stored as it is.
+*/
+
+#define TILED_MAGIC   "BLURTILE"
+#define TILED_VERSION 1
+#define TILED_LZ      1
+#define TILED_HEADER  40
+
+typedef struct {
+  int       fd;
+  int       xsize, ysize, maxval, nch;
+  int       tile_w, tile_h;
+  int       flags;
+  int       ntilesx, ntilesy;
+  uint64_t *offsets;
+} tiled_image;
+
+
+int  tiled_is_tiled( const char *name );
+int  tiled_open( tiled_image *img, const char *name );
+/*
+ * reads the header and the index; returns 0, or -1 if the file is not a valid tiled image
+ */
+
+int  tiled_read_region( const tiled_image *img, int x0, int y0, int w, int h, unsigned char *buf, size_t stride );
+/*
+ * reads the w x h pixels starting at (x0, y0) into buf, with rows of stride pixels, in the
+ * byte layout of a PGM/PPM file. Only the tiles overlapping the region are read, each with
+ * a single pread, so that several threads can read from the same image at the same time.
+ * Returns 0, or -1 on I/O errors.
+ */
+
+void tiled_close( tiled_image *img );
+
+int  tiled_write( const char *name, const unsigned char *raw, int xsize, int ysize, int maxval, int nch, int tile_w, int tile_h, int flags );
+/*
+ * writes the image raw (the pixels of a PGM/PPM file) as a tiled image; returns 0 or -1
+ */
+
+size_t lz_compress( const unsigned char *src, size_t n, unsigned char *dst, size_t capacity );
+size_t lz_decompress( const unsigned char *src, size_t n, unsigned char *dst, size_t capacity );
+/*
+ * return the number of bytes written to dst, or 0 if they do not fit in capacity 
+ * (or src is corrupted)
+ */
+
+#endif
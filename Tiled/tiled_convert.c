@@ -0,0 +1,229 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h> 
+#include "tiled.h"
+
+
+// ============================================================================================================================================================
+// Converter between PGM/PPM images and tiled images (see tiled.h)
+//
+//   ./tiled_convert [input-file] [output-file] {tile-size} {lz}
+//
+// A PGM/PPM input is written as a tiled image with square tiles of tile-size pixels 
+// (64 by default), compressed if the last argument is "lz"; a tiled input is written 
+// back as a PGM/PPM image.
+//
+// 1. utilities for managinf pgm files
+//
+//  * write_pgm_image
+//  * read_pgm_image
+//
+// ============================================================================================================================================================
+//  WRITE 
+
+void write_pgm_image( void *image, int maxval, int xsize, int ysize, int nch, const char *image_name)
+/*
+ * image        : a pointer to the memory region that contains the image
+ * maxval       : either 255 or 65536
+ * xsize, ysize : x and y dimensions of the image
+ * nch          : number of channels, 1 (P5, grey) or 3 (P6, RGB)
+ * image_name   : the name of the file to be written
+ *
+ */
+{
+  FILE* image_file; 
+  image_file = fopen(image_name, "w"); 
+  
+  // Writing header
+  // The header's format is as follows, all in ASCII.
+  // "whitespace" is either a blank or a TAB or a CF or a LF
+  // - The Magic Number (see below the magic numbers)
+  // - the image's width
+  // - the height
+  // - a white space
+  // - the image's height
+  // - a whitespace
+  // - the maximum color value, which must be between 0 and 65535
+  //
+  //
+
+  int color_depth = 1 + ( maxval > 255 );
+
+  fprintf(image_file, "P%d\n# generated by\n# M. Danese \n%d %d\n%d\n", (nch==3)? 6 : 5, xsize, ysize, maxval);
+  
+  // Writing file
+  fwrite( image, 1, (size_t)xsize*ysize*color_depth*nch, image_file);  
+
+  fclose(image_file); 
+  return ;
+
+  /* ---------------------------------------------------------------
+
+     TYPE    MAGIC NUM     EXTENSION   COLOR RANGE
+           ASCII  BINARY
+
+     PBM   P1     P4       .pbm        [0-1]
+     PGM   P2     P5       .pgm        [0-255]
+     PPM   P3     P6       .ppm        [0-2^16[
+  
+  ------------------------------------------------------------------ */
+}
+
+
+// ============================================================================================================================================================
+
+
+//                               READ PGM
+
+
+void read_pgm_image( void **image, int *maxval, int *xsize, int *ysize, int *nch, const char *image_name)
+/*
+ * image        : a pointer to the pointer that will contain the image
+ * maxval       : a pointer to the int that will store the maximum intensity in the image
+ * xsize, ysize : pointers to the x and y sizes
+ * nch          : a pointer to the number of channels, 1 for P5 and 3 for P6 images
+ * image_name   : the name of the file to be read
+ *
+ */
+{
+  FILE* image_file; 
+  image_file = fopen(image_name, "r"); 
+
+  *image = NULL;
+  *xsize = *ysize = *maxval = 0;
+  
+  char    MagicN[3];
+  char   *line = NULL;
+  size_t  k, n = 0;
+
+    
+  /* --------------------------------------------------------------- */
+
+
+  // get the Magic Number - first element
+  k = fscanf(image_file, "%2s%*c", MagicN );
+  *nch = (strcmp(MagicN, "P6") == 0)? 3 : 1;
+
+
+    
+  /* --------------------------------------------------------------- */
+
+
+  // skip all the comments
+  k = getline( &line, &n, image_file);
+  while ( (k > 0) && (line[0]=='#') )
+    k = getline( &line, &n, image_file);
+
+    
+  /* --------------------------------------------------------------- */
+
+
+  if (k > 0)
+    {
+      k = sscanf(line, "%d%*c%d%*c%d%*c", xsize, ysize, maxval);
+      if ( k < 3 )
+	if(fscanf(image_file, "%d%*c", maxval)!=1){
+	  printf("no maxval was provided\n");
+	  return;
+	}
+    }
+  // in the case I am givning some bad input
+  else
+    {
+      *maxval = -1;         // this is the signal that there was an I/O error
+			    // while reading the image header
+      free( line );
+      return;
+    }
+  free( line );
+  
+
+    
+  /* --------------------------------------------------------------- */
+
+
+  int color_depth = 1 + ( *maxval > 255 );
+  size_t size = (size_t)*xsize * *ysize * color_depth * *nch;
+  
+  if ( (*image = (char*)malloc( size )) == NULL )
+    {
+      fclose(image_file);
+      *maxval = -2;         // this is the signal that memory was insufficient
+      *xsize  = 0;
+      *ysize  = 0;
+      return;
+    }
+  
+  if ( fread( *image, 1, size, image_file) != size )
+    {
+      free( image );
+      image   = NULL;
+      *maxval = -3;         // this is the signal that there was an i/o error
+      *xsize  = 0;
+      *ysize  = 0;
+    }  
+
+  fclose(image_file);
+  return;
+}
+
+
+// ============================================================================================================================================================
+
+
+//                               MAIN
+
+
+int main( int argc, char **argv )
+{
+  if ( argc < 3 ){
+    printf("usage: %s [input-file] [output-file] {tile-size} {lz}\n", argv[0]);
+    return 0;
+  }
+  int tile  = ( argc > 3 )? atoi(argv[3]) : 64;
+  int flags = ( argc > 4 && strcmp(argv[4], "lz") == 0 )? TILED_LZ : 0;
+  if ( tile < 1 ){
+    printf("Invalid tile size\n");
+    return 0;
+  }
+
+  if ( tiled_is_tiled(argv[1]) ){
+    // ---------------------------------------------
+    // tiled -> PGM/PPM
+    tiled_image img;
+    if ( tiled_open(&img, argv[1]) != 0 ){
+      printf("Invalid tiled image %s\n", argv[1]);
+      return 0;
+    }
+    unsigned char *raw = (unsigned char*)malloc( (size_t)img.xsize*img.ysize*img.nch*(1 + (img.maxval > 255)) );
+    if ( tiled_read_region(&img, 0, 0, img.xsize, img.ysize, raw, img.xsize) != 0 )
+      printf("Could not read %s\n", argv[1]);
+    else
+      write_pgm_image( raw, img.maxval, img.xsize, img.ysize, img.nch, argv[2] );
+    printf("%dx%d pixels, %d channels, tiles of %dx%d pixels%s\n", img.xsize, img.ysize, img.nch, img.tile_w, img.tile_h, (img.flags & TILED_LZ)? ", compressed" : "");
+    tiled_close(&img);
+    free(raw);
+  }
+  else {
+    // ---------------------------------------------
+    // PGM/PPM -> tiled
+    void *raw;
+    int   xsize, ysize, maxval, nch;
+    read_pgm_image( &raw, &maxval, &xsize, &ysize, &nch, argv[1] );
+    if ( maxval <= 0 ){
+      printf("Could not read %s\n", argv[1]);
+      return 0;
+    }
+    if ( tiled_write( argv[2], raw, xsize, ysize, maxval, nch, tile, tile, flags ) != 0 )
+      printf("Could not write %s\n", argv[2]);
+    else {
+      FILE *file = fopen(argv[2], "rb");
+      fseek(file, 0, SEEK_END);
+      long size = ftell(file);
+      fclose(file);
+      printf("%dx%d pixels, %d channels, tiles of %dx%d pixels: %ld bytes (%.1f%% of the pixels)\n", xsize, ysize, nch, tile, tile, size, 100.*size/((double)xsize*ysize*nch*(1 + (maxval > 255))));
+    }
+    free(raw);
+  }
+  return 0;
+}
@@ -0,0 +1,844 @@
+#include <string.h>
+#include <omp.h>
+#include <stdlib.h>
+#include <stdio.h> 
+#include <math.h>
+#include "blur.h"
+
+
+// ============================================================================================================================================================
+// In-memory blur library (see blur.h): the kernel, the decomposition planner and the 
+// padded blur are those of the OpenMP code, kept private to the library.
+//
+// 1. kernel and blur
+//
+//  * build_kernel
+//  * blur_padded
+//
+// 2. domain decomposition
+//
+//  * plan_tiles
+//  * plan_cost
+//  * plan_rows
+//  * plan_decomposition
+//
+// 3. plan and execute
+//
+//  * plan_create
+//  * blur_plan_create
+//  * blur_tile
+//  * blur_execute
+//  * disjoint_rects
+//  * blur_execute_dirty
+//  * blur_plan_destroy
+//  * blur_plan_strategy
+//  * blur_plan_print
+//
+// 4. auto-tuning
+//
+//  * cpu_model
+//  * wisdom_key
+//  * wisdom_load
+//  * wisdom_store
+//  * time_plan
+//  * blur_plan_create_tuned
+//
+// ============================================================================================================================================================
+
+
+//                               KERNEL
+
+
+static float build_kernel( int ktype, int ksize, float kfactor, float *kernel )
+/*
+ * fills the ksize x ksize kernel (row major) of type ktype and returns its normalisation
+ */
+{
+  float knorm = 0;
+  int khalfsize = (ksize-1)/2;
+
+  if (ktype==0) {
+  // ---------------------------------------------
+  // average kernel
+    for (int i=0; i<ksize*ksize;i++){
+      kernel[i]=1;
+      knorm += kernel[i];
+    }
+  }
+  else if (ktype==1) {
+  // ---------------------------------------------
+  // weight kernel
+    for (int i=0; i<ksize*ksize;i++){
+      kernel[i]=1-kfactor;
+    }
+    knorm = (ksize*ksize-1);
+    kernel[khalfsize*ksize+khalfsize]=kfactor*(ksize*ksize-1);
+  }
+  else if (ktype==2) {
+  // ---------------------------------------------
+  // gaussian kernel
+    float kden  = 1./(2.*khalfsize*khalfsize);
+    for (int i=0; i<ksize;i++){
+      float ky=i-khalfsize;
+      for (int j=0; j<ksize;j++){
+        float kx=j-khalfsize;
+        kernel[i*ksize+j]=expf( -((kx*kx)+(ky*ky))*kden );
+        knorm += kernel[i*ksize+j];
+      }
+    }
+  }
+  return knorm;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               BLUR PADDED REGION
+
+
+static void blur_padded( unsigned short int *image, int istride, unsigned short int *out, int ostride, int xpxl, int ypxl, int ksize, float kernel[ksize][ksize], float knorm, int khalfsize )
+/*
+  image points to the first pixel of a region of xpxl x ypxl pixels (rows of istride 
+  pixels) surrounded by an apron of at least khalfsize pixels on every side, with zeros 
+  outside the image, so that no border check is needed inside the kernel loops. 
+  The result is stored in out (rows of ostride pixels).
+ */
+{
+  for ( int yy = 0; yy < ypxl; yy++ ){
+    for( int xx = 0; xx < xpxl; xx++ ){
+      unsigned short int *center = image + (long)yy*istride + xx;
+      double xxyy = 0;
+      for (int yks=-khalfsize; yks<khalfsize+1; yks++){
+        unsigned short int *row = center + (long)yks*istride;
+        for (int xks=-khalfsize; xks<khalfsize+1; xks++)
+          xxyy += kernel[khalfsize+yks][khalfsize+xks]*row[xks];
+      }
+      out[(long)yy*ostride+xx] = round(xxyy/knorm);
+    }
+  }
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               DECOMPOSITION PLANNER
+
+
+/*
+  Same planner of the OpenMP code: the image is divided among the nths threads in a grid,
+  in row strips or in rows holding different numbers of sub-images (uneven), choosing the
+  plan with the lowest cost of the slowest thread, compute plus halo.
+*/
+
+#define PLAN_GRID   0
+#define PLAN_STRIPS 1
+#define PLAN_UNEVEN 2
+#define HALO_COST   1.0    // cost of reading a pixel of another sub-image, in kernel taps
+
+static const char *plan_names[3] = {"grid", "strips", "uneven"};
+
+typedef struct {
+  int    kind;                // PLAN_GRID, PLAN_STRIPS or PLAN_UNEVEN
+  int    nthsx, nthsy;        // divisions along x and y (for uneven plans nthsx is the longest row)
+  double cost;                // max over the threads of compute + halo
+  double compute;             // mean compute per thread
+  double imbalance;           // cost - mean cost per thread
+  double halo;                // total number of halo pixels
+} plan;
+
+
+static void plan_tiles( plan *pl, int nths, int xsize, int ysize, int *start_x, int *start_y, int *xpxl, int *ypxl )
+/*
+ * fills, for every thread, the starting point and the number of pixels of its sub-image
+ */
+{
+  int nrows = pl->nthsy;
+  int thid  = 0;
+  int done  = 0;  // sub-images in the rows above the current one
+  for (int row=0; row<nrows; row++){
+    int ncols = pl->nthsx;
+    int y0, y1;
+    if (pl->kind == PLAN_UNEVEN){
+      ncols = nths/nrows + (row < nths%nrows);
+      y0 = (int)(((long)ysize*done)/nths);
+      y1 = (int)(((long)ysize*(done+ncols))/nths);
+    } else {
+      y0 = row*(ysize/nrows) + ((row <= ysize%nrows)? row : ysize%nrows);
+      y1 = y0 + ysize/nrows + (row < ysize%nrows);
+    }
+    for (int col=0; col<ncols; col++, thid++){
+      xpxl[thid]    = xsize/ncols + (col < xsize%ncols);
+      start_x[thid] = col*(xsize/ncols) + ((col <= xsize%ncols)? col : xsize%ncols);
+      ypxl[thid]    = y1 - y0;
+      start_y[thid] = y0;
+    }
+    done += ncols;
+  }
+}
+
+
+static void plan_cost( plan *pl, int nths, int xsize, int ysize, int khalfsize )
+{
+  int ksize = 2*khalfsize+1;
+  int start_x[nths], start_y[nths], xpxl[nths], ypxl[nths];
+  plan_tiles( pl, nths, xsize, ysize, start_x, start_y, xpxl, ypxl );
+
+  double sum = 0;
+  pl->cost = pl->compute = pl->halo = 0;
+  for (int thid=0; thid<nths; thid++){
+    // the halo is not needed on the borders of the image
+    int left  = (start_x[thid] > 0)?                    khalfsize : 0;
+    int right = (start_x[thid]+xpxl[thid] < xsize)?     khalfsize : 0;
+    int up    = (start_y[thid] > 0)?                    khalfsize : 0;
+    int down  = (start_y[thid]+ypxl[thid] < ysize)?     khalfsize : 0;
+    double halo    = (double)(xpxl[thid]+left+right)*(ypxl[thid]+up+down) - (double)xpxl[thid]*ypxl[thid];
+    double compute = (double)xpxl[thid]*ypxl[thid]*ksize*ksize;
+    double cost    = compute + HALO_COST*halo;
+
+    if (cost > pl->cost) pl->cost = cost;
+    pl->compute += compute/nths;
+    pl->halo    += halo;
+    sum         += cost;
+  }
+  pl->imbalance = pl->cost - sum/nths;
+}
+
+
+static plan plan_rows( int nths, int ny )
+/*
+ * the plan with ny rows of sub-images
+ */
+{
+  plan pl;
+  pl.nthsy = ny;
+  if (nths%ny == 0){
+    pl.kind  = (ny == nths && nths > 1)? PLAN_STRIPS : PLAN_GRID;
+    pl.nthsx = nths/ny;
+  } else {
+    pl.kind  = PLAN_UNEVEN;
+    pl.nthsx = nths/ny + 1;
+  }
+  return pl;
+}
+
+
+static plan plan_decomposition( int nths, int xsize, int ysize, int khalfsize )
+/*
+ * returns the cheapest plan
+ */
+{
+  plan best, pl;
+  best.cost = -1;
+
+  for (int ny=1; ny<=nths; ny++){
+    if (ny > ysize) break;
+    // regular grids (including the 1 x nths strips) when ny divides nths, uneven otherwise
+    pl = plan_rows( nths, ny );
+    if (pl.nthsx > xsize) continue;
+    plan_cost( &pl, nths, xsize, ysize, khalfsize );
+    if (best.cost < 0 || pl.cost < best.cost) best = pl;
+  }
+  return best;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               PLAN AND EXECUTE
+
+
+/*
+  Every thread blurs its sub-image in tiles: the tile plus an apron of khalfsize pixels is
+  loaded from the caller's buffer (zeros outside the image) into a private work buffer of
+  unsigned short, blurred by blur_padded into a second one and stored into the caller's 
+  output. When the padded sub-images of all the threads fit in TB_CACHE bytes the whole 
+  sub-image is a single tile (BLUR_SUBIMAGE), otherwise the tiles are the largest square
+  fitting there (BLUR_TILES). The work buffers are allocated once, by the plan.
+*/
+
+#define TB_CACHE    (256*1024)   // bytes of cache available to each thread (L2)
+#define TUNE_NEW    1            // tuned by blur_plan_create_tuned
+#define TUNE_WISDOM 2            // read from the wisdom file by blur_plan_create_tuned
+
+struct blur_plan {
+  int    ktype, ksize, khalfsize;
+  float  kfactor;
+  float *kernel;
+  float  knorm;
+  int    xsize, ysize;
+  int    pixel_type;
+  int    nths;
+  plan   pl;                     // decomposition among the threads
+  int   *start_x, *start_y;      // sub-image of every thread
+  int   *xpxl, *ypxl;
+  int    strategy;
+  int    tuned;                  // 0, or where threads, decomposition and tiles come from (see TUNE_*)
+  int    tilex, tiley;           // largest tile
+  size_t worksize;               // pixels of work memory per thread
+  unsigned short int *work;
+};
+
+
+static blur_plan * plan_create( int ktype, int ksize, float kfactor, int xsize, int ysize, int pixel_type, int nths, int nthsy, int tile_size )
+/*
+ * nthsy    : rows of sub-images of the decomposition, 0 = chosen by the planner
+ * tile_size: side of the tiles, 0 = chosen by the strategy
+ */
+{
+  if (ktype < 0 || ktype > 2 || ksize < 1 || ksize%2 == 0 || xsize < 1 || ysize < 1 ||
+      (pixel_type != BLUR_U8 && pixel_type != BLUR_U16) || nths < 0 ||
+      (ktype == 1 && (kfactor < 0 || kfactor > 1)))
+    return NULL;
+  if (nths == 0)
+    nths = omp_get_max_threads();
+
+  blur_plan *p = (blur_plan*)calloc( 1, sizeof(blur_plan) );
+  if (p == NULL)
+    return NULL;
+  p->ktype      = ktype;
+  p->ksize      = ksize;
+  p->khalfsize  = (ksize-1)/2;
+  p->kfactor    = kfactor;
+  p->xsize      = xsize;
+  p->ysize      = ysize;
+  p->pixel_type = pixel_type;
+  p->nths       = (nths > (long)xsize*ysize)? (int)((long)xsize*ysize) : nths;
+
+  // ---------------------------------------------
+  // kernel and decomposition
+  p->kernel  = (float*)malloc( ksize*ksize*sizeof(float) );
+  p->start_x = (int*)malloc( p->nths*sizeof(int) );
+  p->start_y = (int*)malloc( p->nths*sizeof(int) );
+  p->xpxl    = (int*)malloc( p->nths*sizeof(int) );
+  p->ypxl    = (int*)malloc( p->nths*sizeof(int) );
+  if (p->kernel == NULL || p->start_x == NULL || p->start_y == NULL || p->xpxl == NULL || p->ypxl == NULL){
+    blur_plan_destroy( p );
+    return NULL;
+  }
+  p->knorm = build_kernel( ktype, ksize, kfactor, p->kernel );
+  if (nthsy > 0 && nthsy <= p->nths && nthsy <= ysize && plan_rows( p->nths, nthsy ).nthsx <= xsize){
+    p->pl = plan_rows( p->nths, nthsy );
+    plan_cost( &p->pl, p->nths, xsize, ysize, p->khalfsize );
+  }
+  else
+    p->pl = plan_decomposition( p->nths, xsize, ysize, p->khalfsize );
+  plan_tiles( &p->pl, p->nths, xsize, ysize, p->start_x, p->start_y, p->xpxl, p->ypxl );
+
+  // ---------------------------------------------
+  // strategy: whole sub-images if they fit in cache
+  int maxx = 0, maxy = 0;
+  for (int thid=0; thid<p->nths; thid++){
+    if (p->xpxl[thid] > maxx) maxx = p->xpxl[thid];
+    if (p->ypxl[thid] > maxy) maxy = p->ypxl[thid];
+  }
+  int h    = p->khalfsize;
+  int tile = (int)sqrt(TB_CACHE/(2.*sizeof(short int))) - 2*h;
+  if (tile < 16) tile = 16;
+  if (tile_size > 0)
+    tile = tile_size;
+  if ((tile_size <= 0 && (double)(maxx+2*h)*(maxy+2*h) + (double)maxx*maxy <= TB_CACHE/sizeof(short int)) ||
+      (tile_size > 0 && tile >= maxx && tile >= maxy)){
+    p->strategy = BLUR_SUBIMAGE;
+    p->tilex    = maxx;
+    p->tiley    = maxy;
+  } else {
+    p->strategy = BLUR_TILES;
+    p->tilex    = (tile < maxx)? tile : maxx;
+    p->tiley    = (tile < maxy)? tile : maxy;
+  }
+
+  // the padded input tile and the output tile of every thread
+  p->worksize = (size_t)(p->tilex+2*h)*(p->tiley+2*h) + (size_t)p->tilex*p->tiley;
+  p->work     = (unsigned short int*)malloc( p->worksize*p->nths*sizeof(short int) );
+  if (p->work == NULL){
+    blur_plan_destroy( p );
+    return NULL;
+  }
+  return p;
+}
+
+
+blur_plan * blur_plan_create( int ktype, int ksize, float kfactor, int xsize, int ysize, int pixel_type, int nths )
+{
+  return plan_create( ktype, ksize, kfactor, xsize, ysize, pixel_type, nths, 0, 0 );
+}
+
+
+static void blur_tile( const blur_plan *p, const void *in, size_t in_stride, void *out, size_t out_stride, int tx, int ty, int txpxl, int typxl, unsigned short int *tin, unsigned short int *tout )
+/*
+ * blurs the txpxl x typxl tile starting at (tx, ty), at most tilex x tiley pixels, using 
+ * the work buffers tin and tout of a thread
+ */
+{
+  int h       = p->khalfsize;
+  int ksize   = p->ksize;
+  int xstride = txpxl + 2*h;
+
+  // ---------------------------------------------
+  // load the tile and its apron, zeros outside the image
+  memset(tin, 0, (size_t)xstride*(typxl+2*h)*sizeof(short int));
+  int x0 = (tx-h < 0)? 0 : tx-h;
+  int x1 = (tx+txpxl+h > p->xsize)? p->xsize : tx+txpxl+h;
+  for (int y=ty-h; y<ty+typxl+h; y++){
+    if (y < 0 || y >= p->ysize) continue;
+    unsigned short int *dst = tin + (size_t)(y-ty+h)*xstride + (x0-tx+h);
+    if (p->pixel_type == BLUR_U16)
+      memcpy( dst, (const unsigned short int*)in + y*in_stride + x0, (x1-x0)*sizeof(short int) );
+    else {
+      const unsigned char *src = (const unsigned char*)in + y*in_stride + x0;
+      for (int x=0; x<x1-x0; x++) dst[x] = src[x];
+    }
+  }
+
+  // ---------------------------------------------
+  // blur and store
+  blur_padded( tin + h*xstride + h, xstride, tout, txpxl, txpxl, typxl, ksize, (float (*)[ksize])p->kernel, p->knorm, h );
+  for (int y=0; y<typxl; y++){
+    if (p->pixel_type == BLUR_U16)
+      memcpy( (unsigned short int*)out + (ty+y)*out_stride + tx, tout + (size_t)y*txpxl, txpxl*sizeof(short int) );
+    else {
+      unsigned char *dst = (unsigned char*)out + (ty+y)*out_stride + tx;
+      for (int x=0; x<txpxl; x++) dst[x] = tout[(size_t)y*txpxl+x];
+    }
+  }
+}
+
+
+int blur_execute( const blur_plan *p, const void *in, size_t in_stride, void *out, size_t out_stride )
+{
+  if (p == NULL || in == NULL || out == NULL || in_stride < (size_t)p->xsize || out_stride < (size_t)p->xsize)
+    return -1;
+
+  int h = p->khalfsize;
+
+  #pragma omp parallel num_threads(p->nths) proc_bind(close)
+  {
+    // fewer threads than planned may be granted: the sub-images are then shared out
+    int nthreads = omp_get_num_threads();
+    int mythid   = omp_get_thread_num();
+    unsigned short int *tin  = p->work + mythid*p->worksize;
+    unsigned short int *tout = tin + (size_t)(p->tilex+2*h)*(p->tiley+2*h);
+
+    for (int thid=mythid; thid<p->nths; thid+=nthreads){
+      for (int ty=p->start_y[thid]; ty<p->start_y[thid]+p->ypxl[thid]; ty+=p->tiley){
+        for (int tx=p->start_x[thid]; tx<p->start_x[thid]+p->xpxl[thid]; tx+=p->tilex){
+          int txpxl = (tx+p->tilex > p->start_x[thid]+p->xpxl[thid])? p->start_x[thid]+p->xpxl[thid]-tx : p->tilex;
+          int typxl = (ty+p->tiley > p->start_y[thid]+p->ypxl[thid])? p->start_y[thid]+p->ypxl[thid]-ty : p->tiley;
+          blur_tile( p, in, in_stride, out, out_stride, tx, ty, txpxl, typxl, tin, tout );
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               INCREMENTAL BLUR
+
+
+/*
+  When only a few rectangles of the input change, only the output pixels within khalfsize 
+  of them change as well. They are recomputed from the new input exactly as blur_execute 
+  would, so that the result is the same as blurring the whole image again.
+  The grown rectangles may overlap: they are first turned into disjoint ones, cutting the 
+  image into horizontal bands at their top and bottom edges and merging, in every band, 
+  the intervals of the rectangles crossing it; a piece equal to one of the band above is 
+  joined to it. The pieces are then cut into tiles of the plan, which the threads take 
+  dynamically.
+*/
+
+static int compare_ints( const void *a, const void *b )
+{
+  return *(const int*)a - *(const int*)b;
+}
+
+
+static int disjoint_rects( const blur_plan *p, const blur_rect *dirty, int ndirty, blur_rect **pieces )
+/*
+ * returns in pieces (allocated here) the disjoint rectangles covering the dirty ones grown 
+ * by khalfsize and clipped to the image, and their number (-1 if memory is insufficient)
+ */
+{
+  int h = p->khalfsize;
+  blur_rect *grown = (blur_rect*)malloc( ndirty*sizeof(blur_rect) + 1 );
+  int       *ys    = (int*)malloc( 2*ndirty*sizeof(int) + 1 );
+  int       *xs    = (int*)malloc( 2*ndirty*sizeof(int) + 1 );
+  int        npieces = 0, maxpieces = 4*ndirty + 4;
+  *pieces = (blur_rect*)malloc( maxpieces*sizeof(blur_rect) );
+  if (grown == NULL || ys == NULL || xs == NULL || *pieces == NULL){
+    free(grown); free(ys); free(xs); free(*pieces);
+    return -1;
+  }
+
+  // grown and clipped rectangles, as [x, x+w) x [y, y+h)
+  int ngrown = 0, nys = 0;
+  for (int i=0; i<ndirty; i++){
+    int x0 = (dirty[i].x-h < 0)? 0 : dirty[i].x-h;
+    int y0 = (dirty[i].y-h < 0)? 0 : dirty[i].y-h;
+    int x1 = ((long)dirty[i].x+dirty[i].w+h > p->xsize)? p->xsize : dirty[i].x+dirty[i].w+h;
+    int y1 = ((long)dirty[i].y+dirty[i].h+h > p->ysize)? p->ysize : dirty[i].y+dirty[i].h+h;
+    if (dirty[i].w <= 0 || dirty[i].h <= 0 || x0 >= x1 || y0 >= y1) continue;
+    grown[ngrown++] = (blur_rect){x0, y0, x1-x0, y1-y0};
+    ys[nys++] = y0;
+    ys[nys++] = y1;
+  }
+  qsort( ys, nys, sizeof(int), compare_ints );
+
+  int cand_first = 0, cand_last = 0;    // pieces that may end on top of the band
+  for (int k=0; k+1<nys; k++){
+    int y0 = ys[k], y1 = ys[k+1];
+    if (y0 == y1) continue;
+
+    // intervals of the rectangles crossing the band, as pairs (x0, x1) sorted by x0
+    int nxs = 0;
+    for (int i=0; i<ngrown; i++)
+      if (grown[i].y <= y0 && grown[i].y+grown[i].h >= y1){
+        xs[nxs++] = grown[i].x;
+        xs[nxs++] = grown[i].x+grown[i].w;
+      }
+    qsort( xs, nxs/2, 2*sizeof(int), compare_ints );
+
+    int touched = npieces;                // lowest piece ending at the bottom of the band
+    for (int j=0; j<nxs; ){
+      int x0 = xs[j], x1 = xs[j+1];
+      for (j+=2; j<nxs && xs[j] <= x1; j+=2)
+        if (xs[j+1] > x1) x1 = xs[j+1];
+
+      // the same interval in the band just above: extend that piece
+      int joined = 0;
+      for (int q=cand_first; q<cand_last && !joined; q++)
+        if ((*pieces)[q].x == x0 && (*pieces)[q].w == x1-x0 && (*pieces)[q].y+(*pieces)[q].h == y0){
+          (*pieces)[q].h += y1-y0;
+          if (q < touched) touched = q;
+          joined = 1;
+        }
+      if (joined) continue;
+      if (npieces == maxpieces){
+        maxpieces *= 2;
+        blur_rect *more = (blur_rect*)realloc( *pieces, maxpieces*sizeof(blur_rect) );
+        if (more == NULL){
+          free(grown); free(ys); free(xs); free(*pieces);
+          return -1;
+        }
+        *pieces = more;
+      }
+      (*pieces)[npieces++] = (blur_rect){x0, y0, x1-x0, y1-y0};
+    }
+    cand_first = touched;
+    cand_last  = npieces;
+  }
+  free(grown);
+  free(ys);
+  free(xs);
+  return npieces;
+}
+
+
+int blur_execute_dirty( const blur_plan *p, const void *in, size_t in_stride, void *out, size_t out_stride, const blur_rect *dirty, int ndirty )
+{
+  if (p == NULL || in == NULL || out == NULL || in_stride < (size_t)p->xsize || out_stride < (size_t)p->xsize || ndirty < 0 || (ndirty > 0 && dirty == NULL))
+    return -1;
+
+  blur_rect *pieces;
+  int npieces = disjoint_rects( p, dirty, ndirty, &pieces );
+  if (npieces < 0)
+    return -1;
+
+  // tiles of every piece, numbered continuously
+  int *first_tile = (int*)malloc( (npieces+1)*sizeof(int) );
+  if (first_tile == NULL){
+    free(pieces);
+    return -1;
+  }
+  first_tile[0] = 0;
+  for (int i=0; i<npieces; i++)
+    first_tile[i+1] = first_tile[i] + ((pieces[i].w+p->tilex-1)/p->tilex)*((pieces[i].h+p->tiley-1)/p->tiley);
+  int ntiles = first_tile[npieces];
+  int h      = p->khalfsize;
+
+  #pragma omp parallel num_threads(p->nths) proc_bind(close) if(ntiles > 1)
+  {
+    int mythid = omp_get_thread_num();
+    unsigned short int *tin  = p->work + mythid*p->worksize;
+    unsigned short int *tout = tin + (size_t)(p->tilex+2*h)*(p->tiley+2*h);
+    int i = 0;
+
+    #pragma omp for schedule(dynamic)
+    for (int t=0; t<ntiles; t++){
+      while (first_tile[i+1] <= t) i++;
+      while (first_tile[i] > t) i--;
+      int ntx   = (pieces[i].w+p->tilex-1)/p->tilex;
+      int tx    = pieces[i].x + ((t-first_tile[i])%ntx)*p->tilex;
+      int ty    = pieces[i].y + ((t-first_tile[i])/ntx)*p->tiley;
+      int txpxl = (tx+p->tilex > pieces[i].x+pieces[i].w)? pieces[i].x+pieces[i].w-tx : p->tilex;
+      int typxl = (ty+p->tiley > pieces[i].y+pieces[i].h)? pieces[i].y+pieces[i].h-ty : p->tiley;
+      blur_tile( p, in, in_stride, out, out_stride, tx, ty, txpxl, typxl, tin, tout );
+    }
+  }
+  free(first_tile);
+  free(pieces);
+  return 0;
+}
+
+
+
+// ============================================================================================================================================================
+
+
+void blur_plan_destroy( blur_plan *p )
+{
+  if (p == NULL)
+    return;
+  free(p->kernel);
+  free(p->start_x);
+  free(p->start_y);
+  free(p->xpxl);
+  free(p->ypxl);
+  free(p->work);
+  free(p);
+}
+
+
+int blur_plan_strategy( const blur_plan *p )
+{
+  return p->strategy;
+}
+
+
+void blur_plan_print( const blur_plan *p )
+{
+  const char *knames[3] = {"average", "weighted", "gaussian"};
+  printf("Blur plan: %s kernel %dx%d, image %dx%d of %d-byte pixels, %d threads\n", knames[p->ktype], p->ksize, p->ksize, p->xsize, p->ysize, p->pixel_type, p->nths);
+  if (p->pl.kind == PLAN_UNEVEN)
+    printf("Decomposition: %s, %d rows of %d-%d sub-images", plan_names[p->pl.kind], p->pl.nthsy, p->nths/p->pl.nthsy, p->pl.nthsx);
+  else
+    printf("Decomposition: %s %dx%d", plan_names[p->pl.kind], p->pl.nthsx, p->pl.nthsy);
+  printf(" (cost %.4g taps: compute %.4g, imbalance %.4g, halo %.0f pixels)\n", p->pl.cost, p->pl.compute, p->pl.imbalance, p->pl.halo);
+  printf("Strategy: %s, tiles of %dx%d pixels\n", (p->strategy == BLUR_SUBIMAGE)? "sub-image" : "tiles", p->tilex, p->tiley);
+  if (p->tuned)
+    printf("Threads, decomposition and tiles %s\n", (p->tuned == TUNE_WISDOM)? "from the wisdom file" : "tuned on this machine");
+}
+
+
+
+// ============================================================================================================================================================
+
+
+//                               AUTO-TUNING
+
+
+/*
+  The planner and the strategy follow a model, and the number of threads is given by the
+  caller: the fastest choice on a given machine may differ. blur_plan_create_tuned times 
+  the candidates instead, one parameter after the other, on an image of the size of the 
+  plan (whose content does not matter to the time of the direct blur):
+
+    1. the number of threads: powers of two up to the available threads, and these
+    2. the rows of sub-images, for the best number of threads: the divisors of it, and 
+       the choice of the planner
+    3. the tiles: automatic, squares of tune_tiles pixels, or whole sub-images
+
+  Each candidate is executed once to warm up and timed as the best of TUNE_RUNS runs.
+  The winner is appended to the wisdom file, a text file with one tab-separated line per 
+  key: CPU model, ktype, ksize bucket, image-size bucket, then threads, rows and tile side
+  (0 for automatic). Buckets are powers of two, of ksize and of the number of pixels, so 
+  that later plans of similar kernels and images find it and skip the tuning; the last 
+  line of a key wins, so tuning again overrides it.
+*/
+
+#define TUNE_RUNS   2
+#define TUNE_WHOLE  (1<<30)      // tile side standing for the whole sub-image
+
+static const int tune_tiles[] = {0, 32, 64, 128, 256, TUNE_WHOLE};
+
+
+static void cpu_model( char *model, int size )
+/*
+ * the "model name" of /proc/cpuinfo, or "unknown"
+ */
+{
+  char  line[256];
+  FILE *info = fopen("/proc/cpuinfo", "r");
+  snprintf( model, size, "unknown" );
+  if (info == NULL)
+    return;
+  while (fgets( line, sizeof(line), info ) != NULL)
+    if (strncmp( line, "model name", 10 ) == 0){
+      char *value = strchr( line, ':' );
+      if (value != NULL){
+        value += 1 + (value[1] == ' ');
+        value[strcspn( value, "\t\n" )] = '\0';
+        snprintf( model, size, "%s", value );
+      }
+      break;
+    }
+  fclose(info);
+}
+
+
+static int bucket( long n )
+/*
+ * floor(log2(n))
+ */
+{
+  int b = 0;
+  while (n > 1){
+    n >>= 1;
+    b++;
+  }
+  return b;
+}
+
+
+static void wisdom_key( int ktype, int ksize, int xsize, int ysize, char *key, int size )
+{
+  char model[128];
+  cpu_model( model, sizeof(model) );
+  snprintf( key, size, "%s\t%d\t%d\t%d", model, ktype, bucket(ksize), bucket((long)xsize*ysize) );
+}
+
+
+static int wisdom_load( const char *wisdom_name, const char *key, int *nths, int *nthsy, int *tile )
+/*
+ * looks for the key in the wisdom file: returns 1 and the parameters if found, 0 otherwise
+ */
+{
+  FILE *wisdom = fopen(wisdom_name, "r");
+  if (wisdom == NULL)
+    return 0;
+  char line[512];
+  int  found = 0;
+  size_t klen = strlen(key);
+  while (fgets( line, sizeof(line), wisdom ) != NULL){
+    if (line[0] == '#' || strncmp( line, key, klen ) != 0 || line[klen] != '\t')
+      continue;
+    if (sscanf( line+klen+1, "%d\t%d\t%d", nths, nthsy, tile ) == 3)
+      found = 1;
+  }
+  fclose(wisdom);
+  return found;
+}
+
+
+static void wisdom_store( const char *wisdom_name, const char *key, int nths, int nthsy, int tile, double time )
+{
+  FILE *wisdom = fopen(wisdom_name, "a");
+  if (wisdom == NULL)
+    return;
+  if (ftell(wisdom) == 0)
+    fprintf(wisdom, "# blur wisdom: cpu\tktype\tksize bucket\tsize bucket\tthreads\trows\ttile\tseconds\n");
+  fprintf(wisdom, "%s\t%d\t%d\t%d\t%.6f\n", key, nths, nthsy, tile, time);
+  fclose(wisdom);
+}
+
+
+static double time_plan( int ktype, int ksize, float kfactor, int xsize, int ysize, int pixel_type, int nths, int nthsy, int tile, const void *in, void *out )
+/*
+ * best time of TUNE_RUNS executions, after a first one to warm up; -1 if the plan fails
+ */
+{
+  blur_plan *p = plan_create( ktype, ksize, kfactor, xsize, ysize, pixel_type, nths, nthsy, tile );
+  if (p == NULL)
+    return -1;
+  double best = -1;
+  blur_execute( p, in, xsize, out, xsize );
+  for (int r=0; r<TUNE_RUNS; r++){
+    double t = omp_get_wtime();
+    blur_execute( p, in, xsize, out, xsize );
+    t = omp_get_wtime() - t;
+    if (best < 0 || t < best) best = t;
+  }
+  blur_plan_destroy( p );
+  return best;
+}
+
+
+blur_plan * blur_plan_create_tuned( int ktype, int ksize, float kfactor, int xsize, int ysize, int pixel_type, const char *wisdom_name )
+{
+  if (wisdom_name == NULL)
+    wisdom_name = (getenv("BLUR_WISDOM") != NULL)? getenv("BLUR_WISDOM") : "blur.wisdom";
+  int maxths = omp_get_max_threads();
+  char key[256];
+  wisdom_key( ktype, ksize, xsize, ysize, key, sizeof(key) );
+
+  // ---------------------------------------------
+  // known on this machine
+  int nths, nthsy, tile;
+  if (wisdom_load( wisdom_name, key, &nths, &nthsy, &tile ) && nths >= 1 && nths <= maxths){
+    blur_plan *p = plan_create( ktype, ksize, kfactor, xsize, ysize, pixel_type, nths, nthsy, tile );
+    if (p != NULL)
+      p->tuned = TUNE_WISDOM;
+    return p;
+  }
+
+  // ---------------------------------------------
+  // tuning, on an image of random pixels
+  blur_plan *check = blur_plan_create( ktype, ksize, kfactor, xsize, ysize, pixel_type, 1 );
+  if (check == NULL)
+    return NULL;
+  blur_plan_destroy( check );
+  size_t bytes = (size_t)xsize*ysize*pixel_type;
+  unsigned char *in  = (unsigned char*)malloc( bytes );
+  unsigned char *out = (unsigned char*)malloc( bytes );
+  if (in == NULL || out == NULL){
+    free(in);
+    free(out);
+    return NULL;
+  }
+  unsigned int seed = 12345;
+  for (size_t i=0; i<bytes; i++){
+    seed = seed*1103515245 + 12345;
+    in[i] = seed >> 16;
+  }
+
+  double best = -1, t;
+  int best_nths = maxths, best_nthsy = 0, best_tile = 0;
+
+  // 1. threads
+  for (int n=1; ; n=(2*n < maxths)? 2*n : maxths){
+    t = time_plan( ktype, ksize, kfactor, xsize, ysize, pixel_type, n, 0, 0, in, out );
+    if (t >= 0 && (best < 0 || t < best)){
+      best      = t;
+      best_nths = n;
+    }
+    if (n == maxths) break;
+  }
+
+  // 2. rows of sub-images
+  int planned = plan_decomposition( best_nths, xsize, ysize, (ksize-1)/2 ).nthsy;
+  for (int ny=1; ny<=best_nths; ny++){
+    if (ny == planned || best_nths%ny != 0) continue;
+    t = time_plan( ktype, ksize, kfactor, xsize, ysize, pixel_type, best_nths, ny, 0, in, out );
+    if (t >= 0 && t < best){
+      best       = t;
+      best_nthsy = ny;
+    }
+  }
+
+  // 3. tiles
+  for (int k=1; k<(int)(sizeof(tune_tiles)/sizeof(int)); k++){
+    t = time_plan( ktype, ksize, kfactor, xsize, ysize, pixel_type, best_nths, best_nthsy, tune_tiles[k], in, out );
+    if (t >= 0 && t < best){
+      best      = t;
+      best_tile = tune_tiles[k];
+    }
+  }
+  free(in);
+  free(out);
+
+  wisdom_store( wisdom_name, key, best_nths, best_nthsy, best_tile, best );
+  blur_plan *p = plan_create( ktype, ksize, kfactor, xsize, ysize, pixel_type, best_nths, best_nthsy, best_tile );
+  if (p != NULL)
+    p->tuned = TUNE_NEW;
+  return p;
+}
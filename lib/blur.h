@@ -0,0 +1,83 @@
+#ifndef BLUR_H
+#define BLUR_H
+
+#include <stddef.h>
+
+/*
+  In-memory blur library, with a plan/execute interface.
+
+  A plan fixes everything that does not change from one image to the next: the kernel
+  (type, size and kfactor, with the same meaning of the command line of the blur codes),
+  the image dimensions, the pixel type and the number of threads. Creating it builds the
+  kernel, chooses the decomposition among the threads and the strategy, and allocates
+  all the work memory, so that the execution can then run as many times as needed on 
+  buffers owned by the caller, with no allocation and no file I/O:
+
+    blur_plan *p = blur_plan_create( BLUR_GAUSSIAN, 5, 0, xsize, ysize, BLUR_U16, 0 );
+    for (each frame)
+      blur_execute( p, frame, xsize, blurred, xsize );
+    blur_plan_destroy( p );
+
+  Pixels outside the image count as zero, as in the blur codes.
+*/
+
+// kernel types
+#define BLUR_AVERAGE    0
+#define BLUR_WEIGHTED   1     // the central pixel weights kfactor, the others share 1-kfactor
+#define BLUR_GAUSSIAN   2
+
+// pixel types, in the host byte order
+#define BLUR_U8         1     // unsigned char
+#define BLUR_U16        2     // unsigned short int
+
+// strategies
+#define BLUR_SUBIMAGE   0     // every thread blurs its whole sub-image at once
+#define BLUR_TILES      1     // every thread walks its sub-image in cache-sized tiles
+
+typedef struct blur_plan blur_plan;
+
+typedef struct {
+  int x, y;             // first column and row
+  int w, h;             // width and height, in pixels
+} blur_rect;
+
+
+blur_plan * blur_plan_create( int ktype, int ksize, float kfactor, int xsize, int ysize, int pixel_type, int nths );
+/*
+ * returns a new plan, or NULL if the parameters are not valid (or memory is insufficient).
+ * ksize must be odd; nths = 0 uses the default number of OpenMP threads.
+ */
+
+blur_plan * blur_plan_create_tuned( int ktype, int ksize, float kfactor, int xsize, int ysize, int pixel_type, const char *wisdom_name );
+/*
+ * as blur_plan_create, but the number of threads, the decomposition and the tiles are the
+ * fastest measured on this machine. They are looked up in the wisdom file wisdom_name (NULL
+ * = $BLUR_WISDOM, or "blur.wisdom") by CPU model, kernel type and the powers of two of ksize
+ * and of the image size; if missing, they are tuned by timing candidate plans (which takes
+ * a few hundred executions) and appended to the file.
+ */
+
+int blur_execute( const blur_plan *plan, const void *in, size_t in_stride, void *out, size_t out_stride );
+/*
+ * blurs the image in into out, both of the size and pixel type of the plan, with rows of
+ * in_stride and out_stride pixels respectively (>= xsize). in and out must not overlap.
+ * Returns 0, or -1 if the arguments are not valid.
+ * Executions of the same plan must not run concurrently, as they share its work memory.
+ */
+
+int blur_execute_dirty( const blur_plan *plan, const void *in, size_t in_stride, void *out, size_t out_stride, const blur_rect *dirty, int ndirty );
+/*
+ * incremental blur: out holds the blur of a previous version of in, which differs from the
+ * current one only inside the ndirty rectangles (parts outside the image are ignored). 
+ * Only the output pixels within khalfsize of them are recomputed from in, in parallel, and
+ * patched into out, which then equals the result of blur_execute on the current in. The
+ * previous input is not needed. The work is proportional to the area of the grown rectangles.
+ * Returns 0, or -1 if the arguments are not valid (or memory is insufficient).
+ */
+
+void blur_plan_destroy( blur_plan *plan );
+
+int  blur_plan_strategy( const blur_plan *plan );
+void blur_plan_print( const blur_plan *plan );
+
+#endif